@@ -0,0 +1,372 @@
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+// Добавляет копию строки в конец динамического массива строк
+int appendString(char ***list, int *count, char *value)
+{
+    char **grown = (char **)realloc(*list, sizeof(char *) * (*count + 1));
+    if (grown == NULL)
+    {
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    *list = grown;
+    char *copy = strdup(value);
+    if (copy == NULL)
+    {
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    grown[(*count)++] = copy;
+    return 0;
+}
+
+typedef struct BatchJob
+{
+    char *input;
+    char *output;
+    int code;
+} BatchJob;
+
+// Очередь заданий одного рабочего потока: владелец берёт задания с начала,
+// освободившиеся потоки крадут их с конца чужих очередей
+typedef struct WorkQueue
+{
+    pthread_mutex_t lock;
+    int *jobs;
+    int head;
+    int tail;
+} WorkQueue;
+
+typedef struct BatchScheduler
+{
+    WorkQueue *queues;
+    int count;
+    BatchJob *jobs;
+    ProcessOptions *options;
+    BatchReport report;
+    pthread_mutex_t report_lock;
+} BatchScheduler;
+
+typedef struct BatchWorker
+{
+    BatchScheduler *scheduler;
+    int index;
+} BatchWorker;
+
+static int takeJob(WorkQueue *queue, int steal)
+{
+    int job = -1;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail)
+    {
+        job = steal ? queue->jobs[--queue->tail] : queue->jobs[queue->head++];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+static int peekJob(WorkQueue *queue)
+{
+    int job = -1;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail)
+    {
+        job = queue->jobs[queue->head];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+// Просит ядро заранее прочитать файл в page cache, пока обрабатывается текущий
+static void prefetchFile(char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+static void *batchWorker(void *arg)
+{
+    BatchWorker *worker = arg;
+    BatchScheduler *scheduler = worker->scheduler;
+    WorkQueue *own = &scheduler->queues[worker->index];
+
+    // у каждого потока своё изображение, буфер которого переходит от файла к файлу
+    BMP image;
+    initBMP(&image, scheduler->options->allocator);
+    for (;;)
+    {
+        int job = takeJob(own, 0);
+        for (int i = 1; job < 0 && i < scheduler->count; i++)
+        {
+            job = takeJob(&scheduler->queues[(worker->index + i) % scheduler->count], 1);
+        }
+        if (job < 0)
+        {
+            // новые задания не появляются, значит все очереди пусты
+            freeBMP(&image);
+            return NULL;
+        }
+
+        int next = peekJob(own);
+        if (next >= 0)
+        {
+            prefetchFile(scheduler->jobs[next].input);
+        }
+
+        // статистика собирается по каждому файлу отдельно и складывается в общую
+        BmpStats stats;
+        ProcessOptions options = *scheduler->options;
+        if (options.stats != NULL)
+        {
+            initStats(&stats);
+            options.stats = &stats;
+        }
+
+        BatchJob *current = &scheduler->jobs[job];
+        current->code = processFile(&image, current->input, current->output, &options);
+        pthread_mutex_lock(&scheduler->report_lock);
+        if (scheduler->report != NULL)
+        {
+            scheduler->report(current->input, current->code, current->code != 0 ? lastError() : NULL);
+        }
+        if (options.stats != NULL)
+        {
+            mergeStats(scheduler->options->stats, &stats);
+        }
+        pthread_mutex_unlock(&scheduler->report_lock);
+    }
+}
+
+static int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int hasBmpExtension(const char *name)
+{
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(name + length - 4, ".bmp") == 0;
+}
+
+static void freeStrings(char **list, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        free(list[i]);
+    }
+    free(list);
+}
+
+// Список входных файлов: все *.bmp каталога или строки файла-списка
+static int collectBatchFiles(char *source, char ***files, int *count)
+{
+    struct stat st;
+    if (stat(source, &st) != 0)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+
+    *files = NULL;
+    *count = 0;
+    if (S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(source);
+        if (dir == NULL)
+        {
+            return setError(FILE_READ_ERROR, "Error: file reading error");
+        }
+        int code = 0;
+        struct dirent *entry;
+        while (code == 0 && (entry = readdir(dir)) != NULL)
+        {
+            if (!hasBmpExtension(entry->d_name))
+            {
+                continue;
+            }
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+            code = appendString(files, count, path);
+        }
+        closedir(dir);
+        if (*count > 0)
+        {
+            qsort(*files, *count, sizeof(char *), compareNames);
+        }
+        return code;
+    }
+
+    FILE *f = fopen(source, "r");
+    if (!f)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+    int code = 0;
+    char line[PATH_MAX];
+    while (code == 0 && fgets(line, sizeof(line), f) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0')
+        {
+            code = appendString(files, count, line);
+        }
+    }
+    fclose(f);
+    return code;
+}
+
+// Два файла списка не должны писаться в один выходной файл: при --output-dir
+// это одинаковые имена из разных каталогов (a/img.bmp и b/img.bmp), без него -
+// повтор файла. Такие задачи шли бы параллельно, и результат был бы случайным
+static int checkOutputNames(BatchJob *jobs, int count)
+{
+    char **names = (char **)malloc(sizeof(char *) * (count ? count : 1));
+    if (names == NULL)
+    {
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    for (int i = 0; i < count; i++)
+    {
+        names[i] = jobs[i].output;
+    }
+    qsort(names, count, sizeof(char *), compareNames);
+    int code = 0;
+    for (int i = 1; i < count && code == 0; i++)
+    {
+        if (strcmp(names[i - 1], names[i]) == 0)
+        {
+            code = setError(WRONG_ARGUMENTS_ERROR, "Error: several batch files would be written to %s", names[i]);
+        }
+    }
+    free(names);
+    return code;
+}
+
+// Пакетная обработка: одни и те же операции применяются к каждому файлу,
+// результат каждого файла передаётся в report, ошибка в одном файле не
+// останавливает остальные. Возвращает код первой ошибки по порядку файлов
+int runBatch(char *source, char *output_dir, int threads, ProcessOptions *options, BatchReport report)
+{
+    char **files = NULL;
+    int count = 0;
+    int code = collectBatchFiles(source, &files, &count);
+    if (code != 0)
+    {
+        freeStrings(files, count);
+        return code;
+    }
+    if (output_dir != NULL && mkdir(output_dir, 0777) != 0 && errno != EEXIST)
+    {
+        freeStrings(files, count);
+        return setError(FILE_WRITE_ERROR, "Error: can not create output directory");
+    }
+
+    int workers = threads < count ? threads : count;
+    if (workers < 1)
+    {
+        workers = 1;
+    }
+    BatchJob *jobs = (BatchJob *)calloc(count ? count : 1, sizeof(BatchJob));
+    int *order = (int *)malloc(sizeof(int) * (count ? count : 1));
+    WorkQueue *queues = (WorkQueue *)malloc(sizeof(WorkQueue) * workers);
+    pthread_t *handles = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+    int *started = (int *)calloc(workers, sizeof(int));
+    BatchWorker *worker_args = (BatchWorker *)malloc(sizeof(BatchWorker) * workers);
+    if (jobs == NULL || order == NULL || queues == NULL || handles == NULL || started == NULL || worker_args == NULL)
+    {
+        code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+
+    for (int i = 0; code == 0 && i < count; i++)
+    {
+        char path[PATH_MAX];
+        if (output_dir != NULL)
+        {
+            char *name = strdup(files[i]);
+            snprintf(path, sizeof(path), "%s/%s", output_dir, name != NULL ? basename(name) : files[i]);
+            free(name);
+        }
+        else
+        {
+            snprintf(path, sizeof(path), "%s", files[i]);
+        }
+        jobs[i].input = files[i];
+        jobs[i].output = strdup(path);
+        if (jobs[i].output == NULL)
+        {
+            code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+        }
+        order[i] = i;
+    }
+    if (code == 0)
+    {
+        code = checkOutputNames(jobs, count);
+    }
+
+    if (code == 0)
+    {
+        // сначала каждый поток получает свой непрерывный кусок списка
+        BatchScheduler scheduler = {queues, workers, jobs, options, report};
+        pthread_mutex_init(&scheduler.report_lock, NULL);
+        for (int i = 0; i < workers; i++)
+        {
+            pthread_mutex_init(&queues[i].lock, NULL);
+            queues[i].jobs = order;
+            queues[i].head = (long)count * i / workers;
+            queues[i].tail = (long)count * (i + 1) / workers;
+        }
+        for (int i = 0; i < workers; i++)
+        {
+            worker_args[i].scheduler = &scheduler;
+            worker_args[i].index = i;
+        }
+        // если поток не запустился, его очередь разберут остальные
+        for (int i = 1; i < workers; i++)
+        {
+            started[i] = pthread_create(&handles[i], NULL, batchWorker, &worker_args[i]) == 0;
+        }
+        batchWorker(&worker_args[0]);
+        for (int i = 1; i < workers; i++)
+        {
+            if (started[i])
+            {
+                pthread_join(handles[i], NULL);
+            }
+        }
+        for (int i = 0; i < workers; i++)
+        {
+            pthread_mutex_destroy(&queues[i].lock);
+        }
+        pthread_mutex_destroy(&scheduler.report_lock);
+
+        for (int i = 0; i < count && code == 0; i++)
+        {
+            code = jobs[i].code;
+        }
+    }
+
+    for (int i = 0; jobs != NULL && i < count; i++)
+    {
+        free(jobs[i].output);
+    }
+    freeStrings(files, count);
+    free(worker_args);
+    free(started);
+    free(handles);
+    free(queues);
+    free(order);
+    free(jobs);
+    return code;
+}
@@ -0,0 +1,448 @@
+#include "bmp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+// Бенчмарк: генерирует детерминированные 24-битные BMP нескольких размеров,
+// замеряет загрузку, сохранение и операции, печатает пропускную способность,
+// пишет результаты в JSON и сравнивает их с сохранённой базовой линией
+
+typedef struct BenchSize
+{
+    const char *name;
+    unsigned int width;
+    unsigned int height;
+} BenchSize;
+
+static const BenchSize sizes[] = {
+    {"small", 640, 480},
+    {"odd", 1001, 997}, // ширина не кратна 4: строки с выравниванием
+    {"4k", 3840, 2160},
+    {"odd4k", 4097, 2161},
+    {"16k", 15360, 8640},
+};
+
+typedef struct BenchResult
+{
+    char name[96];
+    double seconds; // лучшее время из всех повторов
+    double mpix_s;
+    double gb_s;
+} BenchResult;
+
+static BenchResult results[256];
+static int result_count = 0;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void record(const char *size, const char *name, double seconds, BMP *bmp)
+{
+    if (result_count == sizeof(results) / sizeof(results[0]))
+    {
+        return;
+    }
+    BenchResult *r = &results[result_count++];
+    snprintf(r->name, sizeof(r->name), "%s/%s", size, name);
+    double pixels = (double)bmp->bmih.width * bmp->bmih.height;
+    double bytes = (double)bmp->stride * bmp->bmih.height;
+    r->seconds = seconds;
+    r->mpix_s = seconds > 0 ? pixels / seconds / 1e6 : 0;
+    r->gb_s = seconds > 0 ? bytes / seconds / 1e9 : 0;
+    printf("%-32s %10.3f ms %10.1f MPix/s %8.2f GB/s\n", r->name, seconds * 1e3, r->mpix_s, r->gb_s);
+}
+
+static int generateBMP(const char *filename, unsigned int width, unsigned int height)
+{
+    BMP bmp;
+    initBMP(&bmp, NULL);
+    memset(&bmp.bmfh, 0, sizeof(bmp.bmfh));
+    memset(&bmp.bmih, 0, sizeof(bmp.bmih));
+    bmp.stride = rowStride(width, sizeof(Rgb));
+    bmp.bmfh.signature = 0x4d42;
+    bmp.bmfh.pixelArrOffset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+    bmp.bmfh.filesize = bmp.bmfh.pixelArrOffset + bmp.stride * height;
+    bmp.bmih.headerSize = sizeof(BitmapInfoHeader);
+    bmp.bmih.width = width;
+    bmp.bmih.height = height;
+    bmp.bmih.planes = 1;
+    bmp.bmih.bitsPerPixel = 24;
+    bmp.bmih.imageSize = bmp.stride * height;
+    bmp.bmih.xPixelsPerMeter = 2835;
+    bmp.bmih.yPixelsPerMeter = 2835;
+
+    int code = allocPixels(&bmp, height);
+    if (code != 0)
+    {
+        return code;
+    }
+    bmp.rows = height;
+
+    // xorshift с фиксированным зерном: одинаковые файлы на каждом запуске
+    uint32_t state = 2463534242u;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        unsigned char *row = (unsigned char *)getRow(&bmp, y);
+        for (size_t i = 0; i < (size_t)width * sizeof(Rgb); i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            row[i] = state >> 24;
+        }
+        memset(row + (size_t)width * sizeof(Rgb), 0, bmp.stride - (size_t)width * sizeof(Rgb));
+    }
+    code = writeBMP((char *)filename, &bmp);
+    freeBMP(&bmp);
+    return code;
+}
+
+// Разбирает операцию в синтаксисе командной строки cw
+static int buildBenchOperation(BMP *bmp, char **argv, Operation *op)
+{
+    OperationArgs args;
+    initOperationArgs(&args);
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        int opt = argv[i][1];
+        char *value = NULL;
+        if (strchr("ONVxyTCrP", opt) != NULL)
+        {
+            value = argv[++i];
+        }
+        setOperationArg(&args, opt, value);
+    }
+    return buildOperation(bmp, &args, op);
+}
+
+typedef struct BenchOperation
+{
+    const char *name;
+    char *argv[16];
+} BenchOperation;
+
+static BenchOperation operations[] = {
+    {"rgbFilter", {"-f", "-N", "green", "-V", "128", NULL}},
+    {"lut_gamma", {"-Y", "gamma=2.2", NULL}},
+    {"circle_thin", {"-c", "-O", "CENTER", "-r", "RADIUS", "-T", "1", "-C", "255.0.0", NULL}},
+    {"circle_thick", {"-c", "-O", "CENTER", "-r", "RADIUS", "-T", "THICK", "-C", "255.0.0", NULL}},
+    {"circle_filled", {"-c", "-O", "CENTER", "-r", "RADIUS", "-T", "3", "-C", "255.0.0", "-F", "-P", "0.0.255", NULL}},
+    {"circle_off_edge", {"-c", "-O", "EDGE", "-r", "RADIUS", "-T", "9", "-C", "255.0.0", "-F", "-P", "0.0.255", NULL}},
+    {"dividePicture", {"-s", "-x", "8", "-y", "6", "-T", "4", "-C", "0.0.0", NULL}},
+};
+
+static double timeOperation(ThreadPool *pool, BMP *bmp, BenchOperation *bench, int repeat, int *code)
+{
+    // подставляем геометрию, зависящую от размера изображения
+    char center[32], edge[32], radius[16], thick[16];
+    snprintf(center, sizeof(center), "%u.%u", bmp->bmih.width / 2, bmp->bmih.height / 2);
+    snprintf(edge, sizeof(edge), "%u.%u", bmp->bmih.width, bmp->bmih.height / 3);
+    unsigned int min_side = bmp->bmih.width < bmp->bmih.height ? bmp->bmih.width : bmp->bmih.height;
+    snprintf(radius, sizeof(radius), "%u", min_side / 3 > 0 ? min_side / 3 : 1);
+    snprintf(thick, sizeof(thick), "%u", min_side / 10 > 0 ? min_side / 10 : 1);
+
+    char *argv[16];
+    for (int i = 0; i < 16; i++)
+    {
+        char *arg = bench->argv[i];
+        if (arg != NULL && strcmp(arg, "CENTER") == 0)
+            arg = center;
+        else if (arg != NULL && strcmp(arg, "EDGE") == 0)
+            arg = edge;
+        else if (arg != NULL && strcmp(arg, "RADIUS") == 0)
+            arg = radius;
+        else if (arg != NULL && strcmp(arg, "THICK") == 0)
+            arg = thick;
+        argv[i] = arg;
+        if (arg == NULL)
+        {
+            break;
+        }
+    }
+
+    Operation op;
+    *code = buildBenchOperation(bmp, argv, &op);
+    if (*code != 0)
+    {
+        return 0;
+    }
+    OperationList list = {&op, 1};
+    double best = -1;
+    for (int i = 0; i < repeat; i++)
+    {
+        double start = now();
+        runOperation(pool, bmp, applyOperations, &list);
+        double elapsed = now() - start;
+        if (best < 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+static int benchSize(const BenchSize *size, const char *dir, int repeat, int *thread_counts, int thread_count_len)
+{
+    char input[4096], output[4096];
+    snprintf(input, sizeof(input), "%s/bench_%s.bmp", dir, size->name);
+    snprintf(output, sizeof(output), "%s/bench_%s_out.bmp", dir, size->name);
+    int code = generateBMP(input, size->width, size->height);
+    if (code != 0)
+    {
+        return code;
+    }
+
+    BMP bmp;
+    initBMP(&bmp, NULL);
+    double best = -1;
+    for (int i = 0; i < repeat && code == 0; i++)
+    {
+        double start = now();
+        code = readBMP(input, &bmp);
+        double elapsed = now() - start;
+        if (best < 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+    if (code == 0)
+    {
+        record(size->name, "readBMP", best, &bmp);
+    }
+
+    best = -1;
+    for (int i = 0; i < repeat && code == 0; i++)
+    {
+        double start = now();
+        code = writeBMP(output, &bmp);
+        double elapsed = now() - start;
+        if (best < 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+    if (code == 0)
+    {
+        record(size->name, "writeBMP", best, &bmp);
+    }
+
+    for (int t = 0; t < thread_count_len && code == 0; t++)
+    {
+        ThreadPool pool;
+        code = createPool(&pool, thread_counts[t]);
+        for (size_t i = 0; i < sizeof(operations) / sizeof(operations[0]) && code == 0; i++)
+        {
+            double seconds = timeOperation(&pool, &bmp, &operations[i], repeat, &code);
+            if (code == 0)
+            {
+                char name[64];
+                snprintf(name, sizeof(name), "%s/t%d", operations[i].name, thread_counts[t]);
+                record(size->name, name, seconds, &bmp);
+            }
+        }
+        destroyPool(&pool);
+    }
+
+    freeBMP(&bmp);
+    unlink(input);
+    unlink(output);
+    return code;
+}
+
+static int writeJson(const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (!f)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    fprintf(f, "[\n");
+    for (int i = 0; i < result_count; i++)
+    {
+        fprintf(f, "{\"name\": \"%s\", \"seconds\": %.9f, \"mpix_s\": %.3f, \"gb_s\": %.4f}%s\n",
+                results[i].name, results[i].seconds, results[i].mpix_s, results[i].gb_s, i + 1 < result_count ? "," : "");
+    }
+    fprintf(f, "]\n");
+    fclose(f);
+    return 0;
+}
+
+// Сравнивает с базовой линией в том же формате; возвращает число регрессий
+static int compareBaseline(const char *filename, double threshold)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f)
+    {
+        printf("Error: can not read baseline %s\n", filename);
+        return -1;
+    }
+    int regressions = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char name[96];
+        double seconds, mpix_s, gb_s;
+        if (sscanf(line, "{\"name\": \"%95[^\"]\", \"seconds\": %lf, \"mpix_s\": %lf, \"gb_s\": %lf", name, &seconds, &mpix_s, &gb_s) != 4)
+        {
+            continue;
+        }
+        for (int i = 0; i < result_count; i++)
+        {
+            if (strcmp(results[i].name, name) != 0 || mpix_s <= 0)
+            {
+                continue;
+            }
+            double change = (results[i].mpix_s - mpix_s) / mpix_s * 100.0;
+            if (change < -threshold)
+            {
+                printf("REGRESSION %-32s %10.1f -> %10.1f MPix/s (%+.1f%%)\n", name, mpix_s, results[i].mpix_s, change);
+                regressions++;
+            }
+        }
+    }
+    fclose(f);
+    return regressions;
+}
+
+static void printBenchHelp()
+{
+    printf("Benchmark for the BMP tool\n");
+    printf("Throughput is counted over the whole image, so drawing results are comparable only with the same sizes\n\n");
+    printf("-s, --sizes <list>: Comma separated image sizes: small, odd, 4k, odd4k, 16k (default: small,odd,4k,odd4k)\n");
+    printf("-r, --repeat <number>: Number of runs per measurement, the best one is reported (default: 5)\n");
+    printf("-t, --threads <list>: Comma separated thread counts for the operations (default: 1 and the number of processors)\n");
+    printf("-d, --dir <directory>: Directory for the generated images (default: /tmp)\n");
+    printf("-j, --json <filename>: Write results as JSON\n");
+    printf("-b, --baseline <filename>: Compare results with a JSON file written by --json\n");
+    printf("-R, --threshold <percent>: Slowdown that counts as a regression (default: 10)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char *size_list = "small,odd,4k,odd4k";
+    char *thread_list = NULL;
+    char *dir = "/tmp";
+    char *json = NULL;
+    char *baseline = NULL;
+    double threshold = 10.0;
+    int repeat = 5;
+
+    const struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"sizes", required_argument, 0, 's'},
+        {"repeat", required_argument, 0, 'r'},
+        {"threads", required_argument, 0, 't'},
+        {"dir", required_argument, 0, 'd'},
+        {"json", required_argument, 0, 'j'},
+        {"baseline", required_argument, 0, 'b'},
+        {"threshold", required_argument, 0, 'R'},
+        {0, 0, 0, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hs:r:t:d:j:b:R:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            size_list = optarg;
+            break;
+        case 'r':
+            repeat = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 't':
+            thread_list = optarg;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'j':
+            json = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'R':
+            threshold = atof(optarg);
+            break;
+        case 'h':
+            printBenchHelp();
+            return 0;
+        default:
+            printBenchHelp();
+            return OPTION_ERROR;
+        }
+    }
+
+    int thread_counts[64];
+    int thread_count_len = 0;
+    if (thread_list == NULL)
+    {
+        // по умолчанию сравниваем один поток со всеми процессорами
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_counts[thread_count_len++] = 1;
+        if (cpus > 1)
+        {
+            thread_counts[thread_count_len++] = cpus < 64 ? cpus : 64;
+        }
+        thread_list = "";
+    }
+    char *threads_copy = strdup(thread_list);
+    char *save = NULL;
+    for (char *token = strtok_r(threads_copy, ",", &save); token != NULL && thread_count_len < 64; token = strtok_r(NULL, ",", &save))
+    {
+        thread_counts[thread_count_len++] = atoi(token) > 0 ? atoi(token) : 1;
+    }
+    free(threads_copy);
+
+    char *sizes_copy = strdup(size_list);
+    for (char *token = strtok_r(sizes_copy, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+        const BenchSize *size = NULL;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        {
+            if (strcmp(sizes[i].name, token) == 0)
+            {
+                size = &sizes[i];
+            }
+        }
+        if (size == NULL)
+        {
+            printf("Error: unknown size \"%s\"\n", token);
+            free(sizes_copy);
+            return WRONG_ARGUMENTS_ERROR;
+        }
+        int code = benchSize(size, dir, repeat, thread_counts, thread_count_len);
+        if (code != 0)
+        {
+            printf("%s\n", lastError());
+            free(sizes_copy);
+            return code;
+        }
+    }
+    free(sizes_copy);
+
+    if (json != NULL && writeJson(json) != 0)
+    {
+        printf("%s\n", lastError());
+        return FILE_WRITE_ERROR;
+    }
+    if (baseline != NULL)
+    {
+        int regressions = compareBaseline(baseline, threshold);
+        if (regressions != 0)
+        {
+            printf("%d regression(s) over %.1f%%\n", regressions < 0 ? 0 : regressions, threshold);
+            return EXIT_FAILURE;
+        }
+        printf("No regressions over %.1f%%\n", threshold);
+    }
+    return 0;
+}
@@ -0,0 +1,581 @@
+// copy_file_range
+#define _GNU_SOURCE
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Сообщение о последней ошибке в текущем потоке; функции, которые могут
+// завершиться неудачно, возвращают код ошибки (0 - успех) через setError
+static __thread char last_error[256];
+
+int setError(int code, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(last_error, sizeof(last_error), format, args);
+    va_end(args);
+    return code;
+}
+
+const char *lastError()
+{
+    return last_error;
+}
+
+static void *defaultAlloc(size_t size, size_t alignment, void *user)
+{
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, alignment, size) != 0)
+    {
+        return NULL;
+    }
+    return ptr;
+}
+
+static void defaultFree(void *ptr, void *user)
+{
+    free(ptr);
+}
+
+static const BmpAllocator default_allocator = {defaultAlloc, defaultFree, NULL};
+
+void initBMP(BMP *bmp, const BmpAllocator *allocator)
+{
+    memset(bmp, 0, sizeof(*bmp));
+    bmp->pixel_bytes = sizeof(Rgb);
+    bmp->allocator = allocator != NULL ? allocator : &default_allocator;
+}
+
+// Снимает отображение файла, но оставляет собственный буфер для следующей загрузки
+void closeBMP(BMP *bmp)
+{
+    if (bmp->map != NULL)
+    {
+        munmap(bmp->map, bmp->map_size);
+        bmp->map = NULL;
+        bmp->map_size = 0;
+    }
+    if (bmp->header_extra != NULL)
+    {
+        bmp->allocator->free(bmp->header_extra, bmp->allocator->user);
+        bmp->header_extra = NULL;
+        bmp->header_extra_size = 0;
+    }
+    free(bmp->rle);
+    bmp->rle = NULL;
+    bmp->pixels = NULL;
+    bmp->rows = 0;
+}
+
+void freeBMP(BMP *bmp)
+{
+    closeBMP(bmp);
+    if (bmp->buffer != NULL)
+    {
+        bmp->allocator->free(bmp->buffer, bmp->allocator->user);
+        bmp->buffer = NULL;
+        bmp->capacity = 0;
+    }
+}
+
+// Маска канала i (0 - красный, 1 - зелёный, 2 - синий, 3 - альфа) из байтов
+// сразу за 40-байтным заголовком: там они лежат и в V4/V5, и после BI_BITFIELDS
+static uint32_t channelMask(BMP *bmp, int i)
+{
+    uint32_t mask = 0;
+    if (bmp->header_extra_size >= (size_t)(i + 1) * sizeof(mask))
+    {
+        memcpy(&mask, bmp->header_extra + i * sizeof(mask), sizeof(mask));
+    }
+    return mask;
+}
+
+static int hasAlphaMask(BMP *bmp)
+{
+    return bmp->bmih.compression == BI_BITFIELDS && bmp->bmih.headerSize >= 56 && channelMask(bmp, 3) == 0xff000000u;
+}
+
+// Проверяет заголовки в том виде, в каком они лежат в файле; для BI_BITFIELDS
+// в header_extra должны быть прочитаны маски
+int isSupportedFormat(BMP *bmp)
+{
+    unsigned int size = bmp->bmih.headerSize;
+    if (bmp->bmfh.signature != 0x4d42 || !(size == 40 || size == 52 || size == 56 || size == 108 || size == 124) ||
+        bmp->header_extra_size < size - 40)
+    {
+        return 0;
+    }
+    // сжатые файлы распаковываются в 24 бит; строки RLE идут только снизу вверх
+    unsigned short bits = bmp->bmih.bitsPerPixel;
+    unsigned int compression = bmp->bmih.compression;
+    if ((bits == 8 && compression == BI_RLE8) || (bits == 4 && compression == BI_RLE4) || (bits == 24 && compression == BI_RLE24))
+    {
+        return (int)bmp->bmih.height > 0;
+    }
+    if (bmp->bmih.bitsPerPixel == 24)
+    {
+        return bmp->bmih.compression == BI_RGB;
+    }
+    if (bmp->bmih.bitsPerPixel != 32)
+    {
+        return 0;
+    }
+    if (bmp->bmih.compression == BI_RGB)
+    {
+        return 1;
+    }
+    // поддерживается только стандартный порядок BGRA, чтобы пиксели не нужно было переставлять
+    uint32_t alpha = size >= 56 ? channelMask(bmp, 3) : 0;
+    return bmp->bmih.compression == BI_BITFIELDS && bmp->header_extra_size >= 12 && channelMask(bmp, 0) == 0x00ff0000u &&
+           channelMask(bmp, 1) == 0x0000ff00u && channelMask(bmp, 2) == 0x000000ffu && (alpha == 0 || alpha == 0xff000000u);
+}
+
+// Заголовок в том виде, в каком он пишется в файл (с отрицательной высотой для строк сверху вниз)
+BitmapInfoHeader fileInfoHeader(BMP *bmp)
+{
+    BitmapInfoHeader header = bmp->bmih;
+    if (bmp->top_down)
+    {
+        header.height = -(int)header.height;
+    }
+    return header;
+}
+
+// Читает байты между заголовками и пикселями и запоминает формат пикселей
+static int readHeaderExtra(FILE *f, BMP *bmp)
+{
+    size_t header_bytes = sizeof(bmp->bmfh) + sizeof(bmp->bmih);
+    size_t size = bmp->bmfh.pixelArrOffset > header_bytes ? bmp->bmfh.pixelArrOffset - header_bytes : 0;
+    if (bmp->bmfh.signature != 0x4d42 || size > MAX_HEADER_EXTRA)
+    {
+        return setError(FILE_READ_ERROR, "Error: unsupported file format");
+    }
+    if (size > 0)
+    {
+        bmp->header_extra = bmp->allocator->alloc(size, sizeof(void *), bmp->allocator->user);
+        if (bmp->header_extra == NULL)
+        {
+            return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+        }
+        size_t got = fread(bmp->header_extra, 1, size, f);
+        memset(bmp->header_extra + got, 0, size - got);
+        bmp->header_extra_size = size;
+        STATS_ADD(bytes_read, got);
+    }
+    if (!isSupportedFormat(bmp))
+    {
+        return setError(FILE_READ_ERROR, "Error: unsupported file format");
+    }
+    if (bmp->bmih.compression == BI_RLE8 || bmp->bmih.compression == BI_RLE4 || bmp->bmih.compression == BI_RLE24)
+    {
+        int code = openRle(bmp);
+        if (code != 0)
+        {
+            return code;
+        }
+    }
+
+    bmp->pixel_bytes = bmp->bmih.bitsPerPixel / 8;
+    bmp->top_down = (int)bmp->bmih.height < 0;
+    if (bmp->top_down)
+    {
+        bmp->bmih.height = -(int)bmp->bmih.height;
+    }
+    bmp->alpha = hasAlphaMask(bmp);
+    bmp->stride = rowStride(bmp->bmih.width, bmp->pixel_bytes);
+    return 0;
+}
+
+void writeHeaders(FILE *f, BMP *bmp)
+{
+    BitmapInfoHeader header = fileInfoHeader(bmp);
+    fwrite(&bmp->bmfh, sizeof(BitmapFileHeader), 1, f);
+    fwrite(&header, sizeof(BitmapInfoHeader), 1, f);
+    if (bmp->header_extra_size > 0)
+    {
+        fwrite(bmp->header_extra, 1, bmp->header_extra_size, f);
+    }
+    STATS_ADD(bytes_written, sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + bmp->header_extra_size);
+}
+
+// Открывает файл и читает заголовки; указатель остаётся в начале массива пикселей
+int openBMP(char *filename, BMP *bmp, FILE **file)
+{
+    closeBMP(bmp);
+    STATS_TIME(start);
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+
+    bmp->first_row = 0;
+    fread(&bmp->bmfh, 1, sizeof(bmp->bmfh), f);
+    fread(&bmp->bmih, 1, sizeof(bmp->bmih), f);
+    STATS_ADD(bytes_read, sizeof(bmp->bmfh) + sizeof(bmp->bmih));
+    int code = readHeaderExtra(f, bmp);
+    STATS_ELAPSED(header_parse_ns, start);
+    if (code != 0)
+    {
+        fclose(f);
+        return code;
+    }
+    *file = f;
+    return 0;
+}
+
+int allocPixels(BMP *bmp, size_t rows)
+{
+    // один выровненный по кэш-линии буфер на всё изображение или полосу;
+    // если уже выделенного буфера хватает, он используется повторно
+    size_t size = bmp->stride * rows;
+    if (size == 0)
+    {
+        size = PIXEL_ALIGNMENT;
+    }
+    if (bmp->buffer == NULL || bmp->capacity < size)
+    {
+        if (bmp->buffer != NULL)
+        {
+            bmp->allocator->free(bmp->buffer, bmp->allocator->user);
+            bmp->capacity = 0;
+        }
+        bmp->buffer = bmp->allocator->alloc(size, PIXEL_ALIGNMENT, bmp->allocator->user);
+        if (bmp->buffer == NULL)
+        {
+            return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+        }
+        bmp->capacity = size;
+        STATS_ADD(alloc_count, 1);
+        STATS_ADD(alloc_bytes, size);
+    }
+    bmp->pixels = bmp->buffer;
+    return 0;
+}
+
+// Дополняет нулями строки буфера, которых не хватило в файле (got - сколько
+// байт прочитано), и обнуляет выравнивание, чтобы при записи получались те же
+// байты, что и раньше
+void finishRows(BMP *bmp, size_t got, unsigned int rows)
+{
+    size_t size = bmp->stride * rows;
+    memset(bmp->pixels + got, 0, size - got);
+
+    size_t row_bytes = (size_t)bmp->bmih.width * bmp->pixel_bytes;
+    size_t padding = bmp->stride - row_bytes;
+    if (padding)
+    {
+        for (size_t i = 0; i < rows; i++)
+        {
+            memset(bmp->pixels + i * bmp->stride + row_bytes, 0, padding);
+        }
+    }
+    bmp->rows = rows;
+}
+
+// Читает следующие rows строк в буфер
+void readRows(FILE *f, BMP *bmp, unsigned int rows)
+{
+    STATS_TIME(start);
+    if (bmp->rle != NULL)
+    {
+        readRleRows(f, bmp, rows);
+    }
+    else
+    {
+        size_t got = fread(bmp->pixels, 1, bmp->stride * rows, f);
+        STATS_ADD(bytes_read, got);
+        finishRows(bmp, got, rows);
+    }
+    STATS_ELAPSED(pixel_load_ns, start);
+}
+
+int readBMP(char *filename, BMP *bmp)
+{
+    FILE *f;
+    int code = openBMP(filename, bmp, &f);
+    if (code != 0)
+    {
+        return code;
+    }
+    code = allocPixels(bmp, bmp->bmih.height);
+    if (code == 0)
+    {
+        readRows(f, bmp, bmp->bmih.height);
+    }
+    fclose(f);
+    return code;
+}
+
+// Отображает файл в память для редактирования на месте: операции пишут прямо
+// в массив пикселей файла, и на диск попадают только изменённые страницы.
+// Без writable отображение только для чтения (например, для нарезки на тайлы)
+int mapBMP(char *filename, BMP *bmp, int writable)
+{
+    // заголовки разбираются так же, как при обычном чтении
+    FILE *f;
+    int code = openBMP(filename, bmp, &f);
+    if (code != 0)
+    {
+        return code;
+    }
+    fclose(f);
+    if (bmp->rle != NULL)
+    {
+        // у сжатого файла в массиве пикселей нет строк, которые можно менять на месте
+        return setError(FILE_READ_ERROR, "Error: compressed images can not be mapped");
+    }
+    int fd = open(filename, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+
+    struct stat st;
+    size_t offset = bmp->bmfh.pixelArrOffset;
+    if (fstat(fd, &st) != 0 || offset < sizeof(bmp->bmfh) + sizeof(bmp->bmih) ||
+        (size_t)st.st_size < offset + bmp->stride * bmp->bmih.height)
+    {
+        close(fd);
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+
+    void *map = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+    bmp->map = map;
+    bmp->map_size = st.st_size;
+    bmp->pixels = (unsigned char *)bmp->map + offset;
+    bmp->rows = bmp->bmih.height;
+    return 0;
+}
+
+int writeBMP(char *filename, BMP *bmp)
+{
+    if (bmp->bmih.compression == BI_RLE24)
+    {
+        return writeRleBMP(filename, bmp);
+    }
+    STATS_TIME(start);
+    FILE *ff = fopen(filename, "wb");
+    if (!ff)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+
+    writeHeaders(ff, bmp);
+    fwrite(bmp->pixels, 1, bmp->stride * bmp->bmih.height, ff); // выравнивание уже лежит в буфере нулями
+
+    int failed = fclose(ff) != 0;
+    STATS_ADD(bytes_written, bmp->stride * bmp->bmih.height);
+    STATS_ELAPSED(save_ns, start);
+    if (failed)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    return 0;
+}
+
+// Читает только строки изображения [y, y + rows) (номера снизу вверх)
+int readRegion(FILE *f, BMP *bmp, unsigned int y, unsigned int rows)
+{
+    unsigned int start = bmp->top_down ? bmp->bmih.height - y - rows : y;
+    if (bmp->rle != NULL)
+    {
+        return setError(FILE_READ_ERROR, "Error: compressed images are read only from the first row");
+    }
+    if (fseeko(f, bmp->bmfh.pixelArrOffset + (off_t)start * bmp->stride, SEEK_SET) != 0)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+    bmp->first_row = y;
+    readRows(f, bmp, rows);
+    return 0;
+}
+
+// Копирует size байт с позиции offset одного файла на ту же позицию другого
+// внутри ядра; если файловая система этого не умеет, копирует через буфер
+int copyRange(int in, int out, off_t offset, size_t size)
+{
+    off_t in_offset = offset;
+    off_t out_offset = offset;
+    while (size > 0)
+    {
+        ssize_t copied = copy_file_range(in, &in_offset, out, &out_offset, size, 0);
+        if (copied <= 0)
+        {
+            if (copied < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        size -= copied;
+    }
+
+    char buffer[1 << 16];
+    while (size > 0)
+    {
+        ssize_t got = pread(in, buffer, size < sizeof(buffer) ? size : sizeof(buffer), in_offset);
+        if (got <= 0 || pwrite(out, buffer, got, out_offset) != got)
+        {
+            return -1;
+        }
+        in_offset += got;
+        out_offset += got;
+        size -= got;
+    }
+    return 0;
+}
+
+// Обнуляет выравнивание rows скопированных строк, начиная со строки start файла,
+// чтобы результат совпадал с обычной записью
+static int clearPadding(int out, BMP *bmp, off_t offset, size_t start, size_t rows)
+{
+    static const unsigned char zeros[4] = {0, 0, 0, 0};
+    size_t row_bytes = (size_t)bmp->bmih.width * bmp->pixel_bytes;
+    size_t padding = bmp->stride - row_bytes;
+    for (size_t i = start; padding > 0 && i < start + rows; i++)
+    {
+        if (pwrite(out, zeros, padding, offset + (off_t)i * bmp->stride + row_bytes) != (ssize_t)padding)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Записывает результат, когда в буфере лежат только изменённые строки
+// [first_row, first_row + rows): заголовки пишутся как обычно, полоса - pwrite,
+// а строки до и после неё копируются из входного файла без участия процесса
+int writeRegionBMP(char *input_file, char *filename, BMP *bmp)
+{
+    STATS_TIME(start);
+    int in = open(input_file, O_RDONLY);
+    if (in < 0)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+    FILE *ff = fopen(filename, "wb");
+    if (!ff)
+    {
+        close(in);
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    writeHeaders(ff, bmp);
+    int failed = fflush(ff) != 0;
+
+    int out = fileno(ff);
+    size_t H = bmp->bmih.height;
+    size_t band_start = bmp->top_down ? H - bmp->first_row - bmp->rows : bmp->first_row;
+    size_t band_end = band_start + bmp->rows;
+    off_t pixels = bmp->bmfh.pixelArrOffset;
+    size_t band_bytes = bmp->stride * bmp->rows;
+    failed = failed || copyRange(in, out, pixels, band_start * bmp->stride) != 0 ||
+             (band_bytes > 0 && pwrite(out, bmp->pixels, band_bytes, pixels + (off_t)band_start * bmp->stride) != (ssize_t)band_bytes) ||
+             copyRange(in, out, pixels + (off_t)band_end * bmp->stride, (H - band_end) * bmp->stride) != 0 ||
+             clearPadding(out, bmp, pixels, 0, band_start) != 0 || clearPadding(out, bmp, pixels, band_end, H - band_end) != 0;
+    close(in);
+    if (fclose(ff) != 0)
+    {
+        failed = 1;
+    }
+    STATS_ADD(bytes_written, bmp->stride * H);
+    STATS_ELAPSED(save_ns, start);
+    if (failed)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    return 0;
+}
+
+// Потоковая обработка: полоса из band_rows строк читается, обрабатывается
+// и записывается, после чего тот же буфер используется для следующей полосы
+int streamBMP(FILE *f, char *filename, BMP *bmp, unsigned int band_rows, ThreadPool *pool, BandOperation operation, void *params)
+{
+    FILE *ff = fopen(filename, "wb");
+    if (!ff)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    unsigned int H = bmp->bmih.height;
+    // сжатые строки пишутся снизу вверх, и полосы файла «сверху вниз» шли бы не в том порядке
+    int compress = bmp->bmih.compression == BI_RLE24;
+    if (compress && bmp->top_down)
+    {
+        fclose(ff);
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: --rle can not compress a top-down image band by band");
+    }
+    size_t compressed = 0;
+    int code = 0;
+
+    if (compress)
+    {
+        writeRleHeaders(ff, bmp);
+    }
+    else
+    {
+        writeHeaders(ff, bmp);
+    }
+
+    // y - номер строки в порядке файла; first_row - номер нижней строки полосы
+    for (unsigned int y = 0; y < H && code == 0; y += band_rows)
+    {
+        unsigned int rows = H - y < band_rows ? H - y : band_rows;
+        bmp->first_row = bmp->top_down ? H - y - rows : y;
+        readRows(f, bmp, rows);
+        runOperation(pool, bmp, operation, params);
+        STATS_TIME(start);
+        if (compress)
+        {
+            code = writeRleRows(ff, bmp, &compressed);
+        }
+        else
+        {
+            fwrite(bmp->pixels, 1, bmp->stride * rows, ff);
+            STATS_ADD(bytes_written, bmp->stride * rows);
+        }
+        STATS_ELAPSED(save_ns, start);
+    }
+
+    if (code == 0 && compress)
+    {
+        code = finishRle(ff, bmp, compressed);
+    }
+    if (fclose(ff) != 0 && code == 0)
+    {
+        code = setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    return code;
+}
+
+// Сколько строк помещается в бюджет памяти (но не меньше одной)
+unsigned int bandRows(BMP *bmp, size_t max_memory)
+{
+    size_t rows = bmp->stride ? max_memory / bmp->stride : bmp->bmih.height;
+    if (rows > bmp->bmih.height)
+    {
+        rows = bmp->bmih.height;
+    }
+    if (rows == 0)
+    {
+        rows = 1;
+    }
+    return rows;
+}
+
+int isSameFile(char *first, char *second)
+{
+    struct stat a, b;
+    return stat(first, &a) == 0 && stat(second, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
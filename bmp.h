@@ -0,0 +1,529 @@
+#ifndef BMP_H
+#define BMP_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#define FILE_READ_ERROR 41
+#define OPTION_ERROR 42
+#define WRONG_ARGUMENTS_ERROR 43
+#define MEMORY_ALLOCATION_ERROR 44
+#define FILE_WRITE_ERROR 45
+#define PIXEL_ALIGNMENT 64
+
+#define BI_RGB 0
+#define BI_RLE8 1
+#define BI_RLE4 2
+#define BI_BITFIELDS 3
+#define BI_RLE24 4 // RLE для 24 бит, как в OS/2 (у Windows это значение - BI_JPEG)
+#define MAX_HEADER_EXTRA (16u << 20) // предел байтов между заголовками и пикселями
+
+#pragma pack(push, 1)
+
+typedef struct BitmapFileHeader
+{
+    unsigned short signature;    // определение типа файла
+    unsigned int filesize;       // размер файла
+    unsigned short reserved1;    // должен быть 0
+    unsigned short reserved2;    // должен быть 0
+    unsigned int pixelArrOffset; // начальный адрес байта, в котором находятся данные изображения (массив пикселей)
+} BitmapFileHeader;
+
+typedef struct BitmapInfoHeader
+{
+    unsigned int headerSize;          // размер этого заголовка в байтах
+    unsigned int width;               // ширина изображения в пикселях
+    unsigned int height;              // высота изображения в пикселях
+    unsigned short planes;            // кол-во цветовых плоскостей (должно быть 1)
+    unsigned short bitsPerPixel;      // глубина цвета изображения
+    unsigned int compression;         // тип сжатия; если сжатия не используется, то здесь должен быть 0
+    unsigned int imageSize;           // размер изображения
+    unsigned int xPixelsPerMeter;     // горизонтальное разрешение (пиксель на метр)
+    unsigned int yPixelsPerMeter;     // вертикальное разрешение (пиксель на метр)
+    unsigned int colorsInColorTable;  // кол-во цветов в цветовой палитре
+    unsigned int importantColorCount; // кол-во важных цветов (или 0, если каждый цвет важен)
+} BitmapInfoHeader;
+
+typedef struct Rgb
+{
+    unsigned char b;
+    unsigned char g;
+    unsigned char r;
+} Rgb;
+
+#pragma pack(pop)
+
+// Распределитель памяти для буферов пикселей; NULL означает posix_memalign/free
+typedef struct BmpAllocator
+{
+    void *(*alloc)(size_t size, size_t alignment, void *user);
+    void (*free)(void *ptr, void *user);
+    void *user;
+} BmpAllocator;
+
+typedef struct RleCodec RleCodec;
+
+// Изображение можно загружать повторно: буфер пикселей сохраняется между
+// вызовами и заново выделяется только тогда, когда его не хватает.
+// Поддерживаются 24 бит BI_RGB, 32 бит BI_RGB/BI_BITFIELDS (BGRA) и сжатые BI_RLE8/BI_RLE4/BI_RLE24
+// (распаковываются в 24 бит) с заголовками
+// 40, 52, 56, 108 (V4) и 124 (V5) байт. Высота в bmih всегда положительная,
+// строки нумеруются снизу вверх; для файлов «сверху вниз» буфер хранит строки
+// в порядке файла, а getRow переводит номера
+typedef struct BMP
+{
+    BitmapInfoHeader bmih;
+    BitmapFileHeader bmfh;
+    unsigned char *pixels;          // непрерывный массив пикселей (в порядке файла, с выравниванием)
+    size_t stride;                  // размер строки в байтах вместе с выравниванием до 4 байт
+    unsigned int pixel_bytes;       // 3 (BGR) или 4 (BGRA, пиксель - выровненное слово)
+    int top_down;                   // строки в файле идут сверху вниз (отрицательная высота)
+    int alpha;                      // есть альфа-канал: рисуемые пиксели становятся непрозрачными
+    unsigned char *header_extra;    // байты файла между 54-байтным заголовком и пикселями
+    size_t header_extra_size;       // (остаток заголовка V4/V5, маски, палитра) - пишутся как есть
+    unsigned int first_row;         // номер первой (нижней) строки изображения, лежащей в буфере
+    unsigned int rows;              // количество строк в буфере (всё изображение или полоса)
+    void *buffer;                   // собственный буфер, выделенный allocator
+    size_t capacity;                // размер собственного буфера в байтах
+    const BmpAllocator *allocator;  // распределитель памяти (NULL - стандартный)
+    void *map;                      // отображение файла в память в режиме --inplace (иначе NULL)
+    size_t map_size;                // размер отображения
+    unsigned char *dirty;           // отметки изменённых участков строк снизу вверх, dirtyTiles на строку (NULL - не отслеживать)
+    RleCodec *rle;                  // состояние распаковки сжатого файла (NULL - пиксели лежат в файле как есть)
+} BMP;
+
+// Операция над строками, лежащими в буфере; вызывается для всего изображения
+// или по очереди для каждой полосы в потоковом режиме
+typedef void (*BandOperation)(BMP *bmp, void *params);
+
+static inline size_t rowStride(unsigned int width, unsigned int pixel_bytes)
+{
+    return ((size_t)width * pixel_bytes + 3) & ~(size_t)3;
+}
+
+// Первый пиксель строки y; шаг между пикселями - pixel_bytes
+static inline Rgb *getRow(BMP *bmp, int y)
+{
+    int index = bmp->top_down ? (int)(bmp->first_row + bmp->rows) - 1 - y : y - (int)bmp->first_row;
+    return (Rgb *)(bmp->pixels + (size_t)index * bmp->stride);
+}
+
+static inline Rgb *getPixel(BMP *bmp, int x, int y)
+{
+    return (Rgb *)((unsigned char *)getRow(bmp, y) + (size_t)x * bmp->pixel_bytes);
+}
+
+// границы строк [bandBegin, bandEnd), которые можно менять в текущем буфере
+static inline int bandBegin(BMP *bmp)
+{
+    return bmp->first_row;
+}
+
+static inline int bandEnd(BMP *bmp)
+{
+    return bmp->first_row + bmp->rows;
+}
+
+// Изменения для --delta отмечаются участками строк по DIRTY_TILE пикселей
+#define DIRTY_TILE 16
+
+static inline size_t dirtyTiles(BMP *bmp)
+{
+    return ((size_t)bmp->bmih.width + DIRTY_TILE - 1) / DIRTY_TILE;
+}
+
+// Отмечает строки [begin, end) изменёнными целиком; их потом пишет --delta
+static inline void markRows(BMP *bmp, int begin, int end)
+{
+    if (bmp->dirty != NULL && begin < end)
+    {
+        memset(bmp->dirty + (size_t)begin * dirtyTiles(bmp), 1, (size_t)(end - begin) * dirtyTiles(bmp));
+    }
+}
+
+// Отмечает изменёнными столбцы [x0, x1] строк [begin, end)
+static inline void markPixels(BMP *bmp, int begin, int end, int x0, int x1)
+{
+    if (bmp->dirty != NULL && x0 <= x1)
+    {
+        size_t tiles = dirtyTiles(bmp);
+        for (int y = begin; y < end; y++)
+        {
+            memset(bmp->dirty + y * tiles + x0 / DIRTY_TILE, 1, x1 / DIRTY_TILE - x0 / DIRTY_TILE + 1);
+        }
+    }
+}
+
+// Ошибки: функции возвращают 0 или код ошибки, сообщение доступно через lastError()
+int setError(int code, const char *format, ...);
+const char *lastError();
+
+// Статистика (stats.c): время этапов в наносекундах монотонных часов,
+// объём ввода-вывода и выделения памяти. Точки замера подключаются макросами
+// STATS_* и без BMP_ENABLE_STATS компилируются в пустоту
+#define STATS_MAX_OPERATIONS 64
+
+typedef struct BmpStats
+{
+    unsigned long files;                          // сколько файлов обработано
+    uint64_t header_parse_ns;                     // чтение и проверка заголовков
+    uint64_t pixel_load_ns;                       // чтение массива пикселей
+    uint64_t save_ns;                             // запись результата
+    uint64_t pyramid_ns;                          // построение и запись уровней --pyramid
+    uint64_t total_ns;                            // вся обработка файла
+    uint64_t operation_ns[STATS_MAX_OPERATIONS];  // каждая операция (сумма по потокам)
+    int operation_types[STATS_MAX_OPERATIONS];    // OPERATION_* для вывода
+    int operation_count;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    unsigned long alloc_count;                    // выделения буферов пикселей
+    uint64_t alloc_bytes;
+    unsigned long cache_hits;                     // результаты, взятые из --cache-dir
+    unsigned long cache_misses;
+} BmpStats;
+
+void initStats(BmpStats *stats);
+void mergeStats(BmpStats *to, BmpStats *from);
+uint64_t statsNow();
+BmpStats *currentStats();
+void setCurrentStats(BmpStats *stats);
+void printStats(FILE *f, BmpStats *stats, int json);
+
+#ifdef BMP_ENABLE_STATS
+#define STATS_TIME(var) uint64_t var = statsNow()
+#define STATS_ADD(field, value)              \
+    do                                       \
+    {                                        \
+        BmpStats *stats_ = currentStats();   \
+        if (stats_ != NULL)                  \
+        {                                    \
+            stats_->field += (value);        \
+        }                                    \
+    } while (0)
+#define STATS_ELAPSED(field, start) STATS_ADD(field, statsNow() - (start))
+#define STATS_OPERATION(stats, index, start)                                                             \
+    do                                                                                                   \
+    {                                                                                                    \
+        if ((stats) != NULL && (index) < STATS_MAX_OPERATIONS)                                           \
+        {                                                                                                \
+            __atomic_fetch_add(&(stats)->operation_ns[index], statsNow() - (start), __ATOMIC_RELAXED);   \
+        }                                                                                                \
+    } while (0)
+#define STATS_ATTACH(stats) setCurrentStats(stats)
+#else
+#define STATS_TIME(var)
+#define STATS_ADD(field, value)
+#define STATS_ELAPSED(field, start)
+#define STATS_OPERATION(stats, index, start)
+#define STATS_ATTACH(stats)
+#endif
+
+// Ввод-вывод (bmp.c)
+void initBMP(BMP *bmp, const BmpAllocator *allocator);
+void closeBMP(BMP *bmp);
+void freeBMP(BMP *bmp);
+int isSupportedFormat(BMP *bmp);
+BitmapInfoHeader fileInfoHeader(BMP *bmp);
+int openBMP(char *filename, BMP *bmp, FILE **file);
+int allocPixels(BMP *bmp, size_t rows);
+void finishRows(BMP *bmp, size_t got, unsigned int rows);
+void readRows(FILE *f, BMP *bmp, unsigned int rows);
+int readBMP(char *filename, BMP *bmp);
+int mapBMP(char *filename, BMP *bmp, int writable);
+void writeHeaders(FILE *f, BMP *bmp);
+int writeBMP(char *filename, BMP *bmp);
+int readRegion(FILE *f, BMP *bmp, unsigned int y, unsigned int rows);
+int writeRegionBMP(char *input_file, char *filename, BMP *bmp);
+int copyRange(int in, int out, off_t offset, size_t size);
+unsigned int bandRows(BMP *bmp, size_t max_memory);
+int isSameFile(char *first, char *second);
+
+// Сжатие RLE (rle.c): BI_RLE8/BI_RLE4/BI_RLE24 распаковываются при чтении в
+// 24-битный буфер полосами по порядку строк; с bmih.compression == BI_RLE24
+// writeBMP и streamBMP сжимают результат
+int openRle(BMP *bmp);
+void readRleRows(FILE *f, BMP *bmp, unsigned int rows);
+void writeRleHeaders(FILE *f, BMP *bmp);
+int writeRleRows(FILE *f, BMP *bmp, size_t *written);
+int finishRle(FILE *f, BMP *bmp, size_t written);
+int writeRleBMP(char *filename, BMP *bmp);
+
+// Пул потоков (pool.c)
+typedef void (*TaskFunction)(void *arg, int index);
+
+// Небольшой пул потоков: задачи с номерами 0..task_count-1 разбираются
+// рабочими потоками и вызывающим потоком, poolRun ждёт завершения всех
+typedef struct ThreadPool
+{
+    pthread_t *threads;
+    int count; // всего потоков вместе с вызывающим
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finish;
+    TaskFunction function;
+    void *arg;
+    int task_count;
+    int next_task;
+    int pending;
+    unsigned long generation;
+    int stop;
+} ThreadPool;
+
+int createPool(ThreadPool *pool, int count);
+void poolRun(ThreadPool *pool, int task_count, TaskFunction function, void *arg);
+void destroyPool(ThreadPool *pool);
+void runOperation(ThreadPool *pool, BMP *bmp, BandOperation operation, void *params);
+int streamBMP(FILE *f, char *filename, BMP *bmp, unsigned int band_rows, ThreadPool *pool, BandOperation operation, void *params);
+
+// Конвейер чтение/обработка/запись по полосам (pipeline.c): depth буферов полос,
+// ввод-вывод через io_uring или, если его нет (или use_threads), через два потока
+#define PIPELINE_MIN_DEPTH 3
+#define PIPELINE_MAX_DEPTH 64
+#define PIPELINE_DEFAULT_DEPTH 4
+#define PIPELINE_BAND_BYTES (4u << 20) // полоса конвейера без --max-memory
+#define PIPELINE_MIN_BYTES (16u << 20) // меньшие изображения читаются целиком
+
+int pipelineBMP(FILE *f, char *filename, BMP *bmp, unsigned int band_rows, int depth, int use_threads, ThreadPool *pool,
+                BandOperation operation, void *params);
+
+// Рисование (draw.c)
+void fillSpan(BMP *bmp, int y, int x0, int x1, Rgb *color);
+int checkDataDrawCircle(BMP *bmp, int coord_x, int coord_y, int radius, int thickness, Rgb *line_color, int fill, Rgb *fill_color);
+void drawCircle(BMP *bmp, int coord_x, int coord_y, int radius, int thickness, Rgb *line_color, int fill, Rgb *fill_color);
+void drawCircleClipped(BMP *bmp, int coord_x, int coord_y, int radius, int thickness, Rgb *line_color, int fill, Rgb *fill_color,
+                       int x_begin, int x_end, int y_begin, int y_end);
+int checkDataDrawLine(BMP *bmp, int x0, int y0, int x1, int y1, int thickness, Rgb *color);
+void drawLine(BMP *bmp, int x0, int y0, int x1, int y1, int thickness, Rgb *color);
+int checkDataDividePicture(BMP *bmp, int thickness, int countY, int countX, Rgb *line_color);
+void dividePicture(BMP *bmp, int thickness, int countY, int countX, Rgb *line_color);
+
+// Фильтр (filter.c): поканальные таблицы на 256 значений. Канал c результата
+// (смещение в Rgb: 0 - синий, 1 - зелёный, 2 - красный) равен
+// table[c][исходный канал source[c]]; подряд идущие таблицы складываются в одну
+typedef struct ChannelLut
+{
+    unsigned char table[3][256];
+    unsigned char source[3];
+} ChannelLut;
+
+void initLut(ChannelLut *lut);
+int buildLut(char *spec, char *channels, ChannelLut *lut);
+void composeLut(ChannelLut *lut, const ChannelLut *next);
+void applyLut(BMP *bmp, const ChannelLut *lut);
+int checkDataRgbFilter(BMP *bmp, char *component_name, int component_value);
+void rgbFilter(BMP *bmp, char *component_name, int value);
+
+// Ядра заполнения по маске; по умолчанию выбирается самое широкое из доступных
+#define FILTER_KERNEL_SCALAR 0
+#define FILTER_KERNEL_SSE41 1
+#define FILTER_KERNEL_AVX2 2
+int setFilterKernel(int kernel);
+
+// Ядра таблиц общего вида: скалярный цикл или AVX-512 VBMI
+#define LUT_KERNEL_SCALAR 0
+#define LUT_KERNEL_AVX512 1
+int setLutKernel(int kernel);
+
+// Операции (operations.c)
+typedef struct CircleParams
+{
+    int coord_x;
+    int coord_y;
+    int radius;
+    int thickness;
+    Rgb line_color;
+    int fill;
+    Rgb fill_color;
+} CircleParams;
+
+typedef struct SplitParams
+{
+    int thickness;
+    int number_x;
+    int number_y;
+    Rgb color;
+} SplitParams;
+
+typedef struct LineParams
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    int thickness;
+    Rgb color;
+} LineParams;
+
+// Много окружностей из файла: они раскладываются по тайлам изображения, и каждый
+// тайл рисуется один раз всеми задевающими его окружностями в исходном порядке
+#define CIRCLE_TILE_WIDTH 256
+#define CIRCLE_TILE_ROWS 64
+
+typedef struct CirclesParams
+{
+    CircleParams *items;
+    int count;
+    int tile_columns;
+    int tile_rows;
+    int *bin_start; // окружности тайла t - bin_items[bin_start[t] .. bin_start[t + 1])
+    int *bin_items;
+} CirclesParams;
+
+#define OPERATION_NONE 0
+#define OPERATION_CIRCLE 1
+#define OPERATION_FILTER 2
+#define OPERATION_SPLIT 3
+#define OPERATION_CIRCLES 4
+#define OPERATION_LINE 5
+#define OPERATION_LUT 6
+
+// Значения опций одной операции в том виде, в каком они пришли из командной строки
+typedef struct OperationArgs
+{
+    int option;
+    char *center_coords;
+    int radius;
+    int fill;
+    char *color_f;
+    char *component_name;
+    int component_value;
+    int number_x;
+    int number_y;
+    int thickness;
+    char *color;
+    char *circles_file;
+    char *start_coords;
+    char *end_coords;
+    char *lut_spec;
+    char *channels;
+} OperationArgs;
+
+// Разобранная и проверенная операция, готовая к применению к изображению
+typedef struct Operation
+{
+    BandOperation apply;
+    union
+    {
+        CircleParams circle;
+        ChannelLut lut; // --rgbfilter и --lut
+        SplitParams split;
+        CirclesParams circles;
+        LineParams line;
+    } params;
+} Operation;
+
+typedef struct OperationList
+{
+    Operation *items;
+    int count;
+    BmpStats *stats; // куда добавлять время операций (NULL - не замерять)
+} OperationList;
+
+// Кэш результатов (cache.c): готовые файлы лежат в каталоге под именем из хеша
+// входного файла и разобранных параметров операций; при переполнении удаляются
+// записи, к которым дольше всего не обращались
+#define CACHE_KEY_SIZE 40
+
+typedef struct ResultCache
+{
+    char *dir;
+    size_t limit;          // предельный общий размер записей в байтах
+    uint64_t ops_hash;     // хеш параметров операций
+    int enabled;           // параметры удалось привести к ключу
+    size_t size;           // текущий размер записей (уточняется при вытеснении)
+    unsigned long hits;
+    unsigned long misses;
+    pthread_mutex_t lock;
+} ResultCache;
+
+int openResultCache(ResultCache *cache, char *dir, size_t limit, OperationArgs *ops, int op_count);
+void closeResultCache(ResultCache *cache);
+int cacheKey(ResultCache *cache, char *input_file, char *key);
+int fetchCachedResult(ResultCache *cache, char *key, char *output_file);
+void storeCachedResult(ResultCache *cache, char *key, char *output_file);
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed);
+
+// Как обрабатывать файл: список операций и режим ввода-вывода
+typedef struct ProcessOptions
+{
+    OperationArgs *ops;
+    int op_count;
+    int inplace;
+    size_t max_memory;
+    ThreadPool *pool;              // NULL - всё выполняется в вызывающем потоке
+    const BmpAllocator *allocator; // распределитель для изображений пакетной обработки
+    BmpStats *stats;               // статистика обработки (NULL - не собирать)
+    ResultCache *cache;            // кэш результатов (NULL - не использовать)
+    unsigned int pyramid;          // наименьшая сторона уровней --pyramid (0 - не строить)
+    int io_depth;                  // буферов конвейера ввода-вывода (0 - без конвейера)
+    int io_threads;                // конвейер на потоках даже при наличии io_uring
+    int delta;                     // писать вместо результата патч изменённых строк (--delta)
+    int rle;                       // сжимать 24-битный результат BI_RLE24 (--rle)
+} ProcessOptions;
+
+int getColor(char *color_str, Rgb *color);
+int getCoordinates(char *center_coords, int *coord_x, int *coord_y);
+void applyOperations(BMP *bmp, void *params);
+void initOperationArgs(OperationArgs *args);
+int setOperationArg(OperationArgs *args, int opt, char *value);
+int buildOperation(BMP *bmp, OperationArgs *args, Operation *op);
+int buildOperations(BMP *bmp, OperationArgs *args, int count, Operation *ops, int *built);
+void fuseOperations(Operation *ops, int count);
+void freeOperation(Operation *op);
+int processFile(BMP *image, char *input_file, char *output_file, ProcessOptions *options);
+
+// Уровни уменьшенных копий для превью (pyramid.c): пишутся за один проход
+// вместе с результатом (или без него, если он уже на диске)
+int writePyramid(BMP *bmp, char *filename, int write_result, unsigned int min_size, ThreadPool *pool);
+
+// Патчи из изменённых участков (delta.c): --delta пишет заголовки и прямоугольники,
+// отмеченные в bmp->dirty, --apply-patch собирает из них полный файл
+int writeDeltaBMP(char *input_file, char *filename, BMP *bmp);
+int applyPatch(char *base_file, char *patch_file, char *output_file);
+
+// Пакетная обработка (batch.c)
+typedef void (*BatchReport)(char *input_file, int code, const char *message);
+
+int appendString(char ***list, int *count, char *value);
+int runBatch(char *source, char *output_dir, int threads, ProcessOptions *options, BatchReport report);
+
+// Сервер (server.c): принимает запросы на Unix-сокете и держит недавно
+// прочитанные изображения в памяти. Запрос - строки, каждая завершается нулём:
+// текущий каталог клиента, затем аргументы как в командной строке, в конце
+// пустая строка. Ответ - одна строка "<код> <сообщение>"
+typedef struct ServerRequest
+{
+    char *input_file;
+    char *output_file;
+    OperationArgs *ops;
+    int op_count;
+    char **specs; // копии --op, на которые ссылаются ops
+    int spec_count;
+    int stats;    // запрос счётчиков сервера вместо обработки
+} ServerRequest;
+
+// Разбор аргументов запроса; его предоставляет программа, знающая опции
+typedef int (*ServerParse)(int argc, char **argv, ServerRequest *request);
+
+int runServer(char *socket_path, int threads, size_t memory_limit, ServerParse parse);
+int connectServer(char *socket_path, int *fd);
+int sendRequest(int fd, char *cwd, int argc, char **argv, char *reply, size_t size);
+
+// Окружности из файла (circles.c)
+int buildCircles(BMP *bmp, char *filename, CirclesParams *circles);
+void applyCircles(BMP *bmp, void *params);
+void freeCircles(CirclesParams *circles);
+
+// Нарезка на тайлы (tiles.c)
+int exportTiles(char *input_file, char *output_dir, int number_x, int number_y, ThreadPool *pool);
+
+// Каталог заголовков (index.c)
+int indexDirectory(char *root, ThreadPool *pool, FILE *out, int json);
+
+// Гистограммы и статистика пикселей (histogram.c)
+int imageStatistics(char *filename, Rgb *color, ThreadPool *pool, FILE *out);
+
+#endif
@@ -0,0 +1,435 @@
+// copy_file_range
+#define _GNU_SOURCE
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+// Размер кэша по умолчанию, если --cache-size не задан
+#define CACHE_DEFAULT_LIMIT ((size_t)1 << 30)
+
+// Хеш по схеме xxHash64: четыре независимые цепочки по 8 байт, так что
+// умножения разных цепочек выполняются параллельно
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ull;
+static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t PRIME5 = 0x27D4EB2F165667C5ull;
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t hashRound(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    return rotl64(acc, 31) * PRIME1;
+}
+
+static uint64_t hashMerge(uint64_t acc, uint64_t value)
+{
+    acc ^= hashRound(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + size;
+    uint64_t h;
+    if (size >= 32)
+    {
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = hashRound(v1, read64(p));
+            v2 = hashRound(v2, read64(p + 8));
+            v3 = hashRound(v3, read64(p + 16));
+            v4 = hashRound(v4, read64(p + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hashMerge(hashMerge(hashMerge(hashMerge(h, v1), v2), v3), v4);
+    }
+    else
+    {
+        h = seed + PRIME5;
+    }
+    h += size;
+    for (; p + 8 <= end; p += 8)
+    {
+        h = rotl64(h ^ hashRound(0, read64(p)), 27) * PRIME1 + PRIME4;
+    }
+    for (; p < end; p++)
+    {
+        h = rotl64(h ^ (*p * PRIME5), 11) * PRIME1;
+    }
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    return h ^ (h >> 32);
+}
+
+// Хеш содержимого файла; файл отображается в память, а не читается в буфер
+static int hashFile(char *filename, uint64_t seed, uint64_t *hash, size_t *size)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+    *size = st.st_size;
+    if (st.st_size == 0)
+    {
+        close(fd);
+        *hash = hashBytes(NULL, 0, seed);
+        return 0;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    *hash = hashBytes(data, st.st_size, seed);
+    munmap(data, st.st_size);
+    return 0;
+}
+
+// Дописывает к описанию операций значения одной операции в разобранном виде:
+// "255.0.0" и "255.000.0" дают один ключ, таблицы --lut сравниваются целиком
+static int describeOperation(OperationArgs *args, char *text, size_t size)
+{
+    Rgb color = {0, 0, 0};
+    Rgb fill_color = {0, 0, 0};
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    size_t length = strlen(text);
+    switch (args->option)
+    {
+    case OPERATION_CIRCLE:
+        if (getColor(args->color, &color) != 0 || getCoordinates(args->center_coords, &x0, &y0) != 0 ||
+            (args->fill && getColor(args->color_f, &fill_color) != 0))
+        {
+            return -1;
+        }
+        snprintf(text + length, size - length, "circle %d %d %d %d %d.%d.%d %d %d.%d.%d;", x0, y0, args->radius, args->thickness,
+                 color.r, color.g, color.b, args->fill, fill_color.r, fill_color.g, fill_color.b);
+        break;
+    case OPERATION_SPLIT:
+        if (getColor(args->color, &color) != 0)
+        {
+            return -1;
+        }
+        snprintf(text + length, size - length, "split %d %d %d %d.%d.%d;", args->number_x, args->number_y, args->thickness,
+                 color.r, color.g, color.b);
+        break;
+    case OPERATION_LINE:
+        if (getColor(args->color, &color) != 0 || getCoordinates(args->start_coords, &x0, &y0) != 0 ||
+            getCoordinates(args->end_coords, &x1, &y1) != 0)
+        {
+            return -1;
+        }
+        snprintf(text + length, size - length, "line %d %d %d %d %d %d.%d.%d;", x0, y0, x1, y1, args->thickness,
+                 color.r, color.g, color.b);
+        break;
+    case OPERATION_FILTER:
+    case OPERATION_LUT:
+    {
+        ChannelLut lut;
+        char spec[16];
+        char *channels = args->channels;
+        char *lut_spec = args->lut_spec;
+        if (args->option == OPERATION_FILTER)
+        {
+            if (args->component_name == NULL || (strcmp(args->component_name, "red") != 0 &&
+                                                  strcmp(args->component_name, "green") != 0 &&
+                                                  strcmp(args->component_name, "blue") != 0))
+            {
+                return -1;
+            }
+            snprintf(spec, sizeof(spec), "set=%d", args->component_value);
+            lut_spec = spec;
+            channels = strcmp(args->component_name, "red") == 0 ? "r" : strcmp(args->component_name, "green") == 0 ? "g" : "b";
+        }
+        if (buildLut(lut_spec, channels, &lut) != 0)
+        {
+            return -1;
+        }
+        snprintf(text + length, size - length, "lut %016llx;", (unsigned long long)hashBytes(&lut, sizeof(lut), 0));
+        break;
+    }
+    case OPERATION_CIRCLES:
+    {
+        // окружности задаются содержимым файла, а не его именем
+        uint64_t hash;
+        size_t file_size;
+        if (hashFile(args->circles_file, 0, &hash, &file_size) != 0)
+        {
+            return -1;
+        }
+        snprintf(text + length, size - length, "circles %016llx %zu;", (unsigned long long)hash, file_size);
+        break;
+    }
+    default:
+        return -1;
+    }
+    return strlen(text) + 1 < size ? 0 : -1;
+}
+
+// Просматривает каталог кэша; при limit > 0 удаляет самые давно
+// использованные записи, пока их общий размер больше limit
+typedef struct CacheEntry
+{
+    char name[64];
+    time_t mtime;
+    long mtime_ns;
+    size_t size;
+} CacheEntry;
+
+static int compareEntries(const void *a, const void *b)
+{
+    const CacheEntry *first = a;
+    const CacheEntry *second = b;
+    if (first->mtime != second->mtime)
+    {
+        return first->mtime < second->mtime ? -1 : 1;
+    }
+    return first->mtime_ns < second->mtime_ns ? -1 : first->mtime_ns > second->mtime_ns;
+}
+
+static int isCacheEntry(const char *name)
+{
+    size_t length = strlen(name);
+    return length > 4 && length < 64 && name[0] != '.' && strcmp(name + length - 4, ".bmp") == 0;
+}
+
+static size_t scanCache(ResultCache *cache, size_t limit)
+{
+    DIR *dir = opendir(cache->dir);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+    CacheEntry *entries = NULL;
+    int count = 0;
+    int capacity = 0;
+    size_t total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        if (!isCacheEntry(entry->d_name) || fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+        total += st.st_size;
+        if (limit == 0)
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            CacheEntry *grown = (CacheEntry *)realloc(entries, sizeof(CacheEntry) * capacity);
+            if (grown == NULL)
+            {
+                break;
+            }
+            entries = grown;
+        }
+        CacheEntry *e = &entries[count++];
+        snprintf(e->name, sizeof(e->name), "%s", entry->d_name);
+        e->mtime = st.st_mtim.tv_sec;
+        e->mtime_ns = st.st_mtim.tv_nsec;
+        e->size = st.st_size;
+    }
+
+    if (limit > 0 && total > limit)
+    {
+        // время изменения записи обновляется при каждом попадании
+        qsort(entries, count, sizeof(CacheEntry), compareEntries);
+        for (int i = 0; i < count && total > limit; i++)
+        {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+            {
+                total -= entries[i].size;
+            }
+        }
+    }
+    closedir(dir);
+    free(entries);
+    return total;
+}
+
+int openResultCache(ResultCache *cache, char *dir, size_t limit, OperationArgs *ops, int op_count)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->dir = dir;
+    cache->limit = limit ? limit : CACHE_DEFAULT_LIMIT;
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: can not create cache directory");
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+    // неразборчивые параметры всё равно дадут ошибку при обработке,
+    // поэтому кэш для них просто не используется
+    char text[4096] = "cw-cache 1;";
+    cache->enabled = op_count > 0;
+    for (int i = 0; i < op_count && cache->enabled; i++)
+    {
+        cache->enabled = describeOperation(&ops[i], text, sizeof(text)) == 0;
+    }
+    cache->ops_hash = hashBytes(text, strlen(text), 0);
+    cache->size = scanCache(cache, 0);
+    return 0;
+}
+
+void closeResultCache(ResultCache *cache)
+{
+    if (cache->dir != NULL)
+    {
+        pthread_mutex_destroy(&cache->lock);
+    }
+    cache->dir = NULL;
+}
+
+// Ключ записи: хеш содержимого входного файла с параметрами операций и его размер
+int cacheKey(ResultCache *cache, char *input_file, char *key)
+{
+    if (!cache->enabled)
+    {
+        return -1;
+    }
+    uint64_t hash;
+    size_t size;
+    if (hashFile(input_file, cache->ops_hash, &hash, &size) != 0)
+    {
+        return -1;
+    }
+    snprintf(key, CACHE_KEY_SIZE, "%016llx-%zx", (unsigned long long)hash, size);
+    return 0;
+}
+
+// Копирует файл без разбора: сначала клонированием экстентов (reflink),
+// затем copy_file_range в ядре и только потом через буфер
+static int copyFile(char *from, char *to)
+{
+    int in = open(from, O_RDONLY);
+    if (in < 0)
+    {
+        return -1;
+    }
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0)
+    {
+        close(in);
+        return -1;
+    }
+    int code = 0;
+    if (ioctl(out, FICLONE, in) != 0)
+    {
+        ssize_t copied;
+        while ((copied = copy_file_range(in, NULL, out, NULL, (size_t)1 << 30, 0)) > 0)
+        {
+        }
+        if (copied < 0)
+        {
+            // файловые системы без copy_file_range: обычное копирование с текущего места
+            char buffer[1 << 16];
+            ssize_t got;
+            while ((got = read(in, buffer, sizeof(buffer))) > 0)
+            {
+                if (write(out, buffer, got) != got)
+                {
+                    got = -1;
+                    break;
+                }
+            }
+            code = got < 0 ? -1 : 0;
+        }
+    }
+    close(in);
+    if (close(out) != 0)
+    {
+        code = -1;
+    }
+    return code;
+}
+
+// Попадание: результат копируется из кэша в output_file, запись становится
+// самой свежей. Возвращает 1 при попадании и 0 при промахе
+int fetchCachedResult(ResultCache *cache, char *key, char *output_file)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.bmp", cache->dir, key);
+    int hit = access(path, R_OK) == 0 && copyFile(path, output_file) == 0;
+    if (hit)
+    {
+        utimensat(AT_FDCWD, path, NULL, 0);
+    }
+    pthread_mutex_lock(&cache->lock);
+    if (hit)
+    {
+        cache->hits++;
+    }
+    else
+    {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+// Сохраняет готовый результат: запись копируется во временный файл и
+// переименовывается, так что параллельные процессы не видят её недописанной.
+// Ошибки кэша не мешают обработке и не сообщаются
+void storeCachedResult(ResultCache *cache, char *key, char *output_file)
+{
+    static unsigned long temp_counter;
+    char temp[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s/.tmp-%d-%lu", cache->dir, (int)getpid(),
+             __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED));
+    snprintf(path, sizeof(path), "%s/%s.bmp", cache->dir, key);
+    struct stat st;
+    if (copyFile(output_file, temp) != 0 || stat(temp, &st) != 0 || rename(temp, path) != 0)
+    {
+        unlink(temp);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->size += st.st_size;
+    if (cache->size > cache->limit)
+    {
+        cache->size = scanCache(cache, cache->limit);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,244 @@
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+// Внешний и внутренний радиусы кольца, как в drawCircle
+static void circleRadii(CircleParams *c, long long *inner, long long *outer)
+{
+    *inner = c->radius - c->thickness / 2 > 0 ? c->radius - c->thickness / 2 : 0;
+    *outer = (long long)c->radius + c->thickness / 2;
+}
+
+// Задевает ли окружность хотя бы один пиксель тайла: ближайшая точка тайла
+// должна лежать не дальше внешнего радиуса, а у незалитого кольца самая
+// дальняя точка - не ближе внутреннего
+static int touchesTile(CircleParams *c, long long x0, long long x1, long long y0, long long y1)
+{
+    long long inner, outer;
+    circleRadii(c, &inner, &outer);
+    long long near_x = c->coord_x < x0 ? x0 - c->coord_x : c->coord_x > x1 ? c->coord_x - x1 : 0;
+    long long near_y = c->coord_y < y0 ? y0 - c->coord_y : c->coord_y > y1 ? c->coord_y - y1 : 0;
+    if (near_x * near_x + near_y * near_y > outer * outer)
+    {
+        return 0;
+    }
+    long long far_x = llabs(x0 - c->coord_x) > llabs(x1 - c->coord_x) ? llabs(x0 - c->coord_x) : llabs(x1 - c->coord_x);
+    long long far_y = llabs(y0 - c->coord_y) > llabs(y1 - c->coord_y) ? llabs(y0 - c->coord_y) : llabs(y1 - c->coord_y);
+    return c->fill || far_x * far_x + far_y * far_y >= inner * inner;
+}
+
+// Проходит по тайлам, которые задевает окружность index: при counts == NULL
+// записывает её в корзины по позициям slots, иначе только считает
+static void binCircle(CirclesParams *circles, BMP *bmp, int index, size_t *counts, int *slots)
+{
+    CircleParams *c = &circles->items[index];
+    long long inner, outer;
+    circleRadii(c, &inner, &outer);
+    long long x_lo = c->coord_x - outer > 0 ? c->coord_x - outer : 0;
+    long long x_hi = c->coord_x + outer < (long long)bmp->bmih.width - 1 ? c->coord_x + outer : (long long)bmp->bmih.width - 1;
+    long long y_lo = c->coord_y - outer > 0 ? c->coord_y - outer : 0;
+    long long y_hi = c->coord_y + outer < (long long)bmp->bmih.height - 1 ? c->coord_y + outer : (long long)bmp->bmih.height - 1;
+    if (x_lo > x_hi || y_lo > y_hi)
+    {
+        return;
+    }
+    for (long long ty = y_lo / CIRCLE_TILE_ROWS; ty <= y_hi / CIRCLE_TILE_ROWS; ty++)
+    {
+        for (long long tx = x_lo / CIRCLE_TILE_WIDTH; tx <= x_hi / CIRCLE_TILE_WIDTH; tx++)
+        {
+            if (!touchesTile(c, tx * CIRCLE_TILE_WIDTH, tx * CIRCLE_TILE_WIDTH + CIRCLE_TILE_WIDTH - 1,
+                             ty * CIRCLE_TILE_ROWS, ty * CIRCLE_TILE_ROWS + CIRCLE_TILE_ROWS - 1))
+            {
+                continue;
+            }
+            int tile = ty * circles->tile_columns + tx;
+            if (counts != NULL)
+            {
+                counts[tile]++;
+            }
+            else
+            {
+                circles->bin_items[slots[tile]++] = index;
+            }
+        }
+    }
+}
+
+// Дописывает номер строки файла к сообщению последней ошибки
+static int lineError(int code, int line_number)
+{
+    char message[256];
+    snprintf(message, sizeof(message), "%s (line %d)", lastError(), line_number);
+    return setError(code, "%s", message);
+}
+
+// Читает файл окружностей, по одной на строку:
+//   <x.y> <radius> <thickness> <rrr.ggg.bbb> [<fill rrr.ggg.bbb>]
+// пустые строки и строки с # пропускаются. Затем раскладывает окружности по тайлам
+static int readCircles(BMP *bmp, char *filename, CirclesParams *circles)
+{
+    if (filename == NULL)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: wrong argument");
+    }
+    FILE *f = fopen(filename, "r");
+    if (!f)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+
+    int code = 0;
+    int capacity = 0;
+    int line_number = 0;
+    char line[4096];
+    while (code == 0 && fgets(line, sizeof(line), f) != NULL)
+    {
+        line_number++;
+        char *start = line + strspn(line, " \t\r\n");
+        if (*start == '\0' || *start == '#')
+        {
+            continue;
+        }
+        if (circles->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            CircleParams *grown = (CircleParams *)realloc(circles->items, sizeof(CircleParams) * capacity);
+            if (grown == NULL)
+            {
+                code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+                break;
+            }
+            circles->items = grown;
+        }
+
+        CircleParams *c = &circles->items[circles->count];
+        char center[64], color[64], fill_color[64];
+        int fields = sscanf(start, "%63s %d %d %63s %63s", center, &c->radius, &c->thickness, color, fill_color);
+        if (fields < 4)
+        {
+            code = lineError(setError(WRONG_ARGUMENTS_ERROR, "Error: invalid circle"), line_number);
+            break;
+        }
+        c->fill = fields == 5;
+        if ((code = getCoordinates(center, &c->coord_x, &c->coord_y)) != 0 ||
+            (code = getColor(color, &c->line_color)) != 0 ||
+            (c->fill && (code = getColor(fill_color, &c->fill_color)) != 0) ||
+            (code = checkDataDrawCircle(bmp, c->coord_x, c->coord_y, c->radius, c->thickness, &c->line_color,
+                                        c->fill, c->fill ? &c->fill_color : NULL)) != 0)
+        {
+            code = lineError(code, line_number);
+            break;
+        }
+        c->coord_y = bmp->bmih.height - c->coord_y;
+        circles->count++;
+    }
+    fclose(f);
+    return code;
+}
+
+int buildCircles(BMP *bmp, char *filename, CirclesParams *circles)
+{
+    memset(circles, 0, sizeof(*circles));
+    int code = readCircles(bmp, filename, circles);
+
+    circles->tile_columns = (bmp->bmih.width + CIRCLE_TILE_WIDTH - 1) / CIRCLE_TILE_WIDTH;
+    circles->tile_rows = (bmp->bmih.height + CIRCLE_TILE_ROWS - 1) / CIRCLE_TILE_ROWS;
+    size_t tiles = (size_t)circles->tile_columns * circles->tile_rows;
+    size_t *counts = NULL;
+    if (code == 0)
+    {
+        counts = (size_t *)calloc(tiles + 1, sizeof(size_t));
+        circles->bin_start = (int *)malloc(sizeof(int) * (tiles + 1));
+        if (counts == NULL || circles->bin_start == NULL)
+        {
+            code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+        }
+    }
+
+    if (code == 0)
+    {
+        // первый проход считает окружности в каждом тайле, второй раскладывает
+        // их по порядку, так что внутри тайла порядок рисования сохраняется
+        for (int i = 0; i < circles->count; i++)
+        {
+            binCircle(circles, bmp, i, counts, NULL);
+        }
+        size_t total = 0;
+        for (size_t t = 0; t < tiles; t++)
+        {
+            circles->bin_start[t] = total;
+            total += counts[t];
+            if (total > INT_MAX)
+            {
+                code = setError(MEMORY_ALLOCATION_ERROR, "Error: too many circles");
+                break;
+            }
+        }
+        circles->bin_start[tiles] = total;
+        if (code == 0)
+        {
+            circles->bin_items = (int *)malloc(sizeof(int) * (total ? total : 1));
+            if (circles->bin_items == NULL)
+            {
+                code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+            }
+        }
+    }
+
+    if (code == 0)
+    {
+        int *slots = (int *)counts; // счётчики больше не нужны, память идёт под позиции
+        for (size_t t = 0; t < tiles; t++)
+        {
+            slots[t] = circles->bin_start[t];
+        }
+        for (int i = 0; i < circles->count; i++)
+        {
+            binCircle(circles, bmp, i, NULL, slots);
+        }
+    }
+
+    free(counts);
+    if (code != 0)
+    {
+        freeCircles(circles);
+    }
+    return code;
+}
+
+// Рисует тайлы, строки которых лежат в буфере: каждый тайл целиком попадает в кэш
+// и закрашивается всеми своими окружностями по очереди
+void applyCircles(BMP *bmp, void *params)
+{
+    CirclesParams *circles = params;
+    if (bmp->rows == 0 || circles->tile_columns == 0)
+    {
+        return;
+    }
+    int first_tile_row = bandBegin(bmp) / CIRCLE_TILE_ROWS;
+    int last_tile_row = (bandEnd(bmp) - 1) / CIRCLE_TILE_ROWS;
+    for (int ty = first_tile_row; ty <= last_tile_row; ty++)
+    {
+        for (int tx = 0; tx < circles->tile_columns; tx++)
+        {
+            int tile = ty * circles->tile_columns + tx;
+            for (int i = circles->bin_start[tile]; i < circles->bin_start[tile + 1]; i++)
+            {
+                CircleParams *c = &circles->items[circles->bin_items[i]];
+                drawCircleClipped(bmp, c->coord_x, c->coord_y, c->radius, c->thickness, &c->line_color, c->fill, &c->fill_color,
+                                  tx * CIRCLE_TILE_WIDTH, tx * CIRCLE_TILE_WIDTH + CIRCLE_TILE_WIDTH - 1,
+                                  ty * CIRCLE_TILE_ROWS, ty * CIRCLE_TILE_ROWS + CIRCLE_TILE_ROWS - 1);
+            }
+        }
+    }
+}
+
+void freeCircles(CirclesParams *circles)
+{
+    free(circles->items);
+    free(circles->bin_start);
+    free(circles->bin_items);
+    memset(circles, 0, sizeof(*circles));
+}
@@ -0,0 +1,485 @@
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Патч хранит заголовки результата и только изменённые участки:
+//   DeltaHeader, заголовки результата (header_size байт),
+//   span_count записей DeltaSpan, байты отрезков подряд.
+// Отрезок - прямоугольник из rows строк по bytes байт со сдвига offset в строке;
+// номера строк - в порядке файла, отрезок во всю ширину включает выравнивание.
+// Участки отмечаются по DIRTY_TILE пикселей, так что размер патча растёт
+// с площадью изменений, а не с числом задетых строк. Исходный файл проверяется по размеру,
+// хешу заголовков и хешу всех пикселей, поэтому патч не ложится на другую картинку
+#define DELTA_MAGIC "BMPDELT3"
+
+typedef struct DeltaHeader
+{
+    char magic[8];
+    uint64_t base_size;   // размер исходного файла
+    uint64_t base_header; // сколько первых байт исходного файла покрывает base_hash
+    uint64_t base_hash;
+    uint64_t base_offset; // начало пикселей исходного файла
+    uint64_t base_pixels; // хеш строк исходного файла без выравнивания
+    uint64_t result_size; // размер файла результата
+    uint64_t header_size; // заголовки результата, за ними сразу идут пиксели
+    uint64_t stride;
+    uint64_t row_bytes; // байты пикселей строки без выравнивания
+    uint64_t height;
+    uint64_t span_count;
+} DeltaHeader;
+
+typedef struct DeltaSpan
+{
+    uint64_t first_row;
+    uint64_t rows;
+    uint64_t offset; // первый байт участка в строке
+    uint64_t bytes;
+} DeltaSpan;
+
+static int pushSpan(DeltaSpan **spans, size_t *count, size_t *capacity, DeltaSpan span)
+{
+    if (*count == *capacity)
+    {
+        size_t grown = *capacity > 0 ? *capacity * 2 : 64;
+        DeltaSpan *resized = realloc(*spans, sizeof(DeltaSpan) * grown);
+        if (resized == NULL)
+        {
+            return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+        }
+        *spans = resized;
+        *capacity = grown;
+    }
+    (*spans)[(*count)++] = span;
+    return 0;
+}
+
+// Отрезки из отметок bmp->dirty в порядке файла: участки подряд идущих отмеченных
+// блоков строки; если у следующей строки те же участки, отрезки растут вниз
+static int buildSpans(BMP *bmp, DeltaSpan **spans, size_t *count)
+{
+    size_t H = bmp->bmih.height;
+    size_t tiles = dirtyTiles(bmp);
+    size_t row_bytes = (size_t)bmp->bmih.width * bmp->pixel_bytes;
+    size_t capacity = 0;
+    DeltaSpan *runs = malloc(sizeof(DeltaSpan) * (tiles / 2 + 1));
+    if (runs == NULL)
+    {
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    *spans = NULL;
+    *count = 0;
+    size_t open = 0; // отрезки предыдущей строки - spans[open..count)
+    int code = 0;
+    for (size_t i = 0; code == 0 && i < H; i++)
+    {
+        const unsigned char *marks = bmp->dirty + (bmp->top_down ? H - 1 - i : i) * tiles;
+        size_t run_count = 0;
+        for (size_t t = 0; t < tiles;)
+        {
+            if (!marks[t])
+            {
+                t++;
+                continue;
+            }
+            size_t first = t;
+            while (t < tiles && marks[t])
+            {
+                t++;
+            }
+            size_t begin = first * DIRTY_TILE * bmp->pixel_bytes;
+            size_t end = t == tiles ? row_bytes : t * DIRTY_TILE * bmp->pixel_bytes;
+            runs[run_count].first_row = i;
+            runs[run_count].rows = 1;
+            runs[run_count].offset = begin;
+            runs[run_count].bytes = begin == 0 && end == row_bytes ? bmp->stride : end - begin;
+            run_count++;
+        }
+
+        int same = run_count > 0 && run_count == *count - open;
+        for (size_t k = 0; same && k < run_count; k++)
+        {
+            DeltaSpan *previous = *spans + open + k;
+            same = previous->first_row + previous->rows == i && previous->offset == runs[k].offset && previous->bytes == runs[k].bytes;
+        }
+        if (same)
+        {
+            for (size_t k = open; k < *count; k++)
+            {
+                (*spans)[k].rows++;
+            }
+            continue;
+        }
+        open = *count;
+        for (size_t k = 0; code == 0 && k < run_count; k++)
+        {
+            code = pushSpan(spans, count, &capacity, runs[k]);
+        }
+    }
+    free(runs);
+    if (code != 0)
+    {
+        free(*spans);
+        *spans = NULL;
+    }
+    return code;
+}
+
+// Хеш первых size байт файла; короткий файл хешируется тем, что в нём есть
+static int hashHeader(int fd, size_t size, uint64_t *hash, uint64_t *hashed)
+{
+    unsigned char *buffer = malloc(size > 0 ? size : 1);
+    if (buffer == NULL)
+    {
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    size_t got = 0;
+    while (got < size)
+    {
+        ssize_t n = pread(fd, buffer + got, size - got, got);
+        if (n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+    *hash = hashBytes(buffer, got, 0);
+    *hashed = got;
+    free(buffer);
+    return 0;
+}
+
+// Хеш пикселей файла: row_bytes байт каждой из height строк по stride с offset,
+// выравнивание не учитывается. Байты за концом короткого файла считаются нулями,
+// как при чтении
+static int hashPixels(int fd, size_t size, size_t offset, size_t stride, size_t row_bytes, size_t height, uint64_t *hash)
+{
+    unsigned char *map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    unsigned char *row = calloc(row_bytes > 0 ? row_bytes : 1, 1);
+    if (map == MAP_FAILED || row == NULL)
+    {
+        if (map != MAP_FAILED && map != NULL)
+        {
+            munmap(map, size);
+        }
+        free(row);
+        return map == MAP_FAILED ? setError(FILE_READ_ERROR, "Error: file reading error")
+                                 : setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    uint64_t h = 0;
+    for (size_t i = 0; i < height; i++)
+    {
+        size_t begin = offset + i * stride;
+        if (begin <= size && row_bytes <= size - begin)
+        {
+            h = hashBytes(map + begin, row_bytes, h);
+            continue;
+        }
+        size_t have = begin < size ? size - begin : 0;
+        memcpy(row, map + begin, have);
+        memset(row + have, 0, row_bytes - have);
+        h = hashBytes(row, row_bytes, h);
+    }
+    *hash = h;
+    free(row);
+    if (map != NULL)
+    {
+        munmap(map, size);
+    }
+    return 0;
+}
+
+// Записывает вместо результата патч к input_file: заголовки и строки, отмеченные
+// в bmp->dirty. Отмеченные строки должны лежать в буфере (полный или региональный)
+int writeDeltaBMP(char *input_file, char *filename, BMP *bmp)
+{
+    STATS_TIME(start);
+    size_t H = bmp->bmih.height;
+    DeltaHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+
+    int in = open(input_file, O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0)
+    {
+        if (in >= 0)
+        {
+            close(in);
+        }
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+    header.base_size = st.st_size;
+    header.base_offset = bmp->bmfh.pixelArrOffset;
+    header.stride = bmp->stride;
+    header.row_bytes = (uint64_t)bmp->bmih.width * bmp->pixel_bytes;
+    header.height = H;
+    int code = hashHeader(in, bmp->bmfh.pixelArrOffset, &header.base_hash, &header.base_header);
+    if (code == 0)
+    {
+        // пиксели в памяти уже изменены, хешируется сам файл
+        code = hashPixels(in, header.base_size, header.base_offset, header.stride, header.row_bytes, H, &header.base_pixels);
+    }
+    close(in);
+    if (code != 0)
+    {
+        return code;
+    }
+
+    // заголовки результата - те же байты, что записал бы writeBMP
+    char *headers = NULL;
+    size_t header_size = 0;
+    FILE *memory = open_memstream(&headers, &header_size);
+    if (memory == NULL)
+    {
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    writeHeaders(memory, bmp);
+    if (fclose(memory) != 0)
+    {
+        free(headers);
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+
+    DeltaSpan *spans = NULL;
+    size_t count = 0;
+    if ((code = buildSpans(bmp, &spans, &count)) != 0)
+    {
+        free(headers);
+        return code;
+    }
+
+    header.result_size = header_size + (uint64_t)bmp->stride * H;
+    header.header_size = header_size;
+    header.span_count = count;
+
+    FILE *ff = fopen(filename, "wb");
+    if (!ff)
+    {
+        free(spans);
+        free(headers);
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    fwrite(&header, sizeof(header), 1, ff);
+    fwrite(headers, 1, header_size, ff);
+    fwrite(spans, sizeof(DeltaSpan), count, ff);
+    size_t written = sizeof(header) + sizeof(DeltaSpan) * count; // заголовки уже учёл writeHeaders
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t y = bmp->top_down ? H - 1 - spans[i].first_row : spans[i].first_row;
+        if (spans[i].bytes == bmp->stride)
+        {
+            // строки во всю ширину идут в буфере подряд в порядке файла, начиная с первой строки файла
+            fwrite(getRow(bmp, y), 1, bmp->stride * spans[i].rows, ff);
+        }
+        else
+        {
+            for (size_t r = 0; r < spans[i].rows; r++)
+            {
+                size_t row = bmp->top_down ? y - r : y + r;
+                fwrite((unsigned char *)getRow(bmp, row) + spans[i].offset, 1, spans[i].bytes, ff);
+            }
+        }
+        written += spans[i].bytes * spans[i].rows;
+    }
+    int failed = fclose(ff) != 0;
+    free(spans);
+    free(headers);
+    STATS_ADD(bytes_written, written);
+    STATS_ELAPSED(save_ns, start);
+    if (failed)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    return 0;
+}
+
+// Проверяет, что отрезки патча лежат в изображении, идут по возрастанию первой строки
+// и их байты занимают ровно остаток файла патча
+static int checkPatch(const unsigned char *data, size_t size, DeltaHeader *header, const DeltaSpan **spans)
+{
+    if (size < sizeof(DeltaHeader))
+    {
+        return 0;
+    }
+    memcpy(header, data, sizeof(DeltaHeader));
+    if (memcmp(header->magic, DELTA_MAGIC, sizeof(header->magic)) != 0 || header->row_bytes > header->stride ||
+        header->height > UINT32_MAX || header->stride > UINT32_MAX || header->header_size > MAX_HEADER_EXTRA + 1024 ||
+        header->base_offset > header->base_size || header->base_header > header->base_offset ||
+        header->result_size != header->header_size + header->stride * header->height)
+    {
+        return 0;
+    }
+    size_t table = sizeof(DeltaHeader) + header->header_size;
+    if (size < table || (size - table) / sizeof(DeltaSpan) < header->span_count)
+    {
+        return 0;
+    }
+    *spans = (const DeltaSpan *)(data + table);
+    uint64_t left = size - table - header->span_count * sizeof(DeltaSpan);
+    uint64_t first_row = 0;
+    for (uint64_t i = 0; i < header->span_count; i++)
+    {
+        DeltaSpan span;
+        memcpy(&span, *spans + i, sizeof(span));
+        if (span.first_row < first_row || span.first_row >= header->height || span.rows == 0 ||
+            span.rows > header->height - span.first_row || span.bytes == 0 || span.offset >= header->stride ||
+            span.bytes > header->stride - span.offset || span.rows * span.bytes > left)
+        {
+            return 0;
+        }
+        first_row = span.first_row;
+        left -= span.rows * span.bytes;
+    }
+    return left == 0;
+}
+
+// Обнуляет выравнивание строк: в исходном файле там мог быть мусор
+static void clearPatchPadding(int out, DeltaHeader *header)
+{
+    size_t padding = header->stride - header->row_bytes;
+    if (padding == 0 || header->height == 0)
+    {
+        return;
+    }
+    unsigned char *map = mmap(NULL, header->result_size, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+    if (map == MAP_FAILED)
+    {
+        return;
+    }
+    unsigned char *pixels = map + header->header_size;
+    for (uint64_t i = 0; i < header->height; i++)
+    {
+        unsigned char *tail = pixels + i * header->stride + header->row_bytes;
+        for (size_t k = 0; k < padding; k++)
+        {
+            // страницы, где выравнивание уже нулевое, не становятся грязными
+            if (tail[k] != 0)
+            {
+                memset(tail, 0, padding);
+                break;
+            }
+        }
+    }
+    munmap(map, header->result_size);
+}
+
+static int writeAll(int fd, const unsigned char *data, size_t size, off_t offset)
+{
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t n = pwrite(fd, data + done, size - done, offset + done);
+        if (n <= 0)
+        {
+            return setError(FILE_WRITE_ERROR, "Error: file writing error");
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Восстанавливает полный результат из исходного файла base и патча: патч
+// отображается в память, base копируется в output ядром (или правится на месте,
+// если output - тот же файл), затем заголовки и участки отрезков пишутся pwrite
+int applyPatch(char *base_file, char *patch_file, char *output_file)
+{
+    STATS_TIME(start);
+    int fd = open(patch_file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+    size_t size = st.st_size;
+    unsigned char *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    DeltaHeader header;
+    const DeltaSpan *spans = NULL;
+    if (data == MAP_FAILED || !checkPatch(data, size, &header, &spans))
+    {
+        if (data != MAP_FAILED)
+        {
+            munmap(data, size);
+        }
+        return setError(FILE_READ_ERROR, "Error: not a valid patch file");
+    }
+
+    int code = 0;
+    int in = open(base_file, O_RDONLY);
+    uint64_t hash, hashed, pixels = 0;
+    if (in < 0 || fstat(in, &st) != 0)
+    {
+        code = setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+    else if ((uint64_t)st.st_size != header.base_size)
+    {
+        code = setError(WRONG_ARGUMENTS_ERROR, "Error: the patch was made for a different base file");
+    }
+    // base проверяется целиком до первой записи, в том числе когда output - тот же файл
+    else if ((code = hashHeader(in, header.base_header, &hash, &hashed)) == 0 &&
+             (code = hashPixels(in, header.base_size, header.base_offset, header.stride, header.row_bytes, header.height, &pixels)) == 0 &&
+             (hashed != header.base_header || hash != header.base_hash || pixels != header.base_pixels))
+    {
+        code = setError(WRONG_ARGUMENTS_ERROR, "Error: the patch was made for a different base file");
+    }
+
+    int out = -1;
+    int same = code == 0 && isSameFile(base_file, output_file);
+    if (code == 0)
+    {
+        out = same ? open(output_file, O_RDWR) : open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        size_t copy = header.base_size < header.result_size ? header.base_size : header.result_size;
+        // байты за концом короткого исходного файла становятся нулями, как при обычной записи
+        if (out < 0 || (!same && copyRange(in, out, 0, copy) != 0) || ftruncate(out, header.result_size) != 0)
+        {
+            code = setError(FILE_WRITE_ERROR, "Error: file writing error");
+        }
+    }
+    if (in >= 0)
+    {
+        close(in);
+    }
+
+    const unsigned char *rows = (const unsigned char *)(spans + header.span_count);
+    size_t written = 0;
+    if (code == 0)
+    {
+        code = writeAll(out, data + sizeof(DeltaHeader), header.header_size, 0);
+    }
+    for (uint64_t i = 0; code == 0 && i < header.span_count; i++)
+    {
+        DeltaSpan span;
+        memcpy(&span, spans + i, sizeof(span));
+        off_t offset = header.header_size + span.first_row * header.stride + span.offset;
+        if (span.bytes == header.stride)
+        {
+            code = writeAll(out, rows, span.rows * span.bytes, offset);
+        }
+        for (uint64_t r = 0; code == 0 && span.bytes != header.stride && r < span.rows; r++)
+        {
+            code = writeAll(out, rows + r * span.bytes, span.bytes, offset + r * header.stride);
+        }
+        rows += span.rows * span.bytes;
+        written += span.rows * span.bytes;
+    }
+    if (code == 0)
+    {
+        clearPatchPadding(out, &header);
+    }
+    if (out >= 0 && close(out) != 0 && code == 0)
+    {
+        code = setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    munmap(data, size);
+    STATS_ADD(bytes_written, header.header_size + written);
+    STATS_ELAPSED(save_ns, start);
+    return code;
+}
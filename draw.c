@@ -0,0 +1,382 @@
+#include "bmp.h"
+
+#include <math.h>
+#include <string.h>
+
+int checkDataDrawCircle(BMP *bmp, int coord_x, int coord_y, int radius, int thickness, Rgb *line_color, int fill, Rgb *fill_color)
+{
+    if (bmp->pixels == NULL)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: can not find image data");
+    }
+    if (radius <= 0)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: circle radius must be positive");
+    }
+    if (thickness <= 0)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: thickness must be positive");
+    }
+    if (fill == 1 && fill_color == NULL)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: no fill color given");
+    }
+    return 0;
+}
+
+// Целочисленный квадратный корень: наибольшее a, для которого a * a <= n
+static long long isqrt(long long n)
+{
+    long long a = (long long)sqrt((double)n);
+    while (a * a > n)
+    {
+        a--;
+    }
+    while ((a + 1) * (a + 1) <= n)
+    {
+        a++;
+    }
+    return a;
+}
+
+// Закрашивает отрезок строки y от x0 до x1 включительно, обрезая его по столбцам [clip_begin, clip_end]
+static void fillClippedSpan(BMP *bmp, int y, int x0, int x1, int clip_begin, int clip_end, Rgb *color)
+{
+    if (x0 < clip_begin)
+    {
+        x0 = clip_begin;
+    }
+    if (x1 > clip_end)
+    {
+        x1 = clip_end;
+    }
+    if (x0 > x1)
+    {
+        return;
+    }
+    markPixels(bmp, y, y + 1, x0, x1);
+    if (bmp->pixel_bytes == 4)
+    {
+        // 32 бит: пиксель - одно слово BGRA; без альфа-канала четвёртый байт сохраняется
+        unsigned char *row = (unsigned char *)getRow(bmp, y);
+        uint32_t value = color->b | (uint32_t)color->g << 8 | (uint32_t)color->r << 16;
+        if (bmp->alpha)
+        {
+            value |= 0xff000000u;
+            for (int x = x0; x <= x1; x++)
+            {
+                memcpy(row + (size_t)x * 4, &value, 4);
+            }
+        }
+        else
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                uint32_t word;
+                memcpy(&word, row + (size_t)x * 4, 4);
+                word = (word & 0xff000000u) | value;
+                memcpy(row + (size_t)x * 4, &word, 4);
+            }
+        }
+        return;
+    }
+    Rgb *row = getRow(bmp, y);
+    for (int x = x0; x <= x1; x++)
+    {
+        row[x] = *color;
+    }
+}
+
+// Закрашивает отрезок строки y от x0 до x1 включительно, обрезая его по краям изображения
+void fillSpan(BMP *bmp, int y, int x0, int x1, Rgb *color)
+{
+    fillClippedSpan(bmp, y, x0, x1, 0, bmp->bmih.width - 1, color);
+}
+
+void drawCircle(BMP *bmp, int coord_x, int coord_y, int radius, int thickness, Rgb *line_color, int fill, Rgb *fill_color)
+{
+    drawCircleClipped(bmp, coord_x, coord_y, radius, thickness, line_color, fill, fill_color,
+                      0, bmp->bmih.width - 1, bandBegin(bmp), bandEnd(bmp) - 1);
+}
+
+// Рисует только часть окружности внутри прямоугольника столбцов [x_begin, x_end]
+// и строк [y_begin, y_end]; пиксели те же, что и у drawCircle
+void drawCircleClipped(BMP *bmp, int coord_x, int coord_y, int radius, int thickness, Rgb *line_color, int fill, Rgb *fill_color,
+                       int x_begin, int x_end, int y_begin, int y_end)
+{
+    if (x_begin < 0)
+    {
+        x_begin = 0;
+    }
+    if (x_end > (int)bmp->bmih.width - 1)
+    {
+        x_end = bmp->bmih.width - 1;
+    }
+    if (y_begin < bandBegin(bmp))
+    {
+        y_begin = bandBegin(bmp);
+    }
+    if (y_end > bandEnd(bmp) - 1)
+    {
+        y_end = bandEnd(bmp) - 1;
+    }
+
+    int inner_radius = radius - thickness / 2;
+    if (inner_radius < 0)
+    {
+        inner_radius = 0;
+    }
+
+    int outer_radius = radius + thickness / 2;
+    long long outer_squared = (long long)outer_radius * outer_radius;
+    long long inner_squared = (long long)inner_radius * inner_radius;
+
+    long long min_y = (long long)coord_y - outer_radius;
+    long long max_y = (long long)coord_y + outer_radius;
+    if (min_y < y_begin)
+    {
+        min_y = y_begin;
+    }
+    if (max_y > y_end)
+    {
+        max_y = y_end;
+    }
+
+    // для каждой строки кольцо - это отрезки, где inner^2 <= dx^2 + dy^2 <= outer^2,
+    // а заливка - отрезок, где dx^2 + dy^2 < inner^2
+    for (int y = min_y; y <= max_y; y++)
+    {
+        long long dy_squared = (long long)(y - coord_y) * (y - coord_y);
+        int outer_dx = isqrt(outer_squared - dy_squared);
+        if (inner_squared > dy_squared)
+        {
+            int inner_dx = isqrt(inner_squared - dy_squared - 1);
+            fillClippedSpan(bmp, y, coord_x - outer_dx, coord_x - inner_dx - 1, x_begin, x_end, line_color);
+            fillClippedSpan(bmp, y, coord_x + inner_dx + 1, coord_x + outer_dx, x_begin, x_end, line_color);
+            if (fill)
+            {
+                fillClippedSpan(bmp, y, coord_x - inner_dx, coord_x + inner_dx, x_begin, x_end, fill_color);
+            }
+        }
+        else
+        {
+            fillClippedSpan(bmp, y, coord_x - outer_dx, coord_x + outer_dx, x_begin, x_end, line_color);
+        }
+    }
+}
+
+static void swap(int *a, int *b)
+{
+    int temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+// Закрашивает прямоугольник столбцов [x0, x1] и строк [y0, y1], обрезанный по краям
+// изображения и текущей полосе: первая строка закрашивается, остальные копируются из неё
+static void fillRect(BMP *bmp, long long x0, long long x1, long long y0, long long y1, Rgb *color)
+{
+    if (x0 < 0)
+    {
+        x0 = 0;
+    }
+    if (x1 > (long long)bmp->bmih.width - 1)
+    {
+        x1 = (long long)bmp->bmih.width - 1;
+    }
+    if (y0 < bandBegin(bmp))
+    {
+        y0 = bandBegin(bmp);
+    }
+    if (y1 > bandEnd(bmp) - 1)
+    {
+        y1 = bandEnd(bmp) - 1;
+    }
+    if (x0 > x1 || y0 > y1)
+    {
+        return;
+    }
+
+    fillSpan(bmp, y0, x0, x1, color);
+    if (bmp->pixel_bytes == 4 && !bmp->alpha)
+    {
+        // четвёртый байт у каждого пикселя свой, копировать строку нельзя
+        for (long long y = y0 + 1; y <= y1; y++)
+        {
+            fillSpan(bmp, y, x0, x1, color);
+        }
+        return;
+    }
+    markPixels(bmp, y0, y1 + 1, x0, x1);
+    unsigned char *first = (unsigned char *)getPixel(bmp, x0, y0);
+    size_t bytes = (size_t)(x1 - x0 + 1) * bmp->pixel_bytes;
+    for (long long y = y0 + 1; y <= y1; y++)
+    {
+        memcpy(getPixel(bmp, x0, y), first, bytes);
+    }
+}
+
+// Наклонная линия - прямоугольник ширины thickness с осью на отрезке; в каждой
+// строке закрашиваются пиксели, центры которых лежат внутри него
+static void drawSlantedLine(BMP *bmp, int x0, int y0, int x1, int y1, int thickness, Rgb *color)
+{
+    // вершины в номерах строк изображения (снизу вверх)
+    double H = bmp->bmih.height;
+    double dx = x1 - x0;
+    double dy = (H - y1) - (H - y0);
+    double length = sqrt(dx * dx + dy * dy);
+    // полоса откладывается от отрезка в ту же сторону, что у прямых линий:
+    // вверх (к большим номерам строк) и влево. Прямые линии закрашивают
+    // thickness + 1 пикселей поперёк и оба конца, то есть все пиксели, центры
+    // которых не дальше полупикселя от отрезка и полосы, поэтому и здесь полоса
+    // расширена на полпикселя во все стороны: наклон на пиксель её не сдвигает
+    double ux = dx / length;
+    double uy = dy / length;
+    double nx = -uy;
+    double ny = ux;
+    if (ny - nx < 0 || (ny - nx == 0 && ny < 0))
+    {
+        nx = -nx;
+        ny = -ny;
+    }
+    double near = -0.5;
+    double far = thickness + 0.5;
+    double px[4] = {x0 - ux / 2 + nx * near, x1 + ux / 2 + nx * near, x1 + ux / 2 + nx * far, x0 - ux / 2 + nx * far};
+    double py[4] = {H - y0 - uy / 2 + ny * near, H - y1 + uy / 2 + ny * near, H - y1 + uy / 2 + ny * far,
+                    H - y0 - uy / 2 + ny * far};
+
+    double min_y = py[0];
+    double max_y = py[0];
+    for (int i = 1; i < 4; i++)
+    {
+        min_y = py[i] < min_y ? py[i] : min_y;
+        max_y = py[i] > max_y ? py[i] : max_y;
+    }
+    double row_begin = ceil(min_y) > bandBegin(bmp) ? ceil(min_y) : bandBegin(bmp);
+    double row_end = floor(max_y) < bandEnd(bmp) - 1 ? floor(max_y) : bandEnd(bmp) - 1;
+
+    for (int y = row_begin; y <= row_end; y++)
+    {
+        // пересечение строки с выпуклым четырёхугольником - один отрезок
+        double left = INFINITY;
+        double right = -INFINITY;
+        for (int i = 0; i < 4; i++)
+        {
+            int j = (i + 1) % 4;
+            if ((py[i] <= y && y <= py[j]) || (py[j] <= y && y <= py[i]))
+            {
+                double x = py[i] == py[j] ? px[i] : px[i] + (y - py[i]) * (px[j] - px[i]) / (py[j] - py[i]);
+                double other = py[i] == py[j] ? px[j] : x;
+                left = fmin(left, fmin(x, other));
+                right = fmax(right, fmax(x, other));
+            }
+        }
+        left = fmax(ceil(left), -1);
+        right = fmin(floor(right), bmp->bmih.width);
+        if (left <= right)
+        {
+            fillSpan(bmp, y, left, right, color);
+        }
+    }
+}
+
+int checkDataDrawLine(BMP *bmp, int x0, int y0, int x1, int y1, int thickness, Rgb *color)
+{
+    if (bmp->pixels == NULL)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: can not find image data");
+    }
+    if (x0 < 0 || y0 < 0 || x1 < 0 || y1 < 0)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: line coordinates must not be negative");
+    }
+    if (thickness <= 0)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: thickness must be positive");
+    }
+    return 0;
+}
+
+// Вертикальная линия занимает столбцы от x0 - thickness до x0, горизонтальная -
+// строки от H - y0 до H - y0 + thickness; остальные линии рисуются по строкам
+// как полоса той же ширины, отложенная от отрезка в ту же сторону
+void drawLine(BMP *bmp, int x0, int y0, int x1, int y1, int thickness, Rgb *color)
+{
+    if (x0 < 0 || y0 < 0 || x1 < 0 || y1 < 0 || thickness <= 0)
+    {
+        return;
+    }
+
+    long long H = bmp->bmih.height;
+    if (x0 == x1)
+    {
+        if (y0 > y1)
+        {
+            swap(&y0, &y1);
+        }
+        fillRect(bmp, (long long)x0 - thickness, x0, H - y1, H - y0, color);
+    }
+    else if (y0 == y1)
+    {
+        if (x0 > x1)
+        {
+            swap(&x0, &x1);
+        }
+        fillRect(bmp, x0, x1, H - y0, H - y0 + thickness, color);
+    }
+    else
+    {
+        drawSlantedLine(bmp, x0, y0, x1, y1, thickness, color);
+    }
+}
+
+int checkDataDividePicture(BMP *bmp, int thickness, int countY, int countX, Rgb *line_color)
+{
+    if (bmp->pixels == NULL)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: can not find image data");
+    }
+    if (countY <= 1)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: --number_x argument must be greater than 1");
+    }
+    if (countX <= 1)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: --number_y argument must be greater than 1");
+    }
+    if (thickness <= 0)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: thickness must be positive");
+    }
+    return 0;
+}
+
+void dividePicture(BMP *bmp, int thickness, int countY, int countX, Rgb *line_color)
+{
+    int W = bmp->bmih.width;
+    int H = bmp->bmih.height;
+
+    // вертикальные линии проходят через все строки: за один проход по строкам
+    // в каждой закрашиваются короткие отрезки от x - thickness до x
+    int step_x = W / countX;
+    for (int y = bandBegin(bmp); y < bandEnd(bmp); y++)
+    {
+        for (int i = 1; i < countX; i++)
+        {
+            long long x = (long long)i * step_x;
+            long long left = x - thickness > 0 ? x - thickness : 0;
+            if (left < W)
+            {
+                fillSpan(bmp, y, left, x < W ? x : W - 1, line_color);
+            }
+        }
+    }
+
+    // горизонтальные линии - полосы во всю ширину, строки копируются
+    int step_y = H / countY;
+    for (int i = 1; i < countY; i++)
+    {
+        long long y0 = (long long)i * step_y;
+        fillRect(bmp, 0, W - 1, H - y0, H - y0 + thickness, line_color);
+    }
+}
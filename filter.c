@@ -0,0 +1,522 @@
+#include "bmp.h"
+
+#include <math.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+int checkDataRgbFilter(BMP *bmp, char *component_name, int component_value)
+{
+    if (!(bmp->pixels != NULL && 0 <= component_value && component_value <= 255))
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: wrong data passed to function --rgbfilter");
+    }
+    if (component_name == NULL || !(strcmp(component_name, "red") == 0 || strcmp(component_name, "green") == 0 || strcmp(component_name, "blue") == 0))
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: Invalid component name (red, green, or blue expected)");
+    }
+    if (!(0 <= component_value && component_value <= 255))
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: Color values must be between 0 and 255");
+    }
+    return 0;
+}
+
+// Ядра заполнения: в упакованной строке BGR или BGRA байты, отмеченные в mask,
+// заменяются байтами values. Маска и значения заданы на 96 байт; блоки векторных
+// ядер кратны и 3, и 4 байтам, поэтому один шаблон подходит ко всем блокам строки
+typedef void (*FilterKernel)(unsigned char *row, size_t bytes, const unsigned char *mask, const unsigned char *values);
+
+static void filterRowScalar(unsigned char *row, size_t bytes, const unsigned char *mask, const unsigned char *values)
+{
+    size_t i = 0;
+    for (; i + 96 <= bytes; i += 96)
+    {
+        for (int j = 0; j < 96; j++)
+        {
+            row[i + j] = mask[j] ? values[j] : row[i + j];
+        }
+    }
+    for (int j = 0; i + j < bytes; j++)
+    {
+        row[i + j] = mask[j] ? values[j] : row[i + j];
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+// 48 байт = 16 пикселей = три вектора SSE
+__attribute__((target("sse4.1"))) static void filterRowSse41(unsigned char *row, size_t bytes, const unsigned char *mask, const unsigned char *values)
+{
+    __m128i m0 = _mm_loadu_si128((const __m128i *)mask);
+    __m128i m1 = _mm_loadu_si128((const __m128i *)(mask + 16));
+    __m128i m2 = _mm_loadu_si128((const __m128i *)(mask + 32));
+    __m128i v0 = _mm_loadu_si128((const __m128i *)values);
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(values + 16));
+    __m128i v2 = _mm_loadu_si128((const __m128i *)(values + 32));
+
+    size_t i = 0;
+    for (; i + 48 <= bytes; i += 48)
+    {
+        __m128i *p = (__m128i *)(row + i);
+        _mm_storeu_si128(p, _mm_blendv_epi8(_mm_loadu_si128(p), v0, m0));
+        _mm_storeu_si128(p + 1, _mm_blendv_epi8(_mm_loadu_si128(p + 1), v1, m1));
+        _mm_storeu_si128(p + 2, _mm_blendv_epi8(_mm_loadu_si128(p + 2), v2, m2));
+    }
+    filterRowScalar(row + i, bytes - i, mask, values);
+}
+
+// 96 байт = 32 пикселя = три вектора AVX2
+__attribute__((target("avx2"))) static void filterRowAvx2(unsigned char *row, size_t bytes, const unsigned char *mask, const unsigned char *values)
+{
+    __m256i m0 = _mm256_loadu_si256((const __m256i *)mask);
+    __m256i m1 = _mm256_loadu_si256((const __m256i *)(mask + 32));
+    __m256i m2 = _mm256_loadu_si256((const __m256i *)(mask + 64));
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)values);
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(values + 32));
+    __m256i v2 = _mm256_loadu_si256((const __m256i *)(values + 64));
+
+    size_t i = 0;
+    for (; i + 96 <= bytes; i += 96)
+    {
+        __m256i *p = (__m256i *)(row + i);
+        _mm256_storeu_si256(p, _mm256_blendv_epi8(_mm256_loadu_si256(p), v0, m0));
+        _mm256_storeu_si256(p + 1, _mm256_blendv_epi8(_mm256_loadu_si256(p + 1), v1, m1));
+        _mm256_storeu_si256(p + 2, _mm256_blendv_epi8(_mm256_loadu_si256(p + 2), v2, m2));
+    }
+    filterRowSse41(row + i, bytes - i, mask, values);
+}
+#endif
+
+// Ядра таблиц общего вида (applyLut): обрабатывают столько пикселей с начала
+// строки, сколько помещается в их блоки, и возвращают это число; остаток
+// досчитывает скалярный цикл lutRow
+typedef size_t (*LutKernel)(unsigned char *row, size_t pixels, int step, const ChannelLut *lut);
+
+#ifdef HAVE_X86_SIMD
+#define AVX512_LUT_TARGET __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+
+// Таблица на 256 значений - четыре вектора по 64 байта: vpermi2b выбирает по
+// младшим 7 битам из пары векторов, старший бит значения выбирает пару
+AVX512_LUT_TARGET static inline __m512i lookupAvx512(__m512i x, const __m512i *table)
+{
+    __m512i low = _mm512_permutex2var_epi8(table[0], x, table[1]);
+    __m512i high = _mm512_permutex2var_epi8(table[2], x, table[3]);
+    return _mm512_mask_blend_epi8(_mm512_movepi8_mask(x), low, high);
+}
+
+// 192 байта = 64 пикселя BGR или 48 BGRA. Блок начинается с пикселя, поэтому
+// канал каждого байта и его источник при перестановке каналов известны заранее.
+// Источник лежит в том же пикселе, не дальше 2 байт, и выбирается из двух окон,
+// сдвинутых на 2 байта назад и вперёд; байты за краями строки не читаются
+// (маскированная загрузка). Все загрузки блока идут до записи, так что на месте
+// ничего не затирается раньше времени
+AVX512_LUT_TARGET static size_t lutRowAvx512(unsigned char *row, size_t pixels, int step, const ChannelLut *lut)
+{
+    size_t bytes = pixels * step;
+    if (bytes < 192)
+    {
+        return 0;
+    }
+    __m512i tables[3][4];
+    for (int c = 0; c < 3; c++)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            tables[c][k] = _mm512_loadu_si512(lut->table[c] + 64 * k);
+        }
+    }
+    int same = memcmp(lut->table[0], lut->table[1], 256) == 0 && memcmp(lut->table[0], lut->table[2], 256) == 0;
+    int swap = lut->source[0] != 0 || lut->source[1] != 1 || lut->source[2] != 2;
+
+    __mmask64 channels[3][3];
+    __mmask64 colors[3]; // байты каналов B, G, R (без альфы)
+    __m512i index[3];
+    for (int v = 0; v < 3; v++)
+    {
+        unsigned char source[64];
+        colors[v] = 0;
+        for (int c = 0; c < 3; c++)
+        {
+            channels[v][c] = 0;
+        }
+        for (int j = 0; j < 64; j++)
+        {
+            int c = (64 * v + j) % step;
+            int d = c < 3 ? lut->source[c] - c : 0;
+            if (c < 3)
+            {
+                channels[v][c] |= 1ull << j;
+                colors[v] |= 1ull << j;
+            }
+            source[j] = j + d + 2 < 64 ? j + d + 2 : 64 + j + d - 2;
+        }
+        index[v] = _mm512_loadu_si512(source);
+    }
+
+    size_t i = 0;
+    for (; i + 192 <= bytes; i += 192)
+    {
+        __m512i in[3];
+        for (int v = 0; v < 3; v++)
+        {
+            size_t at = i + 64 * v;
+            if (swap)
+            {
+                __mmask64 before = at >= 2 ? ~0ull : ~0ull << 2;
+                __mmask64 after = at + 66 <= bytes ? ~0ull : ~0ull >> 2;
+                __m512i a = _mm512_maskz_loadu_epi8(before, row + at - 2);
+                __m512i b = _mm512_maskz_loadu_epi8(after, row + at + 2);
+                in[v] = _mm512_permutex2var_epi8(a, index[v], b);
+            }
+            else
+            {
+                in[v] = _mm512_loadu_si512(row + at);
+            }
+        }
+        for (int v = 0; v < 3; v++)
+        {
+            __m512i x = in[v];
+            __m512i result;
+            if (same)
+            {
+                result = _mm512_mask_blend_epi8(colors[v], x, lookupAvx512(x, tables[0]));
+            }
+            else
+            {
+                result = _mm512_mask_blend_epi8(channels[v][0], x, lookupAvx512(x, tables[0]));
+                result = _mm512_mask_blend_epi8(channels[v][1], result, lookupAvx512(x, tables[1]));
+                result = _mm512_mask_blend_epi8(channels[v][2], result, lookupAvx512(x, tables[2]));
+            }
+            _mm512_storeu_si512(row + i + 64 * v, result);
+        }
+    }
+    return i / step;
+}
+#endif
+
+static FilterKernel filter_kernel = filterRowScalar;
+static LutKernel lut_kernel = NULL; // NULL - только скалярный цикл
+static pthread_once_t filter_kernel_once = PTHREAD_ONCE_INIT;
+
+static void selectFilterKernel()
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        filter_kernel = filterRowAvx2;
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+        filter_kernel = filterRowSse41;
+    }
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi"))
+    {
+        lut_kernel = lutRowAvx512;
+    }
+#endif
+}
+
+// Принудительный выбор ядра (для проверки ядер друг против друга);
+// возвращает 0, если процессор его не поддерживает, и тогда ядро не меняется
+int setFilterKernel(int kernel)
+{
+    pthread_once(&filter_kernel_once, selectFilterKernel);
+    if (kernel == FILTER_KERNEL_SCALAR)
+    {
+        filter_kernel = filterRowScalar;
+        return 1;
+    }
+#ifdef HAVE_X86_SIMD
+    if (kernel == FILTER_KERNEL_SSE41 && __builtin_cpu_supports("sse4.1"))
+    {
+        filter_kernel = filterRowSse41;
+        return 1;
+    }
+    if (kernel == FILTER_KERNEL_AVX2 && __builtin_cpu_supports("avx2"))
+    {
+        filter_kernel = filterRowAvx2;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+int setLutKernel(int kernel)
+{
+    pthread_once(&filter_kernel_once, selectFilterKernel);
+    if (kernel == LUT_KERNEL_SCALAR)
+    {
+        lut_kernel = NULL;
+        return 1;
+    }
+#ifdef HAVE_X86_SIMD
+    if (kernel == LUT_KERNEL_AVX512 && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi"))
+    {
+        lut_kernel = lutRowAvx512;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+void initLut(ChannelLut *lut)
+{
+    for (int c = 0; c < 3; c++)
+    {
+        lut->source[c] = c;
+        for (int v = 0; v < 256; v++)
+        {
+            lut->table[c][v] = v;
+        }
+    }
+}
+
+// Каналы задаются буквами r, g, b; результат - маска по смещениям в Rgb
+static int parseChannels(char *channels, int *selected)
+{
+    *selected = 0;
+    if (channels == NULL)
+    {
+        *selected = 7;
+        return 0;
+    }
+    for (char *c = channels; *c; c++)
+    {
+        if (*c == 'r')
+            *selected |= 1 << offsetof(Rgb, r);
+        else if (*c == 'g')
+            *selected |= 1 << offsetof(Rgb, g);
+        else if (*c == 'b')
+            *selected |= 1 << offsetof(Rgb, b);
+        else
+            return setError(WRONG_ARGUMENTS_ERROR, "Error: invalid channels (letters r, g and b expected)");
+    }
+    return *selected ? 0 : setError(WRONG_ARGUMENTS_ERROR, "Error: invalid channels (letters r, g and b expected)");
+}
+
+// Перестановка каналов: буква на позиции красного, зелёного и синего называет
+// канал, из которого он берётся ("bgr" меняет местами красный и синий)
+static int parseSwap(char *order, ChannelLut *lut)
+{
+    static const int targets[3] = {offsetof(Rgb, r), offsetof(Rgb, g), offsetof(Rgb, b)};
+    int selected = 0;
+    if (order == NULL || strlen(order) != 3 || parseChannels(order, &selected) != 0 || selected != 7)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: swap expects a permutation of \"rgb\"");
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        lut->source[targets[i]] = order[i] == 'r' ? offsetof(Rgb, r) : order[i] == 'g' ? offsetof(Rgb, g) : offsetof(Rgb, b);
+    }
+    return 0;
+}
+
+static unsigned char clampByte(double value)
+{
+    return value <= 0 ? 0 : value >= 255 ? 255 : (unsigned char)(value + 0.5);
+}
+
+// Строит таблицы одного преобразования "<op>[=<arg>]" для выбранных каналов:
+//   set=V, scale=K, invert, clamp=LO.HI, gamma=G, threshold=T, swap=<rgb>
+int buildLut(char *spec, char *channels, ChannelLut *lut)
+{
+    initLut(lut);
+    if (spec == NULL)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: wrong argument");
+    }
+    char name[16];
+    char *arg = strchr(spec, '=');
+    size_t length = arg ? (size_t)(arg - spec) : strlen(spec);
+    if (length >= sizeof(name))
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: unknown --lut operation");
+    }
+    memcpy(name, spec, length);
+    name[length] = '\0';
+    arg = arg ? arg + 1 : NULL;
+
+    if (strcmp(name, "swap") == 0)
+    {
+        return parseSwap(arg, lut);
+    }
+    int selected;
+    int code = parseChannels(channels, &selected);
+    if (code != 0)
+    {
+        return code;
+    }
+
+    unsigned char table[256];
+    double number = 0;
+    int low = 0, high = 0;
+    if (strcmp(name, "invert") == 0)
+    {
+        for (int v = 0; v < 256; v++)
+            table[v] = 255 - v;
+    }
+    else if (strcmp(name, "clamp") == 0)
+    {
+        if (arg == NULL || sscanf(arg, "%d.%d", &low, &high) != 2 || low < 0 || high > 255 || low > high)
+        {
+            return setError(WRONG_ARGUMENTS_ERROR, "Error: clamp expects LO.HI with 0 <= LO <= HI <= 255");
+        }
+        for (int v = 0; v < 256; v++)
+            table[v] = v < low ? low : v > high ? high : v;
+    }
+    else if (arg == NULL || sscanf(arg, "%lf", &number) != 1)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: unknown --lut operation or missing argument");
+    }
+    else if (strcmp(name, "set") == 0 || strcmp(name, "threshold") == 0)
+    {
+        if (number < 0 || number > 255)
+        {
+            return setError(WRONG_ARGUMENTS_ERROR, "Error: Color values must be between 0 and 255");
+        }
+        for (int v = 0; v < 256; v++)
+            table[v] = name[0] == 's' ? (unsigned char)number : v >= number ? 255 : 0;
+    }
+    else if (strcmp(name, "scale") == 0)
+    {
+        if (number < 0)
+        {
+            return setError(WRONG_ARGUMENTS_ERROR, "Error: scale factor must not be negative");
+        }
+        for (int v = 0; v < 256; v++)
+            table[v] = clampByte(v * number);
+    }
+    else if (strcmp(name, "gamma") == 0)
+    {
+        if (number <= 0)
+        {
+            return setError(WRONG_ARGUMENTS_ERROR, "Error: gamma must be positive");
+        }
+        for (int v = 0; v < 256; v++)
+            table[v] = clampByte(255.0 * pow(v / 255.0, 1.0 / number));
+    }
+    else
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: unknown --lut operation");
+    }
+
+    for (int c = 0; c < 3; c++)
+    {
+        if (selected & (1 << c))
+        {
+            memcpy(lut->table[c], table, sizeof(table));
+        }
+    }
+    return 0;
+}
+
+// Дописывает преобразование next после lut: канал c берётся из того же
+// исходного канала, что и next->source[c] в lut, и проходит обе таблицы
+void composeLut(ChannelLut *lut, const ChannelLut *next)
+{
+    ChannelLut result;
+    for (int c = 0; c < 3; c++)
+    {
+        int middle = next->source[c];
+        result.source[c] = lut->source[middle];
+        for (int v = 0; v < 256; v++)
+        {
+            result.table[c][v] = next->table[c][lut->table[middle][v]];
+        }
+    }
+    *lut = result;
+}
+
+// Общий случай: каждый пиксель проходит через три таблицы; альфа не меняется
+static void lutRow(unsigned char *row, size_t pixels, int step, const ChannelLut *lut)
+{
+    const unsigned char *t0 = lut->table[0];
+    const unsigned char *t1 = lut->table[1];
+    const unsigned char *t2 = lut->table[2];
+    int s0 = lut->source[0], s1 = lut->source[1], s2 = lut->source[2];
+    for (size_t x = 0; x < pixels; x++, row += step)
+    {
+        unsigned char in[3] = {row[0], row[1], row[2]};
+        row[0] = t0[in[s0]];
+        row[1] = t1[in[s1]];
+        row[2] = t2[in[s2]];
+    }
+}
+
+// Применяет таблицы к строкам полосы за один проход. Если каналы не
+// переставляются и каждая таблица тождественна или постоянна (как у
+// --rgbfilter), проход сводится к векторному заполнению по маске, иначе
+// таблицы общего вида применяет ядро AVX-512 VBMI, если оно есть
+void applyLut(BMP *bmp, const ChannelLut *lut)
+{
+    int step = bmp->pixel_bytes;
+    int identity = 1;
+    int fill = 1;
+    unsigned char mask[96];
+    unsigned char values[96];
+    memset(mask, 0, sizeof(mask));
+    memset(values, 0, sizeof(values));
+    for (int c = 0; c < 3; c++)
+    {
+        int channel_identity = lut->source[c] == c;
+        int constant = 1;
+        for (int v = 0; v < 256; v++)
+        {
+            channel_identity &= lut->table[c][v] == v;
+            constant &= lut->table[c][v] == lut->table[c][0];
+        }
+        identity &= channel_identity;
+        fill &= channel_identity || constant;
+        if (!channel_identity && constant)
+        {
+            for (int i = c; i < 96; i += step)
+            {
+                mask[i] = 0xff;
+                values[i] = lut->table[c][0];
+            }
+        }
+    }
+    if (identity || bmp->rows == 0)
+    {
+        return;
+    }
+    markRows(bmp, bandBegin(bmp), bandEnd(bmp));
+
+    pthread_once(&filter_kernel_once, selectFilterKernel);
+    FilterKernel kernel = filter_kernel;
+    size_t row_bytes = (size_t)bmp->bmih.width * step;
+    // без выравнивания (в том числе всегда для 32 бит) строки идут подряд,
+    // и полосу можно обработать целиком
+    int whole = row_bytes == bmp->stride;
+    int begin = whole ? 0 : bandBegin(bmp);
+    int end = whole ? 1 : bandEnd(bmp);
+    for (int i = begin; i < end; i++)
+    {
+        unsigned char *row = whole ? bmp->pixels : (unsigned char *)getRow(bmp, i);
+        size_t bytes = whole ? row_bytes * bmp->rows : row_bytes;
+        if (fill)
+        {
+            kernel(row, bytes, mask, values);
+        }
+        else
+        {
+            size_t pixels = bytes / step;
+            size_t done = lut_kernel != NULL ? lut_kernel(row, pixels, step, lut) : 0;
+            lutRow(row + done * step, pixels - done, step, lut);
+        }
+    }
+}
+
+// Фильтр - частный случай таблиц: выбранный канал заменяется константой
+void rgbFilter(BMP *bmp, char *component_name, int value)
+{
+    ChannelLut lut;
+    char spec[16];
+    snprintf(spec, sizeof(spec), "set=%d", value);
+    char *channel = strcmp(component_name, "red") == 0 ? "r" : strcmp(component_name, "green") == 0 ? "g" : "b";
+    buildLut(spec, channel, &lut);
+    applyLut(bmp, &lut);
+}
@@ -0,0 +1,288 @@
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// Сколько байт строк одна задача читает за раз
+#define HISTOGRAM_CHUNK (4u << 20)
+// Копии гистограммы в потоке: соседние пиксели с одинаковым значением
+// увеличивают разные счётчики и не ждут друг друга
+#define HISTOGRAM_COPIES 4
+
+// Счётчики одного потока; выравнивание по кэш-линии, чтобы потоки не делили линии
+typedef struct __attribute__((aligned(64))) HistogramCounts
+{
+    uint64_t bins[3][256]; // каналы по смещениям в Rgb
+    uint64_t matches;      // пиксели цвета --color
+    int code;
+} HistogramCounts;
+
+typedef struct HistogramJob
+{
+    int fd;
+    BMP *bmp;
+    unsigned int chunk_rows;
+    unsigned int chunk_count;
+    unsigned int next_chunk; // следующая свободная порция строк (атомарно)
+    int match;               // считать пиксели цвета pattern
+    unsigned char pattern[48];
+    HistogramCounts *counts;
+} HistogramJob;
+
+// Считает значения каналов строки; у 32-битных пикселей альфа пропускается
+static void countRow(const unsigned char *row, unsigned int width, unsigned int bytes, uint32_t (*local)[3][256])
+{
+    unsigned int x = 0;
+    for (; x + HISTOGRAM_COPIES <= width; x += HISTOGRAM_COPIES)
+    {
+        for (int k = 0; k < HISTOGRAM_COPIES; k++)
+        {
+            const unsigned char *p = row + (size_t)(x + k) * bytes;
+            local[k][0][p[0]]++;
+            local[k][1][p[1]]++;
+            local[k][2][p[2]]++;
+        }
+    }
+    for (; x < width; x++)
+    {
+        const unsigned char *p = row + (size_t)x * bytes;
+        local[0][0][p[0]]++;
+        local[0][1][p[1]]++;
+        local[0][2][p[2]]++;
+    }
+}
+
+// Пиксели строки, совпадающие с цветом pattern (BGR, повторённым на 48 байт)
+static uint64_t matchRow(const unsigned char *row, unsigned int width, unsigned int bytes, const unsigned char *pattern)
+{
+    uint64_t matches = 0;
+    unsigned int x = 0;
+#ifdef HAVE_X86_SIMD
+    if (bytes == 3)
+    {
+        // 48 байт = 16 пикселей: пиксель совпал, если совпали все три его байта
+        __m128i p0 = _mm_loadu_si128((const __m128i *)pattern);
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(pattern + 16));
+        __m128i p2 = _mm_loadu_si128((const __m128i *)(pattern + 32));
+        for (; x + 16 <= width; x += 16)
+        {
+            const __m128i *p = (const __m128i *)(row + (size_t)x * 3);
+            uint64_t m = (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p), p0)) |
+                         (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 1), p1)) << 16 |
+                         (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), p2)) << 32;
+            matches += __builtin_popcountll(m & (m >> 1) & (m >> 2) & 0x249249249249ull);
+        }
+    }
+    else
+    {
+        // 16 байт = 4 пикселя BGRA, байт альфы считается совпавшим
+        __m128i color = _mm_setr_epi8(pattern[0], pattern[1], pattern[2], 0, pattern[0], pattern[1], pattern[2], 0,
+                                      pattern[0], pattern[1], pattern[2], 0, pattern[0], pattern[1], pattern[2], 0);
+        __m128i alpha = _mm_set1_epi32((int)0xff000000u);
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *)(row + (size_t)x * 4));
+            unsigned int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(p, color), alpha));
+            matches += __builtin_popcount(m & (m >> 1) & (m >> 2) & (m >> 3) & 0x1111u);
+        }
+    }
+#endif
+    for (; x < width; x++)
+    {
+        const unsigned char *p = row + (size_t)x * bytes;
+        matches += p[0] == pattern[0] && p[1] == pattern[1] && p[2] == pattern[2];
+    }
+    return matches;
+}
+
+// Задача пула - один поток: забирает порции строк, пока они не кончатся,
+// читает их своим pread и копит счётчики в своей записи counts
+static void countChunks(void *arg, int index)
+{
+    HistogramJob *job = arg;
+    BMP *bmp = job->bmp;
+    HistogramCounts *counts = &job->counts[index];
+    size_t size = (size_t)job->chunk_rows * bmp->stride;
+    unsigned char *buffer = NULL;
+    uint32_t(*local)[3][256] = calloc(HISTOGRAM_COPIES, sizeof(*local));
+    if (local == NULL || posix_memalign((void **)&buffer, PIXEL_ALIGNMENT, size) != 0)
+    {
+        free(local);
+        counts->code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+        return;
+    }
+
+    unsigned int chunk;
+    while ((chunk = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED)) < job->chunk_count)
+    {
+        unsigned int first = chunk * job->chunk_rows;
+        unsigned int rows = bmp->bmih.height - first < job->chunk_rows ? bmp->bmih.height - first : job->chunk_rows;
+        size_t wanted = (size_t)rows * bmp->stride;
+        off_t offset = bmp->bmfh.pixelArrOffset + (off_t)first * bmp->stride;
+        size_t got = 0;
+        while (got < wanted)
+        {
+            ssize_t n = pread(job->fd, buffer + got, wanted - got, offset + got);
+            if (n <= 0)
+            {
+                break;
+            }
+            got += n;
+        }
+        // недостающие байты файла считаются нулями, как при обычном чтении
+        memset(buffer + got, 0, wanted - got);
+
+        for (unsigned int y = 0; y < rows; y++)
+        {
+            const unsigned char *row = buffer + (size_t)y * bmp->stride;
+            countRow(row, bmp->bmih.width, bmp->pixel_bytes, local);
+            if (job->match)
+            {
+                counts->matches += matchRow(row, bmp->bmih.width, bmp->pixel_bytes, job->pattern);
+            }
+        }
+        // 32-битные счётчики сбрасываются после каждой порции и не переполняются
+        for (int k = 0; k < HISTOGRAM_COPIES; k++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                for (int v = 0; v < 256; v++)
+                {
+                    counts->bins[c][v] += local[k][c][v];
+                }
+            }
+        }
+        memset(local, 0, HISTOGRAM_COPIES * sizeof(*local));
+    }
+    free(buffer);
+    free(local);
+}
+
+static void printChannel(FILE *out, const char *name, uint64_t *bins, uint64_t pixels)
+{
+    int min = -1;
+    int max = 0;
+    uint64_t sum = 0;
+    for (int v = 0; v < 256; v++)
+    {
+        if (bins[v] > 0)
+        {
+            min = min < 0 ? v : min;
+            max = v;
+            sum += bins[v] * v;
+        }
+    }
+    fprintf(out, "\"%s\":{\"min\":%d,\"max\":%d,\"mean\":%.4f,\"histogram\":[", name, min < 0 ? 0 : min, max,
+            pixels ? (double)sum / pixels : 0.0);
+    for (int v = 0; v < 256; v++)
+    {
+        fprintf(out, "%s%llu", v ? "," : "", (unsigned long long)bins[v]);
+    }
+    fprintf(out, "]}");
+}
+
+// Гистограммы каналов, минимум, максимум и среднее за один проход по файлу
+// без загрузки изображения: каждый поток пула читает свои порции строк и
+// считает в своих счётчиках, в конце они складываются. Если задан color,
+// считаются ещё пиксели этого цвета. Результат - одна строка JSON
+int imageStatistics(char *filename, Rgb *color, ThreadPool *pool, FILE *out)
+{
+    BMP bmp;
+    initBMP(&bmp, NULL);
+    FILE *f;
+    int code = openBMP(filename, &bmp, &f);
+    if (code == 0 && bmp.rle != NULL)
+    {
+        // порции строк читаются с произвольных смещений, а сжатый файл - только по порядку
+        fclose(f);
+        code = setError(FILE_READ_ERROR, "Error: --stats-image does not support compressed images");
+    }
+    if (code != 0)
+    {
+        freeBMP(&bmp);
+        return code;
+    }
+
+    HistogramJob job;
+    memset(&job, 0, sizeof(job));
+    job.fd = fileno(f);
+    job.bmp = &bmp;
+    job.chunk_rows = HISTOGRAM_CHUNK / bmp.stride > 0 ? HISTOGRAM_CHUNK / bmp.stride : 1;
+    job.chunk_count = (bmp.bmih.height + job.chunk_rows - 1) / job.chunk_rows;
+    if (color != NULL)
+    {
+        job.match = 1;
+        for (int i = 0; i < 48; i += 3)
+        {
+            memcpy(job.pattern + i, color, sizeof(Rgb));
+        }
+    }
+    int workers = pool != NULL && pool->count > 1 ? pool->count : 1;
+    if ((unsigned int)workers > job.chunk_count)
+    {
+        workers = job.chunk_count > 0 ? job.chunk_count : 1;
+    }
+    if (posix_memalign((void **)&job.counts, 64, sizeof(HistogramCounts) * workers) != 0)
+    {
+        fclose(f);
+        freeBMP(&bmp);
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    memset(job.counts, 0, sizeof(HistogramCounts) * workers);
+    posix_fadvise(job.fd, bmp.bmfh.pixelArrOffset, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (workers > 1)
+    {
+        poolRun(pool, workers, countChunks, &job);
+    }
+    else
+    {
+        countChunks(&job, 0);
+    }
+
+    HistogramCounts *total = &job.counts[0];
+    for (int i = 0; i < workers && code == 0; i++)
+    {
+        code = job.counts[i].code;
+    }
+    for (int i = 1; i < workers; i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            for (int v = 0; v < 256; v++)
+            {
+                total->bins[c][v] += job.counts[i].bins[c][v];
+            }
+        }
+        total->matches += job.counts[i].matches;
+    }
+
+    if (code == 0)
+    {
+        uint64_t pixels = (uint64_t)bmp.bmih.width * bmp.bmih.height;
+        fprintf(out, "{\"width\":%u,\"height\":%u,\"bpp\":%hu,\"pixels\":%llu,", bmp.bmih.width, bmp.bmih.height,
+                bmp.bmih.bitsPerPixel, (unsigned long long)pixels);
+        printChannel(out, "red", total->bins[offsetof(Rgb, r)], pixels);
+        fputc(',', out);
+        printChannel(out, "green", total->bins[offsetof(Rgb, g)], pixels);
+        fputc(',', out);
+        printChannel(out, "blue", total->bins[offsetof(Rgb, b)], pixels);
+        if (color != NULL)
+        {
+            fprintf(out, ",\"color\":\"%d.%d.%d\",\"color_count\":%llu", color->r, color->g, color->b,
+                    (unsigned long long)total->matches);
+        }
+        fprintf(out, "}\n");
+    }
+
+    free(job.counts);
+    fclose(f);
+    freeBMP(&bmp);
+    return code;
+}
@@ -0,0 +1,259 @@
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+// Сколько файлов одна задача пула разбирает за раз
+#define INDEX_CHUNK 256
+
+// Заголовки одного файла каталога; пиксели не читаются
+typedef struct IndexEntry
+{
+    BitmapFileHeader bmfh;
+    BitmapInfoHeader bmih;
+    unsigned char masks[16]; // маски каналов сразу за 40-байтным заголовком
+    long long file_size;
+    int readable; // удалось прочитать оба заголовка
+    int valid;    // заголовки похожи на настоящий BMP
+} IndexEntry;
+
+typedef struct IndexJob
+{
+    char **files;
+    IndexEntry *entries;
+    int count;
+} IndexJob;
+
+static int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int hasBmpExtension(const char *name)
+{
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(name + length - 4, ".bmp") == 0;
+}
+
+// Рекурсивно собирает пути всех *.bmp; тип берётся из d_type, stat нужен
+// только там, где файловая система его не сообщает
+static int collectIndexFiles(char *path, char ***files, int *count)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+    int code = 0;
+    struct dirent *entry;
+    while (code == 0 && (entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (lstat(child, &st) != 0)
+            {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR)
+        {
+            // недоступные подкаталоги пропускаются, каталог индексируется дальше
+            if (collectIndexFiles(child, files, count) == MEMORY_ALLOCATION_ERROR)
+            {
+                code = MEMORY_ALLOCATION_ERROR;
+            }
+        }
+        else if (type == DT_REG && hasBmpExtension(entry->d_name))
+        {
+            code = appendString(files, count, child);
+        }
+    }
+    closedir(dir);
+    return code;
+}
+
+static int isValidHeader(IndexEntry *entry)
+{
+    unsigned int size = entry->bmih.headerSize;
+    unsigned short bpp = entry->bmih.bitsPerPixel;
+    return entry->readable && entry->bmfh.signature == 0x4d42 && entry->bmih.planes == 1 &&
+           (size == 40 || size == 52 || size == 56 || size == 108 || size == 124) &&
+           (bpp == 1 || bpp == 4 || bpp == 8 || bpp == 16 || bpp == 24 || bpp == 32) &&
+           entry->bmfh.pixelArrOffset >= sizeof(BitmapFileHeader) + size &&
+           entry->bmfh.pixelArrOffset <= entry->file_size;
+}
+
+static void indexChunk(void *arg, int index)
+{
+    IndexJob *job = arg;
+    int end = (index + 1) * INDEX_CHUNK < job->count ? (index + 1) * INDEX_CHUNK : job->count;
+    for (int i = index * INDEX_CHUNK; i < end; i++)
+    {
+        IndexEntry *entry = &job->entries[i];
+        memset(entry, 0, sizeof(*entry));
+        int fd = open(job->files[i], O_RDONLY);
+        if (fd < 0)
+        {
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+        {
+            entry->file_size = st.st_size;
+        }
+        entry->readable = pread(fd, &entry->bmfh, sizeof(entry->bmfh), 0) == sizeof(entry->bmfh) &&
+                          pread(fd, &entry->bmih, sizeof(entry->bmih), sizeof(entry->bmfh)) == sizeof(entry->bmih);
+        if (!entry->readable)
+        {
+            // у файла короче заголовков прочитанная часть полей не печатается как размеры
+            memset(&entry->bmfh, 0, sizeof(entry->bmfh));
+            memset(&entry->bmih, 0, sizeof(entry->bmih));
+        }
+        else if (pread(fd, entry->masks, sizeof(entry->masks), sizeof(entry->bmfh) + sizeof(entry->bmih)) < 0)
+        {
+            memset(entry->masks, 0, sizeof(entry->masks));
+        }
+        close(fd);
+        entry->valid = isValidHeader(entry);
+    }
+}
+
+static void printCsvPath(FILE *out, const char *path)
+{
+    if (strpbrk(path, ",\"\n") == NULL)
+    {
+        fputs(path, out);
+        return;
+    }
+    fputc('"', out);
+    for (const char *c = path; *c; c++)
+    {
+        if (*c == '"')
+        {
+            fputc('"', out);
+        }
+        fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void printJsonPath(FILE *out, const char *path)
+{
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)path; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fprintf(out, "\\%c", *c);
+        }
+        else if (*c < 0x20)
+        {
+            fprintf(out, "\\u%04x", *c);
+        }
+        else
+        {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Каталог изображений: рекурсивно обходит root, читает только заголовки
+// каждого *.bmp на пуле потоков и печатает по строке на файл в порядке путей
+int indexDirectory(char *root, ThreadPool *pool, FILE *out, int json)
+{
+    char **files = NULL;
+    int count = 0;
+    int code = collectIndexFiles(root, &files, &count);
+    IndexEntry *entries = NULL;
+    if (code == 0)
+    {
+        entries = (IndexEntry *)malloc(sizeof(IndexEntry) * (count ? count : 1));
+        if (entries == NULL)
+        {
+            code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+        }
+    }
+
+    if (code == 0)
+    {
+        if (count > 0)
+        {
+            qsort(files, count, sizeof(char *), compareNames);
+        }
+        IndexJob job = {files, entries, count};
+        int chunks = (count + INDEX_CHUNK - 1) / INDEX_CHUNK;
+        if (pool != NULL && pool->count > 1 && chunks > 1)
+        {
+            poolRun(pool, chunks, indexChunk, &job);
+        }
+        else
+        {
+            for (int i = 0; i < chunks; i++)
+            {
+                indexChunk(&job, i);
+            }
+        }
+
+        if (json)
+        {
+            fprintf(out, "[\n");
+        }
+        else
+        {
+            fprintf(out, "path,width,height,bpp,compression,file_size,valid,supported\n");
+        }
+        for (int i = 0; i < count; i++)
+        {
+            IndexEntry *entry = &entries[i];
+            // для проверки формата хватает заголовков и масок каналов
+            BMP header;
+            header.bmfh = entry->bmfh;
+            header.bmih = entry->bmih;
+            header.header_extra = entry->masks;
+            header.header_extra_size = entry->valid ? entry->bmfh.pixelArrOffset - sizeof(BitmapFileHeader) - sizeof(BitmapInfoHeader) : 0;
+            int supported = entry->valid && isSupportedFormat(&header);
+            if (json)
+            {
+                fprintf(out, "{\"path\": ");
+                printJsonPath(out, files[i]);
+                fprintf(out, ", \"width\": %u, \"height\": %d, \"bpp\": %hu, \"compression\": %u, \"file_size\": %lld, \"valid\": %s, \"supported\": %s}%s\n",
+                        entry->bmih.width, (int)entry->bmih.height, entry->bmih.bitsPerPixel, entry->bmih.compression,
+                        entry->file_size, entry->valid ? "true" : "false", supported ? "true" : "false", i + 1 < count ? "," : "");
+            }
+            else
+            {
+                printCsvPath(out, files[i]);
+                fprintf(out, ",%u,%d,%hu,%u,%lld,%d,%d\n", entry->bmih.width, (int)entry->bmih.height, entry->bmih.bitsPerPixel,
+                        entry->bmih.compression, entry->file_size, entry->valid, supported);
+            }
+        }
+        if (json)
+        {
+            fprintf(out, "]\n");
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        free(files[i]);
+    }
+    free(files);
+    free(entries);
+    return code;
+}
@@ -0,0 +1,222 @@
+#include "bmp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+// Нагрузочный тест сервера (--serve): несколько клиентов по своим соединениям
+// шлют запросы с окружностями в случайных местах и сетками, время каждого
+// ответа записывается, в конце печатаются перцентили задержки и пропускная способность
+
+typedef struct LoadClient
+{
+    char *socket_path;
+    char *input_file;
+    char *output_file;
+    int requests;
+    int split_every; // каждый такой запрос - сетка --split (0 - только окружности)
+    unsigned int seed;
+    double *latencies;
+    int failed;
+} LoadClient;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void *runLoadClient(void *arg)
+{
+    LoadClient *client = arg;
+    char cwd[PATH_MAX];
+    int fd;
+    if (getcwd(cwd, sizeof(cwd)) == NULL || connectServer(client->socket_path, &fd) != 0)
+    {
+        client->failed = client->requests;
+        return NULL;
+    }
+
+    for (int i = 0; i < client->requests; i++)
+    {
+        char center[32], radius[16];
+        snprintf(center, sizeof(center), "%d.%d", rand_r(&client->seed) % 1000, rand_r(&client->seed) % 1000);
+        snprintf(radius, sizeof(radius), "%d", 5 + rand_r(&client->seed) % 60);
+        char *circle[] = {"-c", "--center", center, "--radius", radius, "--thickness", "3", "--color", "255.0.0",
+                          "-o", client->output_file, client->input_file};
+        char *split[] = {"-s", "--number_x", "4", "--number_y", "3", "--thickness", "2", "--color", "0.0.0",
+                         "-o", client->output_file, client->input_file};
+        int is_split = client->split_every > 0 && i % client->split_every == client->split_every - 1;
+
+        char reply[1024];
+        double start = now();
+        int code = is_split ? sendRequest(fd, cwd, sizeof(split) / sizeof(split[0]), split, reply, sizeof(reply))
+                            : sendRequest(fd, cwd, sizeof(circle) / sizeof(circle[0]), circle, reply, sizeof(reply));
+        client->latencies[i] = now() - start;
+        if (code != 0)
+        {
+            if (client->failed == 0)
+            {
+                printf("Error: %s\n", reply);
+            }
+            client->failed++;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static double percentile(double *sorted, int count, double p)
+{
+    int index = (int)(p / 100.0 * (count - 1) + 0.5);
+    return sorted[index < count ? index : count - 1];
+}
+
+static void printHelp()
+{
+    printf("Load test for the BMP tool server (cw --serve <socket>)\n\n");
+    printf("-s, --socket <path>: Socket of the running server\n");
+    printf("-i, --input <filename>: Base image the requests draw on\n");
+    printf("-c, --clients <number>: Number of concurrent clients, each with its own connection (default: 4)\n");
+    printf("-n, --requests <number>: Requests sent by each client (default: 200)\n");
+    printf("-g, --split-every <number>: Make every N-th request a --split grid instead of a circle (default: 4, 0 - never)\n");
+    printf("-d, --dir <directory>: Directory for the results, one file per client (default: /tmp)\n");
+    printf("-j, --json: Print the summary as one JSON line\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char *socket_path = NULL;
+    char *input_file = NULL;
+    char *dir = "/tmp";
+    int clients = 4;
+    int requests = 200;
+    int split_every = 4;
+    int json = 0;
+
+    const struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"socket", required_argument, 0, 's'},
+        {"input", required_argument, 0, 'i'},
+        {"clients", required_argument, 0, 'c'},
+        {"requests", required_argument, 0, 'n'},
+        {"split-every", required_argument, 0, 'g'},
+        {"dir", required_argument, 0, 'd'},
+        {"json", no_argument, 0, 'j'},
+        {0, 0, 0, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hs:i:c:n:g:d:j", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            printHelp();
+            return 0;
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'i':
+            input_file = optarg;
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'n':
+            requests = atoi(optarg);
+            break;
+        case 'g':
+            split_every = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        default:
+            printf("Error: unknown option\n");
+            return OPTION_ERROR;
+        }
+    }
+    if (socket_path == NULL || input_file == NULL || clients <= 0 || requests <= 0 || split_every < 0)
+    {
+        printf("Error: --socket and --input are required, --clients and --requests must be positive\n");
+        return WRONG_ARGUMENTS_ERROR;
+    }
+
+    int total = clients * requests;
+    LoadClient *load = (LoadClient *)calloc(clients, sizeof(LoadClient));
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * clients);
+    double *latencies = (double *)malloc(sizeof(double) * total);
+    char(*outputs)[PATH_MAX] = malloc(sizeof(*outputs) * clients);
+    if (load == NULL || threads == NULL || latencies == NULL || outputs == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return MEMORY_ALLOCATION_ERROR;
+    }
+
+    double start = now();
+    for (int i = 0; i < clients; i++)
+    {
+        snprintf(outputs[i], PATH_MAX, "%s/load_%d.bmp", dir, i);
+        load[i] = (LoadClient){socket_path, input_file, outputs[i], requests, split_every, 12345u + i, latencies + i * requests, 0};
+        if (pthread_create(&threads[i], NULL, runLoadClient, &load[i]) != 0)
+        {
+            printf("Error: can not start client thread\n");
+            return MEMORY_ALLOCATION_ERROR;
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < clients; i++)
+    {
+        pthread_join(threads[i], NULL);
+        failed += load[i].failed;
+    }
+    double seconds = now() - start;
+
+    qsort(latencies, total, sizeof(double), compareDoubles);
+    double sum = 0;
+    for (int i = 0; i < total; i++)
+    {
+        sum += latencies[i];
+    }
+    double p50 = percentile(latencies, total, 50) * 1e3;
+    double p90 = percentile(latencies, total, 90) * 1e3;
+    double p99 = percentile(latencies, total, 99) * 1e3;
+    double max = latencies[total - 1] * 1e3;
+    if (json)
+    {
+        printf("{\"clients\":%d,\"requests\":%d,\"failed\":%d,\"seconds\":%.3f,\"requests_per_s\":%.1f,"
+               "\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}\n",
+               clients, total, failed, seconds, total / seconds, sum / total * 1e3, p50, p90, p99, max);
+    }
+    else
+    {
+        printf("requests:     \t%d (%d failed) from %d clients\n", total, failed, clients);
+        printf("throughput:   \t%.1f requests/s\n", total / seconds);
+        printf("latency mean: \t%.3f ms\n", sum / total * 1e3);
+        printf("latency p50:  \t%.3f ms\n", p50);
+        printf("latency p90:  \t%.3f ms\n", p90);
+        printf("latency p99:  \t%.3f ms\n", p99);
+        printf("latency max:  \t%.3f ms\n", max);
+    }
+
+    free(load);
+    free(threads);
+    free(latencies);
+    free(outputs);
+    return failed ? FILE_WRITE_ERROR : 0;
+}
@@ -1,119 +1,20 @@
+#include "bmp.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
-#include <math.h>
-#include <stdint.h>
-#define FILE_READ_ERROR 41
-#define OPTION_ERROR 42
-#define WRONG_ARGUMENTS_ERROR 43
-#define MEMORY_ALLOCATION_ERROR 44
-
-#pragma pack(push, 1)
-
-typedef struct BitmapFileHeader
-{
-    unsigned short signature;    // определение типа файла
-    unsigned int filesize;       // размер файла
-    unsigned short reserved1;    // должен быть 0
-    unsigned short reserved2;    // должен быть 0
-    unsigned int pixelArrOffset; // начальный адрес байта, в котором находятся данные изображения (массив пикселей)
-} BitmapFileHeader;
-
-typedef struct BitmapInfoHeader
-{
-    unsigned int headerSize;          // размер этого заголовка в байтах
-    unsigned int width;               // ширина изображения в пикселях
-    unsigned int height;              // высота изображения в пикселях
-    unsigned short planes;            // кол-во цветовых плоскостей (должно быть 1)
-    unsigned short bitsPerPixel;      // глубина цвета изображения
-    unsigned int compression;         // тип сжатия; если сжатия не используется, то здесь должен быть 0
-    unsigned int imageSize;           // размер изображения
-    unsigned int xPixelsPerMeter;     // горизонтальное разрешение (пиксель на метр)
-    unsigned int yPixelsPerMeter;     // вертикальное разрешение (пиксель на метр)
-    unsigned int colorsInColorTable;  // кол-во цветов в цветовой палитре
-    unsigned int importantColorCount; // кол-во важных цветов (или 0, если каждый цвет важен)
-} BitmapInfoHeader;
-
-typedef struct Rgb
-{
-    unsigned char b;
-    unsigned char g;
-    unsigned char r;
-} Rgb;
-
-typedef struct BMP
-{
-    BitmapInfoHeader bmih;
-    BitmapFileHeader bmfh;
-    Rgb **img;
-} BMP;
+#include <unistd.h>
+#include <limits.h>
 
-#pragma pack(pop)
-
-BMP readBMP(char *filename)
+// Для командной строки: печатает сообщение и завершает программу с кодом ошибки
+void checkError(int code)
 {
-    FILE *f = fopen(filename, "rb");
-    if (!f)
-    {
-        printf("Error: file reading error\n");
-        exit(FILE_READ_ERROR);
-    }
-
-    BMP bmp;
-    fread(&bmp.bmfh, 1, sizeof(bmp.bmfh), f);
-    fread(&bmp.bmih, 1, sizeof(bmp.bmih), f);
-    if (bmp.bmih.headerSize != 40 || bmp.bmih.bitsPerPixel != 24 || bmp.bmfh.signature != 0x4d42 || bmp.bmih.compression != 0)
+    if (code != 0)
     {
-        printf("Error: unsupported file format\n");
-        exit(FILE_READ_ERROR);
+        printf("%s\n", lastError());
+        exit(code);
     }
-
-    unsigned int H = bmp.bmih.height;
-    unsigned int W = bmp.bmih.width;
-    bmp.img = (Rgb **)malloc(sizeof(Rgb *) * H);
-    if (bmp.img == NULL)
-    {
-        printf("Memory allocation error!\n");
-        exit(MEMORY_ALLOCATION_ERROR);
-    }
-
-    for (int i = 0; i < H; i++)
-    {
-        bmp.img[i] = (Rgb *)malloc(W * sizeof(Rgb) + (4 - (W * sizeof(Rgb)) % 4) % 4);
-        if (bmp.img[i] == NULL)
-        {
-            printf("Memory allocation error!\n");
-            exit(MEMORY_ALLOCATION_ERROR);
-        }
-        fread(bmp.img[i], 1, W * sizeof(Rgb) + (4 - (W * sizeof(Rgb)) % 4) % 4, f);
-    }
-
-    fclose(f);
-    return bmp;
-}
-
-void writeBMP(char *filename, BMP bmp)
-{
-    FILE *ff = fopen(filename, "wb");
-    size_t H = bmp.bmih.height;
-    size_t W = bmp.bmih.width;
-
-    fwrite(&bmp.bmfh, sizeof(BitmapFileHeader), 1, ff);
-    fwrite(&bmp.bmih, sizeof(BitmapInfoHeader), 1, ff);
-
-    int padding = (4 - (W * 3) % 4) % 4; // выравнивание
-    uint8_t paddingBytes[3] = {0};
-
-    for (size_t i = 0; i < H; i++)
-    {
-        fwrite(bmp.img[i], sizeof(Rgb), W, ff);
-        fwrite(paddingBytes, sizeof(uint8_t), padding, ff);
-        free(bmp.img[i]);
-    }
-
-    free(bmp.img);
-    fclose(ff);
 }
 
 void printFileHeader(BitmapFileHeader header)
@@ -147,8 +48,31 @@ void printHelp()
     printf("***Options:***\n");
     printf("-h, --help: Display this help information\n");
     printf("-i, --info: Display  information about file\n");
+    printf("-H, --stats-image: Print channel histograms, min, max and mean as JSON; with --color also count pixels of that color\n");
     printf("-I, --input <filename>: Specify the input BMP file\n");
     printf("-o, --output <filename>: Specify the output BMP file\n");
+    printf("-d, --delta: Write a patch with the headers and only the changed areas of the result to --output instead of the whole file\n");
+    printf("-a, --apply-patch <patch>: Rebuild the full result from the input file and a --delta patch into --output\n");
+    printf("-E, --rle: Write a 24-bit result compressed with run-length encoding (BI_RLE24); RLE8/RLE4/RLE24 input is always read\n");
+    printf("-p, --inplace: Modify the input file in place instead of writing an output file\n");
+    printf("-m, --max-memory <size>: Process the image in bands that fit into the given memory (e.g., --max-memory 64M)\n");
+    printf("-t, --threads <number>: Number of worker threads (default: number of online CPUs)\n");
+    printf("-J, --io-depth <number>: Row bands in flight while large images are read, processed and written (3-64, default 4, 0 - off)\n");
+    printf("-j, --io-threads: Use a reader and a writer thread for --io-depth instead of io_uring\n");
+    printf("-A, --op <operation>: Add an operation written with the options below (can be repeated)\n");
+    printf("-S, --ops <filename>: Read operations from a file, one per line\n");
+    printf("-B, --batch <directory|list>: Apply the operations to every BMP in a directory or listed in a file\n");
+    printf("-D, --output-dir <directory>: Directory for the results of --batch\n");
+    printf("-G, --tiles <directory>: Cut the image into --number_x by --number_y parts of --split and save each as tile_<row>_<column>.bmp\n");
+    printf("-K, --index <directory>: Print a catalog of the headers of every BMP under the directory (CSV)\n");
+    printf("-k, --index-format <csv|json>: Format of the --index catalog\n");
+    printf("-X, --stats[=json]: Print timings of each phase, I/O volume, allocations and peak memory (as one JSON line with =json)\n");
+    printf("-Q, --cache-dir <directory>: Reuse results of the same input and operations saved in the directory\n");
+    printf("-q, --cache-size <size>: Limit the cache size, least recently used results are removed first (default 1G)\n");
+    printf("-W, --serve <socket>: Run a server on the Unix socket that applies operations sent by --connect clients\n");
+    printf("-M, --server-memory <size>: Memory for decoded images kept by the server (default 512M)\n");
+    printf("-w, --connect <socket>: Send the operation to a running server instead of processing the file here\n");
+    printf("-R, --pyramid <size>: Also save half-size previews output_1.bmp, output_2.bmp, ... down to the given size of the larger side\n");
     printf("-c, --circle: Draw a circle\n");
     printf("-O, --center <x.y>: Specify the center coordinates of the circle (e.g., --center 100.50)\n");
     printf("-r, --radius <radius>: Set the radius of the circle (positive integer, e.g., --radius 50)\n");
@@ -156,9 +80,15 @@ void printHelp()
     printf("-C, --color <rrr.ggg.bbb>: Specify the color of the circle line (RGB values, e.g., --color 255.0.0 for red)\n");
     printf("-F, --fill: Fill the circle with the specified color (optional)\n");
     printf("-P, --fill_color <rrr.ggg.bbb>: Set the fill color of the circle (RGB values, e.g., --fill_color 0.0.255 for blue)\n");
+    printf("-U, --circles <filename>: Draw many circles from a file, one per line: <x.y> <radius> <thickness> <rrr.ggg.bbb> [<fill rrr.ggg.bbb>]\n");
+    printf("-L, --line: Draw a line of any angle from --start to --end with --thickness and --color\n");
+    printf("-b, --start <x.y>: Specify the start point of the line (e.g., --start 0.0)\n");
+    printf("-e, --end <x.y>: Specify the end point of the line (e.g., --end 640.480)\n");
     printf("-f, --rgbfilter: Apply an RGB component filter to the entire image\n");
     printf("-N, --component_name <red|green|blue>: Select the RGB component to modify\n");
     printf("-V, --component_value <value>: Set the value of the selected component (0-255)\n");
+    printf("-Y, --lut <op[=arg]>: Transform channel values: set=V, scale=K, invert, clamp=LO.HI, gamma=G, threshold=T or swap=<rgb order>\n");
+    printf("-Z, --channels <rgb>: Select the channels changed by --lut (e.g., --channels rg, all by default)\n");
     printf("-s, --split: Divide the image into N*M parts\n");
     printf("-x, --number_x <number>: Set the number of horizontal divisions (positive integer, e.g., --number_x 3)\n");
     printf("-y, --number_y <number>: Set the number of vertical divisions (positive integer, e.g., --number_y 2)\n");
@@ -178,354 +108,332 @@ void printHelp()
     printf("3. Divide the image into 4x3 parts with black dividing lines of thickness 10:\n");
     printf("./cw -i input.bmp -o output.bmp -s --number_x 4 --number_y 3 --thickness 10 --color 0.0.0\n");
     printf("\n");
-}
 
-void drawPixel(BMP *bmp, int x, int y, Rgb *color)
-{
-    bmp->img[y][x].r = color->r;
-    bmp->img[y][x].g = color->g;
-    bmp->img[y][x].b = color->b;
+    printf("4. Draw two circles and apply a filter with a single load and save:\n");
+    printf("./cw -o output.bmp --op \"-c --center 10.10 --radius 5 --thickness 1 --color 255.0.0\" \\\n");
+    printf("     --op \"-c --center 50.50 --radius 9 --thickness 2 --color 0.0.255\" --op \"-f -N red -V 0\" input.bmp\n");
+    printf("\n");
+
+    printf("5. Invert the image, raise the gamma of red and green and swap red with blue in one pass over the pixels:\n");
+    printf("./cw -o output.bmp --op \"--lut invert\" --op \"--lut gamma=2.2 --channels rg\" --op \"--lut swap=bgr\" input.bmp\n");
+    printf("\n");
 }
 
-void checkDataDrawCircle(BMP *bmp, int coord_x, int coord_y, int radius, int thickness, Rgb *line_color, int fill, Rgb *fill_color)
+size_t parseSize(char *size_str)
 {
-    if (bmp->img == NULL)
+    char *end;
+    unsigned long long value = strtoull(size_str, &end, 10);
+    if (*end == 'k' || *end == 'K')
     {
-        printf("Error: can not find image data\n");
-        exit(WRONG_ARGUMENTS_ERROR);
+        value <<= 10;
+        end++;
     }
-    if (radius <= 0)
+    else if (*end == 'm' || *end == 'M')
     {
-        printf("Error: circle radius must be positive\n");
-        exit(WRONG_ARGUMENTS_ERROR);
+        value <<= 20;
+        end++;
     }
-    if (thickness <= 0)
+    else if (*end == 'g' || *end == 'G')
     {
-        printf("Error: thickness must be positive\n");
-        exit(WRONG_ARGUMENTS_ERROR);
+        value <<= 30;
+        end++;
     }
-    if (fill == 1 && fill_color == NULL)
+    if (end == size_str || *end != '\0' || value == 0)
     {
-        printf("Error: no fill color given\n");
+        printf("Error: invalid size \"%s\"\n", size_str);
         exit(WRONG_ARGUMENTS_ERROR);
     }
+    return value;
 }
 
-void drawCircle(BMP *bmp, int coord_x, int coord_y, int radius, int thickness, Rgb *line_color, int fill, Rgb *fill_color)
-{
-
-    int inner_radius = radius - thickness / 2;
-    if (inner_radius < 0)
-    {
-        inner_radius = 0;
-    }
-
-    int outer_radius = radius + thickness / 2;
-    int min_x = 0;
-    int end_iteration_x = bmp->bmih.width;
-    int min_y = 0;
-    int end_iteration_y = bmp->bmih.height;
-    if (coord_x - outer_radius - 1 > 0)
-    {
-        min_x = coord_x - outer_radius - 1;
-    }
-    if (coord_y - outer_radius - 1 > 0)
-    {
-        min_y = coord_y - outer_radius - 1;
-    }
-    if (coord_x + outer_radius + 1 < bmp->bmih.width)
-    {
-        end_iteration_x = coord_x + outer_radius + 1;
-    }
-    if (coord_y + outer_radius + 1 < bmp->bmih.height)
-    {
-        end_iteration_y = coord_y + outer_radius + 1;
-    }
+static int batch_processed = 0;
+static int batch_failed = 0;
 
-    for (int y = min_y; y < end_iteration_y; y++)
-    {
-        for (int x = min_x; x < end_iteration_x; x++)
-        {
-            if (y >= 0 && y < bmp->bmih.height && x >= 0 && x < bmp->bmih.width)
-            {
-                int squared_dist = (x - coord_x) * (x - coord_x) + (y - coord_y) * (y - coord_y);
-                if ((squared_dist <= (outer_radius) * (outer_radius)) && (squared_dist >= (inner_radius) * (inner_radius)))
-                {
-
-                    drawPixel(bmp, x, y, line_color);
-                }
-            }
-        }
-    }
-    if (fill)
+void reportBatchFile(char *input_file, int code, const char *message)
+{
+    batch_processed++;
+    if (code != 0)
     {
-        for (int y = coord_y - inner_radius; y <= coord_y + inner_radius; y++)
-        {
-            for (int x = coord_x - inner_radius; x <= coord_x + inner_radius; x++)
-            {
-                if (y >= 0 && y < bmp->bmih.height && x >= 0 && x < bmp->bmih.width &&
-                    sqrt((x - coord_x) * (x - coord_x) + (y - coord_y) * (y - coord_y)) < inner_radius)
-                {
-                    drawPixel(bmp, x, y, fill_color);
-                }
-            }
-        }
+        batch_failed++;
+        printf("%s: %s\n", input_file, message);
     }
 }
 
-void swap(int *a, int *b)
-{
-    int temp = *a;
-    *a = *b;
-    *b = temp;
-}
-
-void drawLine(BMP *bmp, int x0, int y0, int x1, int y1, int thickness, Rgb *color)
+const char *short_options = "hiHda:Eo:I:pm:t:A:S:B:D:G:K:k:X::U:Lb:e:Y:Z:Q:q:W:w:M:R:J:jfN:V:sx:y:T:C:cO:r:FP:";
+
+const struct option long_options[] =
+    {
+
+        {"help", no_argument, 0, 'h'},
+        {"info", no_argument, 0, 'i'},
+        {"stats-image", no_argument, 0, 'H'},
+        {"delta", no_argument, 0, 'd'},
+        {"apply-patch", required_argument, 0, 'a'},
+        {"rle", no_argument, 0, 'E'},
+        {"output", required_argument, 0, 'o'},
+        {"input", required_argument, 0, 'I'},
+        {"inplace", no_argument, 0, 'p'},
+        {"max-memory", required_argument, 0, 'm'},
+        {"threads", required_argument, 0, 't'},
+        {"op", required_argument, 0, 'A'},
+        {"ops", required_argument, 0, 'S'},
+        {"batch", required_argument, 0, 'B'},
+        {"output-dir", required_argument, 0, 'D'},
+        {"tiles", required_argument, 0, 'G'},
+        {"index", required_argument, 0, 'K'},
+        {"index-format", required_argument, 0, 'k'},
+        {"stats", optional_argument, 0, 'X'},
+        {"cache-dir", required_argument, 0, 'Q'},
+        {"cache-size", required_argument, 0, 'q'},
+        {"serve", required_argument, 0, 'W'},
+        {"connect", required_argument, 0, 'w'},
+        {"server-memory", required_argument, 0, 'M'},
+        {"pyramid", required_argument, 0, 'R'},
+        {"io-depth", required_argument, 0, 'J'},
+        {"io-threads", no_argument, 0, 'j'},
+        {"circle", no_argument, 0, 'c'},
+        {"circles", required_argument, 0, 'U'},
+        {"line", no_argument, 0, 'L'},
+        {"start", required_argument, 0, 'b'},
+        {"end", required_argument, 0, 'e'},
+        {"center", required_argument, 0, 'O'},
+        {"radius", required_argument, 0, 'r'},
+        {"fill", no_argument, 0, 'F'},
+        {"fill_color", required_argument, 0, 'P'},
+        {"rgbfilter", no_argument, 0, 'f'},
+        {"lut", required_argument, 0, 'Y'},
+        {"channels", required_argument, 0, 'Z'},
+        {"component_name", required_argument, 0, 'N'},
+        {"component_value", required_argument, 0, 'V'},
+        {"split", no_argument, 0, 's'},
+        {"number_x", required_argument, 0, 'x'},
+        {"number_y", required_argument, 0, 'y'},
+        {"thickness", required_argument, 0, 'T'},
+        {"color", required_argument, 0, 'C'},
+        {0, 0, 0, 0}};
+
+// Разбирает описание одной операции в тех же опциях, что и командная строка,
+// например "--circle --center 100.50 --radius 50 --thickness 3 --color 255.0.0".
+// Строка spec разрезается на месте и должна жить, пока используется операция
+int parseOperationSpec(char *spec, OperationArgs *args)
 {
-    if (x0 < 0 || y0 < 0 || x1 < 0 || y1 < 0 || thickness <= 0)
+    char *spec_argv[128];
+    int spec_argc = 0;
+    char *save = NULL;
+    spec_argv[spec_argc++] = "op";
+    for (char *token = strtok_r(spec, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save))
     {
-        return;
+        if (spec_argc == 127)
+        {
+            return setError(OPTION_ERROR, "Error: too many arguments in operation");
+        }
+        spec_argv[spec_argc++] = token;
     }
+    spec_argv[spec_argc] = NULL;
 
-    unsigned int H = bmp->bmih.height;
-    unsigned int W = bmp->bmih.width;
-
-    // vertical line
-    if (x0 == x1)
+    initOperationArgs(args);
+    int opt;
+    optind = 0;
+    while ((opt = getopt_long(spec_argc, spec_argv, short_options, long_options, NULL)) != -1)
     {
-        if (y0 > y1)
+        if (!setOperationArg(args, opt, optarg))
         {
-            swap(&y0, &y1);
-        }
-        for (int y = y0; y <= y1; y++)
-        {
-            for (int j = 0; j <= thickness; j++)
-            {
-                if (H - y >= 0 && x0 - j >= 0 && x0 - j < W && H - y < H)
-                {
-                    bmp->img[H - y][x0 - j].r = color->r;
-                    bmp->img[H - y][x0 - j].g = color->g;
-                    bmp->img[H - y][x0 - j].b = color->b;
-                }
-            }
+            return setError(OPTION_ERROR, "Error: unknown option");
         }
     }
-    else if (y0 == y1)
+    if (optind != spec_argc)
     {
-        if (x0 > x1)
-        {
-            swap(&x0, &x1);
-        }
-        for (int x = x0; x <= x1; x++)
-        {
-            for (int j = 0; j <= thickness; j++)
-            {
-                if (H - y0 + j >= 0 && x >= 0 && x < W && H - y0 + j < H)
-                {
-                    bmp->img[H - y0 + j][x].r = color->r;
-                    bmp->img[H - y0 + j][x].g = color->g;
-                    bmp->img[H - y0 + j][x].b = color->b;
-                }
-            }
-        }
+        return setError(OPTION_ERROR, "Error: unexpected argument \"%s\" in operation", spec_argv[optind]);
     }
+    return 0;
 }
 
-void checkDataDividePicture(BMP *bmp, int thickness, int countY, int countX, Rgb *line_color)
+// Собирает операции: операция из основных опций идёт первой, за ней --op и --ops
+// в порядке появления
+int collectOperations(OperationArgs *args, char **specs, int spec_count, OperationArgs **ops, int *count)
 {
-    if (bmp->img == NULL)
+    *count = (args->option != OPERATION_NONE) + spec_count;
+    *ops = (OperationArgs *)malloc(sizeof(OperationArgs) * (*count ? *count : 1));
+    if (*ops == NULL)
     {
-        printf("Error: can not find image data\n");
-        exit(WRONG_ARGUMENTS_ERROR);
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
     }
-    if (countY <= 1)
+    int first_spec = 0;
+    if (args->option != OPERATION_NONE)
     {
-        printf("Error: --number_x argument must be greater than 1\n");
-        exit(WRONG_ARGUMENTS_ERROR);
+        (*ops)[0] = *args;
+        first_spec = 1;
     }
-    if (countX <= 1)
+    for (int i = 0; i < spec_count; i++)
     {
-        printf("Error: --number_y argument must be greater than 1\n");
-        exit(WRONG_ARGUMENTS_ERROR);
-    }
-    if (thickness <= 0)
-    {
-        printf("Error: thickness must be positive\n");
-        exit(WRONG_ARGUMENTS_ERROR);
+        int code = parseOperationSpec(specs[i], &(*ops)[first_spec + i]);
+        if (code != 0)
+        {
+            return code;
+        }
     }
+    return 0;
 }
 
-void dividePicture(BMP *bmp, int thickness, int countY, int countX, Rgb *line_color)
+// Разбирает запрос к серверу в тех же опциях, что и командная строка (--op,
+// опции операций, -I/-o и входной файл последним аргументом). В отличие от
+// командной строки ошибки не завершают процесс, а возвращаются кодом
+int parseRequest(int argc, char **argv, ServerRequest *request)
 {
-    int W = bmp->bmih.width;
-    int H = bmp->bmih.height;
-
-    int countlinesY = countY - 1;
-    int countlinesX = countX - 1;
+    OperationArgs args;
+    initOperationArgs(&args);
+    memset(request, 0, sizeof(*request));
+    request->input_file = argv[argc - 1];
+    request->output_file = "output.bmp";
 
-    int x0 = W / countX;
-    int y0 = H;
-    int y1 = 0;
-    int cnt_x = 0;
-    while (cnt_x != countlinesX)
+    int code = 0;
+    int opt;
+    optind = 0;
+    opterr = 0;
+    while (code == 0 && (opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1)
     {
-        drawLine(bmp, x0, y0, x0, y1, thickness, line_color);
-        x0 += W / countX;
-        cnt_x++;
+        if (setOperationArg(&args, opt, optarg))
+        {
+            continue;
+        }
+        switch (opt)
+        {
+        case 'o':
+            request->output_file = optarg;
+            break;
+        case 'I':
+            request->input_file = optarg;
+            break;
+        case 'A':
+            code = appendString(&request->specs, &request->spec_count, optarg);
+            break;
+        case 'X':
+            request->stats = 1;
+            break;
+        case 't':
+            break;
+        default:
+            code = setError(OPTION_ERROR, "Error: option is not supported by the server");
+            break;
+        }
     }
-
-    x0 = 0;
-    int x1 = W;
-    y0 = H / countY;
-    int cnt_y = 0;
-    while (cnt_y != countlinesY)
+    if (code == 0 && !request->stats)
     {
-        drawLine(bmp, x0, y0, x1, y0, thickness, line_color);
-        y0 += H / countY;
-        cnt_y++;
+        code = collectOperations(&args, request->specs, request->spec_count, &request->ops, &request->op_count);
     }
+    return code;
 }
 
-void checkDataRgbFilter(BMP *bmp, char *component_name, int component_value)
+// Файл операций: одна операция на строку, пустые строки и строки с # пропускаются
+void readOperationsFile(char *filename, char ***specs, int *count)
 {
-    if (!(bmp->img != NULL && 0 <= component_value && component_value <= 255))
-    {
-        printf("Error: wrong data passed to function --rgbfilter\n");
-        exit(WRONG_ARGUMENTS_ERROR);
-    }
-    if (!(strcmp(component_name, "red") == 0 || strcmp(component_name, "green") == 0 || strcmp(component_name, "blue") == 0))
+    FILE *f = fopen(filename, "r");
+    if (!f)
     {
-        printf("Error: Invalid component name (red, green, or blue expected)\n");
-        exit(WRONG_ARGUMENTS_ERROR);
+        printf("Error: file reading error\n");
+        exit(FILE_READ_ERROR);
     }
-    if (!(0 <= component_value && component_value <= 255))
+    char line[4096];
+    while (fgets(line, sizeof(line), f) != NULL)
     {
-        printf("Error: Color values must be between 0 and 255\n");
-        exit(WRONG_ARGUMENTS_ERROR);
-    }
-}
-
-void rgbFilter(BMP *bmp, char *component_name, int value)
-{
-    int H = bmp->bmih.height;
-    int W = bmp->bmih.width;
-    unsigned char c;
-    if (strcmp(component_name, "red") == 0)
-        c = 'r';
-    else if (strcmp(component_name, "green") == 0)
-        c = 'g';
-    else if (strcmp(component_name, "blue") == 0)
-        c = 'b';
-
-    for (size_t i = 0; i < H; i++)
-    {
-        for (size_t j = 0; j < W; j++)
-        {
-            if (c == 'r')
-                (bmp->img)[i][j].r = value;
-            else if (c == 'g')
-                (bmp->img)[i][j].g = value;
-            else if (c == 'b')
-                (bmp->img)[i][j].b = value;
+        char *start = line + strspn(line, " \t\r\n");
+        if (*start == '\0' || *start == '#')
+        {
+            continue;
         }
+        checkError(appendString(specs, count, start));
     }
+    fclose(f);
 }
 
-Rgb *getColor(char *color_str)
+// Клиент: пересылает серверу все аргументы, кроме --connect, вместе с текущим
+// каталогом и завершается с кодом ответа
+int runClient(char *socket_path, int argc, char *argv[])
 {
-    if (color_str == NULL)
+    char **forward = (char **)malloc(sizeof(char *) * argc);
+    int count = 0;
+    char cwd[PATH_MAX];
+    if (forward == NULL || getcwd(cwd, sizeof(cwd)) == NULL)
     {
-        printf("Error: wrong argument");
-        exit(WRONG_ARGUMENTS_ERROR);
+        free(forward);
+        printf("Error: can not get current directory\n");
+        return WRONG_ARGUMENTS_ERROR;
     }
-
-    int check;
-    int r, g, b;
-    check = sscanf(color_str, "%d.%d.%d", &r, &g, &b);
-    if (check != 3)
+    for (int i = 1; i < argc; i++)
     {
-        printf("Error: invalid color format (expected \"RRR.GGG.BBB\")\n");
-        exit(WRONG_ARGUMENTS_ERROR);
+        if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--connect") == 0)
+        {
+            i++;
+        }
+        else if (strncmp(argv[i], "--connect=", 10) != 0 && strncmp(argv[i], "-w", 2) != 0)
+        {
+            forward[count++] = argv[i];
+        }
     }
 
-    if ((r < 0) || (r > 255) || (g < 0) || (g > 255) || (b < 0) || (b > 255))
+    // сообщение об ошибке соединения лежит в lastError(), ответ сервера - в reply
+    char reply[1024];
+    int fd;
+    int code = connectServer(socket_path, &fd);
+    if (code == 0)
     {
-        printf("Error: Color values must be between 0 and 255\n");
-        exit(WRONG_ARGUMENTS_ERROR);
+        code = sendRequest(fd, cwd, count, forward, reply, sizeof(reply));
+        close(fd);
     }
-
-    Rgb *color = (Rgb *)malloc(sizeof(Rgb));
-    if (color == NULL)
+    else
     {
-        printf("Memory allocation error!\n");
-        exit(MEMORY_ALLOCATION_ERROR);
+        snprintf(reply, sizeof(reply), "%s", lastError());
     }
-
-    color->r = (unsigned char)r;
-    color->g = (unsigned char)g;
-    color->b = (unsigned char)b;
-    return color;
-}
-
-void getCoordinates(char* center_coords, int* coord_x, int* coord_y)
-{
-    int check_coords;
-    check_coords = sscanf(center_coords, "%d.%d", coord_x, coord_y);
-    if (check_coords < 2)
+    free(forward);
+    if (strcmp(reply, "OK") != 0)
     {
-        printf("Error: wrong center coordinates\n");
-        exit(WRONG_ARGUMENTS_ERROR);
+        printf("%s\n", reply);
     }
+    return code;
 }
 
 int main(int argc, char *argv[])
 {
     char *input_file = argv[argc - 1];
     char *output_file = "output.bmp";
-    const char *short_options = "hio:I:fN:V:sx:y:T:C:cO:r:FP:";
-
-    const struct option long_options[] =
-        {
-
-            {"help", no_argument, 0, 'h'},
-            {"info", no_argument, 0, 'i'},
-            {"output", required_argument, 0, 'o'},
-            {"input", required_argument, 0, 'I'},
-            {"circle", no_argument, 0, 'c'},
-            {"center", required_argument, 0, 'O'},
-            {"radius", required_argument, 0, 'r'},
-            {"fill", no_argument, 0, 'F'},
-            {"fill_color", required_argument, 0, 'P'},
-            {"rgbfilter", no_argument, 0, 'f'},
-            {"component_name", required_argument, 0, 'N'},
-            {"component_value", required_argument, 0, 'V'},
-            {"split", no_argument, 0, 's'},
-            {"number_x", required_argument, 0, 'x'},
-            {"number_y", required_argument, 0, 'y'},
-            {"thickness", required_argument, 0, 'T'},
-            {"color", required_argument, 0, 'C'},
-            {0, 0, 0, 0}};
 
     int opt;
     int option_index;
     int make_info_about_file = 0;
-    int option = 0;
-
-    char *center_coords = NULL;
-    int coord_x, coord_y;
-    int radius = -1;
-    int fill = 0;
-    char *color_f = NULL;
-
-    char *component_name;
-    int component_value = -1;
-    int number_x = -1;
-    int number_y = -1;
-    int thickness = -1;
-    char *color = NULL;
+    int stats_image = 0;
+    int inplace = 0;
+    size_t max_memory = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *batch_source = NULL;
+    char *output_dir = NULL;
+    char *tiles_dir = NULL;
+    char *index_root = NULL;
+    int index_json = 0;
+    int print_stats = 0;
+    int stats_json = 0;
+    char *cache_dir = NULL;
+    size_t cache_size = 0;
+    char *serve_socket = NULL;
+    char *connect_socket = NULL;
+    size_t server_memory = 0;
+    int pyramid = 0;
+    int io_depth = PIPELINE_DEFAULT_DEPTH;
+    int io_threads = 0;
+    int delta = 0;
+    int rle = 0;
+    char *patch_file = NULL;
+
+    OperationArgs args;
+    initOperationArgs(&args);
+    char **specs = NULL;
+    int spec_count = 0;
 
     while ((opt = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1)
     {
+        if (setOperationArg(&args, opt, optarg))
+        {
+            continue;
+        }
         switch (opt)
         {
         case 'h':
@@ -534,84 +442,164 @@ int main(int argc, char *argv[])
             exit(EXIT_SUCCESS);
             break;
         };
-        case 'c':
+        case 'o':
         {
-            option = 1;
+            output_file = optarg;
             break;
         };
-        case 'f':
+        case 'i':
         {
-            option = 2;
+            make_info_about_file = 1;
             break;
         };
-        case 's':
+        case 'H':
         {
-            option = 3;
+            stats_image = 1;
             break;
         };
-        case 'o':
+        case 'd':
         {
-            output_file = optarg;
+            delta = 1;
             break;
         };
-        case 'i':
+        case 'a':
         {
-            make_info_about_file = 1;
+            patch_file = optarg;
             break;
         };
-        case 'r':
+        case 'E':
         {
-            radius = atoi(optarg);
+            rle = 1;
             break;
         };
-        case 'O':
+        case 'p':
         {
-            center_coords = optarg;
+            inplace = 1;
             break;
         };
-        case 'F':
+        case 'm':
         {
-            fill = 1;
+            max_memory = parseSize(optarg);
             break;
         };
-        case 'P':
+        case 't':
         {
-            color_f = optarg;
+            threads = atoi(optarg);
+            if (threads <= 0)
+            {
+                printf("Error: number of threads must be positive\n");
+                exit(WRONG_ARGUMENTS_ERROR);
+            }
             break;
         };
-        case 'N':
+        case 'A':
         {
-            component_name = optarg;
+            checkError(appendString(&specs, &spec_count, optarg));
             break;
         };
-        case 'V':
+        case 'S':
         {
-            component_value = atoi(optarg);
+            readOperationsFile(optarg, &specs, &spec_count);
             break;
         };
-        case 'x':
+        case 'B':
         {
-            number_x = atoi(optarg);
+            batch_source = optarg;
             break;
         };
-        case 'y':
+        case 'D':
         {
-            number_y = atoi(optarg);
+            output_dir = optarg;
             break;
         };
-        case 'T':
+        case 'I':
         {
-            thickness = atoi(optarg);
+            input_file = optarg;
             break;
         };
-        case 'C':
+        case 'G':
         {
-            color = optarg;
+            tiles_dir = optarg;
             break;
         };
-        case 'I':
+        case 'K':
         {
-            input_file = optarg;
+            index_root = optarg;
+            break;
+        };
+        case 'k':
+        {
+            if (strcmp(optarg, "csv") != 0 && strcmp(optarg, "json") != 0)
+            {
+                printf("Error: unknown index format \"%s\"\n", optarg);
+                exit(WRONG_ARGUMENTS_ERROR);
+            }
+            index_json = strcmp(optarg, "json") == 0;
+            break;
+        };
+        case 'X':
+        {
+#ifndef BMP_ENABLE_STATS
+            printf("Error: statistics are disabled in this build\n");
+            exit(OPTION_ERROR);
+#endif
+            if (optarg != NULL && strcmp(optarg, "json") != 0)
+            {
+                printf("Error: unknown statistics format \"%s\"\n", optarg);
+                exit(WRONG_ARGUMENTS_ERROR);
+            }
+            print_stats = 1;
+            stats_json = optarg != NULL;
+            break;
+        };
+        case 'Q':
+        {
+            cache_dir = optarg;
+            break;
+        };
+        case 'q':
+        {
+            cache_size = parseSize(optarg);
+            break;
+        };
+        case 'W':
+        {
+            serve_socket = optarg;
+            break;
+        };
+        case 'w':
+        {
+            connect_socket = optarg;
+            break;
+        };
+        case 'M':
+        {
+            server_memory = parseSize(optarg);
+            break;
+        };
+        case 'J':
+        {
+            io_depth = atoi(optarg);
+            if (io_depth != 0 && (io_depth < PIPELINE_MIN_DEPTH || io_depth > PIPELINE_MAX_DEPTH))
+            {
+                printf("Error: --io-depth must be 0 or between %d and %d\n", PIPELINE_MIN_DEPTH, PIPELINE_MAX_DEPTH);
+                exit(WRONG_ARGUMENTS_ERROR);
+            }
+            break;
+        };
+        case 'j':
+        {
+            io_threads = 1;
+            break;
+        };
+        case 'R':
+        {
+            pyramid = atoi(optarg);
+            if (pyramid <= 0)
+            {
+                printf("Error: --pyramid size must be positive\n");
+                exit(WRONG_ARGUMENTS_ERROR);
+            }
             break;
         };
         case '?':
@@ -623,63 +611,158 @@ int main(int argc, char *argv[])
         }
     }
 
-    BMP bmp = readBMP(input_file);
+    if (connect_socket != NULL)
+    {
+        exit(runClient(connect_socket, argc, argv));
+    }
 
-    if (make_info_about_file == 1)
+    if (serve_socket != NULL)
     {
-        printFileHeader(bmp.bmfh);
-        printInfoHeader(bmp.bmih);
+        printf("Server: listening on %s\n", serve_socket);
+        fflush(stdout);
+        checkError(runServer(serve_socket, threads, server_memory, parseRequest));
         exit(EXIT_SUCCESS);
     }
 
-    switch (option)
-    {
-    case 1:
+    if (index_root != NULL)
     {
+        ThreadPool pool;
+        checkError(createPool(&pool, threads));
+        int code = indexDirectory(index_root, &pool, stdout, index_json);
+        destroyPool(&pool);
+        checkError(code);
+        exit(EXIT_SUCCESS);
+    }
 
-        Rgb *color_line = getColor(color);
-        Rgb *fill_color = NULL;
-        if (fill == 1)
+    if (stats_image)
+    {
+        Rgb color;
+        if (args.color != NULL)
         {
-            fill_color = getColor(color_f);
-        }
-        getCoordinates(center_coords, &coord_x, &coord_y);
-        coord_y = bmp.bmih.height - coord_y;
-        checkDataDrawCircle(&bmp, coord_x, coord_y, radius, thickness, color_line, fill, fill_color);
-        drawCircle(&bmp, coord_x, coord_y, radius, thickness, color_line, fill, fill_color);
-        free(color_line);
-        if (fill_color != NULL)
-        {
-            free(fill_color);
+            checkError(getColor(args.color, &color));
         }
-        break;
-    };
+        ThreadPool pool;
+        checkError(createPool(&pool, threads));
+        int code = imageStatistics(input_file, args.color != NULL ? &color : NULL, &pool, stdout);
+        destroyPool(&pool);
+        checkError(code);
+        exit(EXIT_SUCCESS);
+    }
 
-    case 2:
+    if (patch_file != NULL)
     {
-        checkDataRgbFilter(&bmp, component_name, component_value);
-        rgbFilter(&bmp, component_name, component_value);
-        break;
-    };
+        checkError(applyPatch(input_file, patch_file, output_file));
+        exit(EXIT_SUCCESS);
+    }
 
-    case 3:
+    if (tiles_dir != NULL)
     {
-        Rgb *color_line = getColor(color);
-        checkDataDividePicture(&bmp, thickness, number_x, number_y, color_line);
-        dividePicture(&bmp, thickness, number_x, number_y, color_line);
-        free(color_line);
-        break;
-    };
+        ThreadPool pool;
+        checkError(createPool(&pool, threads));
+        int code = exportTiles(input_file, tiles_dir, args.number_x, args.number_y, &pool);
+        destroyPool(&pool);
+        checkError(code);
+        exit(EXIT_SUCCESS);
+    }
 
-    default:
+    OperationArgs *op_args;
+    int op_count;
+    checkError(collectOperations(&args, specs, spec_count, &op_args, &op_count));
+
+    BmpStats stats;
+    initStats(&stats);
+    if (pyramid > 0 && max_memory > 0 && !inplace)
     {
-        printf("Error: no option selected\n");
-        exit(OPTION_ERROR);
-        break;
+        printf("Error: --pyramid needs the whole image in memory and can not be used with --max-memory\n");
+        exit(WRONG_ARGUMENTS_ERROR);
     }
+    if (delta && (max_memory > 0 || inplace || pyramid > 0))
+    {
+        printf("Error: --delta needs the changed rows in memory and can not be used with --max-memory, --inplace or --pyramid\n");
+        exit(WRONG_ARGUMENTS_ERROR);
     }
+    if (rle && (inplace || delta || pyramid > 0))
+    {
+        printf("Error: --rle can not be used with --inplace, --delta or --pyramid\n");
+        exit(WRONG_ARGUMENTS_ERROR);
+    }
+    ProcessOptions options = {op_args, op_count, inplace, max_memory, NULL, NULL, print_stats ? &stats : NULL, NULL, pyramid, io_depth, io_threads, delta, rle};
+    ResultCache cache;
+    if (cache_dir != NULL)
+    {
+        checkError(openResultCache(&cache, cache_dir, cache_size, op_args, op_count));
+        options.cache = &cache;
+    }
+    int code;
+    if (batch_source != NULL)
+    {
+        if (output_dir == NULL && !inplace)
+        {
+            printf("Error: --output-dir is required in batch mode\n");
+            exit(WRONG_ARGUMENTS_ERROR);
+        }
+        code = runBatch(batch_source, inplace ? NULL : output_dir, threads, &options, reportBatchFile);
+        if (batch_processed == 0 && code != 0)
+        {
+            checkError(code);
+        }
+        printf("Batch: %d files processed, %d failed\n", batch_processed, batch_failed);
+        if (options.cache != NULL)
+        {
+            printf("Cache: %lu hits, %lu misses\n", cache.hits, cache.misses);
+        }
+        if (print_stats)
+        {
+            printStats(stdout, &stats, stats_json);
+        }
+    }
+    else
+    {
+        BMP bmp;
+        initBMP(&bmp, NULL);
+        if (make_info_about_file == 1)
+        {
+            // нужны только заголовки: массив пикселей не читается
+            FILE *f;
+            checkError(openBMP(input_file, &bmp, &f));
+            BitmapFileHeader file_header = bmp.bmfh;
+            BitmapInfoHeader info_header = fileInfoHeader(&bmp);
+            if (bmp.rle != NULL)
+            {
+                // заголовки сжатого файла уже переделаны под распакованное изображение
+                rewind(f);
+                fread(&file_header, sizeof(file_header), 1, f);
+                fread(&info_header, sizeof(info_header), 1, f);
+            }
+            fclose(f);
+            printFileHeader(file_header);
+            printInfoHeader(info_header);
+            exit(EXIT_SUCCESS);
+        }
 
-    writeBMP(output_file, bmp);
+        ThreadPool pool;
+        checkError(createPool(&pool, threads));
+        options.pool = &pool;
+        code = processFile(&bmp, input_file, output_file, &options);
+        destroyPool(&pool);
+        freeBMP(&bmp);
+        checkError(code);
+        if (print_stats)
+        {
+            printStats(stdout, &stats, stats_json);
+        }
+    }
 
-    return 0;
-}
\ No newline at end of file
+    if (options.cache != NULL)
+    {
+        closeResultCache(&cache);
+    }
+    free(op_args);
+    for (int i = 0; i < spec_count; i++)
+    {
+        free(specs[i]);
+    }
+    free(specs);
+
+    return code;
+}
@@ -0,0 +1,598 @@
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+int getColor(char *color_str, Rgb *color)
+{
+    if (color_str == NULL)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: wrong argument");
+    }
+
+    int check;
+    int r, g, b;
+    check = sscanf(color_str, "%d.%d.%d", &r, &g, &b);
+    if (check != 3)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: invalid color format (expected \"RRR.GGG.BBB\")");
+    }
+
+    if ((r < 0) || (r > 255) || (g < 0) || (g > 255) || (b < 0) || (b > 255))
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: Color values must be between 0 and 255");
+    }
+
+    color->r = (unsigned char)r;
+    color->g = (unsigned char)g;
+    color->b = (unsigned char)b;
+    return 0;
+}
+
+int getCoordinates(char *center_coords, int *coord_x, int *coord_y)
+{
+    int check_coords = 0;
+    if (center_coords != NULL)
+    {
+        check_coords = sscanf(center_coords, "%d.%d", coord_x, coord_y);
+    }
+    if (check_coords < 2)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: wrong center coordinates");
+    }
+    return 0;
+}
+
+void applyCircle(BMP *bmp, void *params)
+{
+    CircleParams *p = params;
+    drawCircle(bmp, p->coord_x, p->coord_y, p->radius, p->thickness, &p->line_color, p->fill, &p->fill_color);
+}
+
+void applyLutOperation(BMP *bmp, void *params)
+{
+    applyLut(bmp, params);
+}
+
+void applySplit(BMP *bmp, void *params)
+{
+    SplitParams *p = params;
+    dividePicture(bmp, p->thickness, p->number_x, p->number_y, &p->color);
+}
+
+void applyLine(BMP *bmp, void *params)
+{
+    LineParams *p = params;
+    drawLine(bmp, p->x0, p->y0, p->x1, p->y1, p->thickness, &p->color);
+}
+
+// Все операции применяются к строкам буфера по порядку; каждая меняет только
+// свои пиксели, поэтому порядок сохраняется и при обработке по полосам
+void applyOperations(BMP *bmp, void *params)
+{
+    OperationList *list = params;
+    for (int i = 0; i < list->count; i++)
+    {
+        if (list->items[i].apply == NULL)
+        {
+            continue; // операция влита в предыдущую (fuseOperations)
+        }
+        STATS_TIME(start);
+        list->items[i].apply(bmp, &list->items[i].params);
+        STATS_OPERATION(list->stats, i, start);
+    }
+}
+
+void initOperationArgs(OperationArgs *args)
+{
+    args->option = OPERATION_NONE;
+    args->center_coords = NULL;
+    args->radius = -1;
+    args->fill = 0;
+    args->color_f = NULL;
+    args->component_name = NULL;
+    args->component_value = -1;
+    args->number_x = -1;
+    args->number_y = -1;
+    args->thickness = -1;
+    args->color = NULL;
+    args->circles_file = NULL;
+    args->start_coords = NULL;
+    args->end_coords = NULL;
+    args->lut_spec = NULL;
+    args->channels = NULL;
+}
+
+// Запоминает опцию операции; возвращает 0, если опция к операциям не относится
+int setOperationArg(OperationArgs *args, int opt, char *value)
+{
+    switch (opt)
+    {
+    case 'c':
+        args->option = OPERATION_CIRCLE;
+        break;
+    case 'f':
+        args->option = OPERATION_FILTER;
+        break;
+    case 's':
+        args->option = OPERATION_SPLIT;
+        break;
+    case 'r':
+        args->radius = atoi(value);
+        break;
+    case 'O':
+        args->center_coords = value;
+        break;
+    case 'F':
+        args->fill = 1;
+        break;
+    case 'P':
+        args->color_f = value;
+        break;
+    case 'N':
+        args->component_name = value;
+        break;
+    case 'V':
+        args->component_value = atoi(value);
+        break;
+    case 'x':
+        args->number_x = atoi(value);
+        break;
+    case 'y':
+        args->number_y = atoi(value);
+        break;
+    case 'T':
+        args->thickness = atoi(value);
+        break;
+    case 'C':
+        args->color = value;
+        break;
+    case 'U':
+        args->option = OPERATION_CIRCLES;
+        args->circles_file = value;
+        break;
+    case 'L':
+        args->option = OPERATION_LINE;
+        break;
+    case 'b':
+        args->start_coords = value;
+        break;
+    case 'e':
+        args->end_coords = value;
+        break;
+    case 'Y':
+        args->option = OPERATION_LUT;
+        args->lut_spec = value;
+        break;
+    case 'Z':
+        args->channels = value;
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+// Проверяет параметры и переводит их в координаты изображения
+int buildOperation(BMP *bmp, OperationArgs *args, Operation *op)
+{
+    int code = 0;
+    switch (args->option)
+    {
+    case OPERATION_CIRCLE:
+    {
+        CircleParams *circle = &op->params.circle;
+        if ((code = getColor(args->color, &circle->line_color)) != 0 ||
+            (args->fill == 1 && (code = getColor(args->color_f, &circle->fill_color)) != 0) ||
+            (code = getCoordinates(args->center_coords, &circle->coord_x, &circle->coord_y)) != 0)
+        {
+            return code;
+        }
+        circle->coord_y = bmp->bmih.height - circle->coord_y;
+        circle->radius = args->radius;
+        circle->thickness = args->thickness;
+        circle->fill = args->fill;
+        code = checkDataDrawCircle(bmp, circle->coord_x, circle->coord_y, circle->radius, circle->thickness,
+                                   &circle->line_color, circle->fill, circle->fill ? &circle->fill_color : NULL);
+        op->apply = applyCircle;
+        break;
+    }
+    case OPERATION_FILTER:
+    {
+        if ((code = checkDataRgbFilter(bmp, args->component_name, args->component_value)) != 0)
+        {
+            return code;
+        }
+        char spec[16];
+        snprintf(spec, sizeof(spec), "set=%d", args->component_value);
+        code = buildLut(spec, strcmp(args->component_name, "red") == 0 ? "r" : strcmp(args->component_name, "green") == 0 ? "g" : "b",
+                        &op->params.lut);
+        op->apply = applyLutOperation;
+        break;
+    }
+    case OPERATION_SPLIT:
+    {
+        SplitParams *split = &op->params.split;
+        if ((code = getColor(args->color, &split->color)) != 0)
+        {
+            return code;
+        }
+        code = checkDataDividePicture(bmp, args->thickness, args->number_x, args->number_y, &split->color);
+        split->thickness = args->thickness;
+        split->number_x = args->number_x;
+        split->number_y = args->number_y;
+        op->apply = applySplit;
+        break;
+    }
+    case OPERATION_CIRCLES:
+    {
+        code = buildCircles(bmp, args->circles_file, &op->params.circles);
+        op->apply = applyCircles;
+        break;
+    }
+    case OPERATION_LUT:
+    {
+        code = buildLut(args->lut_spec, args->channels, &op->params.lut);
+        op->apply = applyLutOperation;
+        break;
+    }
+    case OPERATION_LINE:
+    {
+        LineParams *line = &op->params.line;
+        if ((code = getColor(args->color, &line->color)) != 0 ||
+            (code = getCoordinates(args->start_coords, &line->x0, &line->y0)) != 0 ||
+            (code = getCoordinates(args->end_coords, &line->x1, &line->y1)) != 0)
+        {
+            return code;
+        }
+        line->thickness = args->thickness;
+        code = checkDataDrawLine(bmp, line->x0, line->y0, line->x1, line->y1, line->thickness, &line->color);
+        op->apply = applyLine;
+        break;
+    }
+    default:
+    {
+        code = setError(OPTION_ERROR, "Error: no option selected");
+        break;
+    }
+    }
+    return code;
+}
+
+// Строит все операции по порядку и складывает поканальные; в *built - сколько
+// построено (их нужно освободить и при ошибке)
+int buildOperations(BMP *bmp, OperationArgs *args, int count, Operation *ops, int *built)
+{
+    int code = 0;
+    *built = 0;
+    while (code == 0 && *built < count)
+    {
+        code = buildOperation(bmp, &args[*built], &ops[*built]);
+        if (code == 0)
+        {
+            (*built)++;
+        }
+    }
+    if (code == 0)
+    {
+        fuseOperations(ops, *built);
+    }
+    return code;
+}
+
+// Складывает подряд идущие поканальные преобразования в таблицы первого из
+// них, чтобы изображение проходилось один раз; остальные получают apply == NULL
+// и пропускаются, так что номера операций в статистике не сдвигаются
+void fuseOperations(Operation *ops, int count)
+{
+    int head = -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (ops[i].apply != applyLutOperation)
+        {
+            head = -1;
+        }
+        else if (head < 0)
+        {
+            head = i;
+        }
+        else
+        {
+            composeLut(&ops[head].params.lut, &ops[i].params.lut);
+            ops[i].apply = NULL;
+        }
+    }
+}
+
+// Освобождает память, выделенную buildOperation (нужна только для окружностей из файла)
+void freeOperation(Operation *op)
+{
+    if (op->apply == applyCircles)
+    {
+        freeCircles(&op->params.circles);
+    }
+}
+
+// Строки изображения [*begin, *end), которые могут изменить операции; 0, если
+// хотя бы одна операция меняет всё изображение. Границы берутся с запасом в строку
+static int operationRegion(Operation *ops, int count, BMP *bmp, long long *begin, long long *end)
+{
+    long long H = bmp->bmih.height;
+    *begin = H;
+    *end = 0;
+    for (int i = 0; i < count; i++)
+    {
+        long long low, high;
+        if (ops[i].apply == applyCircle)
+        {
+            CircleParams *c = &ops[i].params.circle;
+            low = (long long)c->coord_y - c->radius - c->thickness / 2;
+            high = (long long)c->coord_y + c->radius + c->thickness / 2;
+        }
+        else if (ops[i].apply == applyCircles)
+        {
+            CirclesParams *circles = &ops[i].params.circles;
+            low = H;
+            high = -1;
+            for (int j = 0; j < circles->count; j++)
+            {
+                CircleParams *c = &circles->items[j];
+                long long outer = (long long)c->radius + c->thickness / 2;
+                low = c->coord_y - outer < low ? c->coord_y - outer : low;
+                high = c->coord_y + outer > high ? c->coord_y + outer : high;
+            }
+        }
+        else if (ops[i].apply == applyLine)
+        {
+            // строки линии лежат между H - y0 и H - y1, толщина добавляется с обеих сторон
+            LineParams *line = &ops[i].params.line;
+            long long row0 = H - line->y0;
+            long long row1 = H - line->y1;
+            low = (row0 < row1 ? row0 : row1) - line->thickness;
+            high = (row0 > row1 ? row0 : row1) + line->thickness;
+        }
+        else
+        {
+            return 0;
+        }
+        *begin = low - 1 < *begin ? low - 1 : *begin;
+        *end = high + 2 > *end ? high + 2 : *end;
+    }
+    *begin = *begin < 0 ? 0 : *begin;
+    *end = *end > H ? H : *end;
+    if (*begin > *end)
+    {
+        *begin = *end;
+    }
+    return 1;
+}
+
+// Хватает ли в файле байтов на весь массив пикселей (копировать короткий файл нельзя)
+static int holdsAllPixels(FILE *f, BMP *bmp)
+{
+    struct stat st;
+    return fstat(fileno(f), &st) == 0 &&
+           (unsigned long long)st.st_size >= bmp->bmfh.pixelArrOffset + (unsigned long long)bmp->stride * bmp->bmih.height;
+}
+
+// Загружает файл в image, применяет к нему все операции и сохраняет результат.
+// Ошибки возвращаются кодом с сообщением в lastError(); буфер image остаётся
+// выделенным, чтобы следующий файл мог загрузиться в него же.
+// Если все операции локальные (окружности, линии), читаются и пишутся только
+// затронутые строки, а остальные копируются из входного файла ядром
+static int processImage(BMP *image, char *input_file, char *output_file, ProcessOptions *options)
+{
+    FILE *stream = NULL;
+    unsigned int band_rows = 0;
+    int region = 0;
+    int code;
+    STATS_ATTACH(options->stats);
+    STATS_TIME(start);
+    if (options->inplace)
+    {
+        code = mapBMP(input_file, image, 1);
+    }
+    else
+    {
+        // пиксели читаются после разбора операций, но проверкам нужен буфер
+        code = openBMP(input_file, image, &stream);
+        if (code == 0)
+        {
+            code = allocPixels(image, 1);
+        }
+    }
+
+    Operation *ops = (Operation *)malloc(sizeof(Operation) * (options->op_count ? options->op_count : 1));
+    if (code == 0 && ops == NULL)
+    {
+        code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    if (code == 0 && options->op_count == 0)
+    {
+        code = setError(OPTION_ERROR, "Error: no option selected");
+    }
+    int built = 0;
+    if (code == 0)
+    {
+        code = buildOperations(image, options->ops, options->op_count, ops, &built);
+    }
+    BmpStats *stats = NULL;
+#ifdef BMP_ENABLE_STATS
+    stats = options->stats;
+    if (stats != NULL)
+    {
+        for (int i = 0; i < options->op_count && i < STATS_MAX_OPERATIONS; i++)
+        {
+            stats->operation_types[i] = options->ops[i].option;
+        }
+        if (options->op_count > stats->operation_count)
+        {
+            stats->operation_count = options->op_count;
+        }
+    }
+#endif
+
+    // сжатые файлы читаются и пишутся только по порядку строк: без регионов и конвейера
+    int coded = image->rle != NULL || options->rle;
+    if (code == 0 && options->delta && image->rle != NULL)
+    {
+        code = setError(WRONG_ARGUMENTS_ERROR, "Error: --delta needs an uncompressed input file");
+    }
+    if (code == 0 && options->rle)
+    {
+        if (image->pixel_bytes != 3)
+        {
+            code = setError(WRONG_ARGUMENTS_ERROR, "Error: --rle output needs a 24-bit image");
+        }
+        else
+        {
+            // writeBMP и streamBMP сжимают строки, если в заголовке стоит BI_RLE24
+            image->bmih.compression = BI_RLE24;
+        }
+    }
+
+    if (code == 0 && stream != NULL)
+    {
+        long long region_begin, region_end;
+        unsigned int H = image->bmih.height;
+        // уровням --pyramid нужно всё изображение в буфере
+        if (options->pyramid == 0 && !coded && operationRegion(ops, built, image, &region_begin, &region_end) && region_end - region_begin < H &&
+            (options->max_memory == 0 || (size_t)(region_end - region_begin) * image->stride <= options->max_memory) &&
+            holdsAllPixels(stream, image) && !isSameFile(input_file, output_file))
+        {
+            region = 1;
+            code = allocPixels(image, region_end - region_begin);
+            if (code == 0)
+            {
+                code = readRegion(stream, image, region_begin, region_end - region_begin);
+            }
+        }
+        else if (options->max_memory > 0 && options->pyramid == 0)
+        {
+            // буферы конвейера делят бюджет памяти между собой
+            band_rows = bandRows(image, options->io_depth > 0 && !coded ? options->max_memory / options->io_depth : options->max_memory);
+            code = options->io_depth > 0 && !coded ? 0 : allocPixels(image, band_rows);
+        }
+        else if (options->io_depth > 0 && options->pyramid == 0 && !options->delta && !coded && (size_t)H * image->stride >= PIPELINE_MIN_BYTES &&
+                 !isSameFile(input_file, output_file))
+        {
+            // большое изображение: чтение и запись полос идут одновременно с обработкой
+            band_rows = bandRows(image, PIPELINE_BAND_BYTES);
+        }
+        else
+        {
+            code = allocPixels(image, H);
+            if (code == 0)
+            {
+                readRows(stream, image, H);
+            }
+        }
+        if (band_rows == 0)
+        {
+            fclose(stream);
+            stream = NULL;
+        }
+    }
+    if (code == 0 && options->delta)
+    {
+        image->dirty = calloc(image->bmih.height > 0 ? (size_t)image->bmih.height * dirtyTiles(image) + 1 : 1, 1);
+        if (image->dirty == NULL)
+        {
+            code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+        }
+    }
+
+    if (code == 0)
+    {
+        OperationList list = {ops, options->op_count, stats};
+        if (stream != NULL)
+        {
+            if (isSameFile(input_file, output_file))
+            {
+                code = setError(WRONG_ARGUMENTS_ERROR, "Error: input and output must be different files when --max-memory is used");
+            }
+            else if (options->io_depth > 0 && !coded)
+            {
+                code = pipelineBMP(stream, output_file, image, band_rows, options->io_depth, options->io_threads, options->pool,
+                                   applyOperations, &list);
+            }
+            else
+            {
+                code = streamBMP(stream, output_file, image, band_rows, options->pool, applyOperations, &list);
+            }
+        }
+        else
+        {
+            runOperation(options->pool, image, applyOperations, &list);
+            if (options->delta)
+            {
+                code = writeDeltaBMP(input_file, output_file, image);
+            }
+            else if (region)
+            {
+                code = writeRegionBMP(input_file, output_file, image);
+            }
+            else if (options->pyramid > 0)
+            {
+                code = writePyramid(image, options->inplace ? input_file : output_file, !options->inplace, options->pyramid, options->pool);
+            }
+            else if (!options->inplace)
+            {
+                code = writeBMP(output_file, image);
+            }
+        }
+    }
+
+    if (stream != NULL)
+    {
+        fclose(stream);
+    }
+    closeBMP(image);
+    free(image->dirty);
+    image->dirty = NULL;
+    for (int i = 0; i < built; i++)
+    {
+        freeOperation(&ops[i]);
+    }
+    free(ops);
+    STATS_ADD(files, 1);
+    STATS_ELAPSED(total_ns, start);
+    STATS_ATTACH(NULL);
+    return code;
+}
+
+// processImage с кэшем результатов: при попадании файл копируется из кэша без
+// разбора, при промахе готовый результат добавляется в кэш. На месте (--inplace),
+// с уровнями --pyramid, которых в кэше нет, для патчей --delta и сжатого --rle
+// результата кэш не используется
+int processFile(BMP *image, char *input_file, char *output_file, ProcessOptions *options)
+{
+    ResultCache *cache = options->inplace || options->pyramid > 0 || options->delta || options->rle ? NULL : options->cache;
+    char key[CACHE_KEY_SIZE];
+    if (cache != NULL && cacheKey(cache, input_file, key) != 0)
+    {
+        cache = NULL;
+    }
+    if (cache != NULL && fetchCachedResult(cache, key, output_file))
+    {
+        STATS_ATTACH(options->stats);
+        STATS_ADD(files, 1);
+        STATS_ADD(cache_hits, 1);
+        STATS_ATTACH(NULL);
+        return 0;
+    }
+
+    int code = processImage(image, input_file, output_file, options);
+    if (cache != NULL)
+    {
+        STATS_ATTACH(options->stats);
+        STATS_ADD(cache_misses, 1);
+        STATS_ATTACH(NULL);
+        if (code == 0)
+        {
+            storeCachedResult(cache, key, output_file);
+        }
+    }
+    return code;
+}
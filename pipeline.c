@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+// Конвейер ввода-вывода по полосам строк: пока полоса k обрабатывается,
+// следующие полосы уже читаются, а предыдущая пишется. Запросы уходят в
+// io_uring (системными вызовами, без liburing); если ядро его не даёт,
+// чтение и запись выполняют два потока. Каждый из depth буферов проходит
+// по кругу чтение -> обработка -> запись
+
+typedef struct PipelineSlot
+{
+    unsigned char *pixels;
+    struct iovec iov; // ещё не переданная часть запроса
+    off_t offset;     // позиция в файле для iov
+    size_t size;      // размер всего запроса
+    size_t done;      // сколько байт уже передано
+    int writing;
+    int busy;         // запрос ещё не завершён
+} PipelineSlot;
+
+#ifdef HAVE_IO_URING
+typedef struct UringRing
+{
+    int fd;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} UringRing;
+#endif
+
+typedef struct Pipeline
+{
+    int in;
+    int out;
+    int depth;
+    PipelineSlot slots[PIPELINE_MAX_DEPTH];
+    int uring; // запросы идут через io_uring, иначе через потоки
+#ifdef HAVE_IO_URING
+    UringRing ring;
+#endif
+    // запасной вариант: очереди номеров слотов для потока чтения и потока записи
+    pthread_t reader;
+    pthread_t writer;
+    int threads;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int queue[2][PIPELINE_MAX_DEPTH];
+    int queue_head[2];
+    int queue_count[2];
+    int stop;
+    int failed; // запись не удалась
+} Pipeline;
+
+#ifdef HAVE_IO_URING
+static int uringSetup(UringRing *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+    {
+        ring->sq_map_size = ring->cq_map_size = ring->sq_map_size > ring->cq_map_size ? ring->sq_map_size : ring->cq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single || ring->sq_map == MAP_FAILED ? ring->sq_map
+                                                        : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = ring->cq_map == MAP_FAILED ? MAP_FAILED
+                                            : mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        {
+            munmap(ring->cq_map, ring->cq_map_size);
+        }
+        if (ring->sq_map != MAP_FAILED)
+        {
+            munmap(ring->sq_map, ring->sq_map_size);
+        }
+        close(ring->fd);
+        return -1;
+    }
+
+    unsigned char *sq = ring->sq_map;
+    unsigned char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uringClose(UringRing *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map)
+    {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+// Ставит в очередь остаток запроса слота; в полёте не больше depth запросов,
+// поэтому место в кольце всегда есть
+static int uringSubmit(Pipeline *p, int index)
+{
+    UringRing *ring = &p->ring;
+    PipelineSlot *slot = &p->slots[index];
+    unsigned tail = *ring->sq_tail;
+    unsigned position = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[position];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = slot->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = slot->writing ? p->out : p->in;
+    sqe->addr = (unsigned long)&slot->iov;
+    sqe->len = 1;
+    sqe->off = slot->offset;
+    sqe->user_data = index;
+    ring->sq_array[position] = position;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    for (;;)
+    {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+        if (submitted >= 0 || errno != EINTR)
+        {
+            return submitted == 1 ? 0 : -1;
+        }
+    }
+}
+
+// Ждёт хотя бы одного завершения и разбирает все готовые
+static void uringReap(Pipeline *p)
+{
+    UringRing *ring = &p->ring;
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        {
+            // кольцо сломалось: незавершённые запросы считаются неудачными
+            for (int i = 0; i < p->depth; i++)
+            {
+                p->failed |= p->slots[i].busy && p->slots[i].writing;
+                p->slots[i].busy = 0;
+            }
+            return;
+        }
+    }
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        PipelineSlot *slot = &p->slots[cqe->user_data];
+        int result = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (result > 0)
+        {
+            slot->done += result;
+            slot->iov.iov_base = (char *)slot->iov.iov_base + result;
+            slot->iov.iov_len -= result;
+            slot->offset += result;
+        }
+        int retry = result == -EINTR || result == -EAGAIN;
+        if ((result > 0 && slot->done < slot->size) || retry)
+        {
+            if (uringSubmit(p, slot - p->slots) == 0)
+            {
+                continue;
+            }
+            result = -EIO;
+        }
+        // чтение за концом файла просто короче, неудачная запись - ошибка
+        if (slot->writing && slot->done < slot->size)
+        {
+            p->failed = 1;
+        }
+        slot->busy = 0;
+    }
+}
+#endif
+
+// Поток чтения (queue 0) или записи (queue 1): выполняет запросы по очереди
+static void *ioWorker(Pipeline *p, int queue)
+{
+    pthread_mutex_lock(&p->lock);
+    for (;;)
+    {
+        while (!p->stop && p->queue_count[queue] == 0)
+        {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        if (p->queue_count[queue] == 0)
+        {
+            break;
+        }
+        PipelineSlot *slot = &p->slots[p->queue[queue][p->queue_head[queue]]];
+        pthread_mutex_unlock(&p->lock);
+
+        int fd = slot->writing ? p->out : p->in;
+        while (slot->done < slot->size)
+        {
+            ssize_t n = slot->writing ? pwrite(fd, slot->pixels + slot->done, slot->size - slot->done, slot->offset + slot->done)
+                                      : pread(fd, slot->pixels + slot->done, slot->size - slot->done, slot->offset + slot->done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            slot->done += n;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (slot->writing && slot->done < slot->size)
+        {
+            p->failed = 1;
+        }
+        p->queue_head[queue] = (p->queue_head[queue] + 1) % PIPELINE_MAX_DEPTH;
+        p->queue_count[queue]--;
+        slot->busy = 0;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void *readerThread(void *arg)
+{
+    return ioWorker(arg, 0);
+}
+
+static void *writerThread(void *arg)
+{
+    return ioWorker(arg, 1);
+}
+
+static int startIo(Pipeline *p, int use_threads)
+{
+#ifdef HAVE_IO_URING
+    if (!use_threads && uringSetup(&p->ring, p->depth) == 0)
+    {
+        p->uring = 1;
+        return 0;
+    }
+#endif
+    (void)use_threads;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+    if (pthread_create(&p->reader, NULL, readerThread, p) != 0)
+    {
+        return setError(MEMORY_ALLOCATION_ERROR, "Error: can not start I/O threads");
+    }
+    if (pthread_create(&p->writer, NULL, writerThread, p) != 0)
+    {
+        pthread_mutex_lock(&p->lock);
+        p->stop = 1;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->reader, NULL);
+        return setError(MEMORY_ALLOCATION_ERROR, "Error: can not start I/O threads");
+    }
+    p->threads = 1;
+    return 0;
+}
+
+static void stopIo(Pipeline *p)
+{
+#ifdef HAVE_IO_URING
+    if (p->uring)
+    {
+        uringClose(&p->ring);
+        return;
+    }
+#endif
+    if (p->threads)
+    {
+        pthread_mutex_lock(&p->lock);
+        p->stop = 1;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->reader, NULL);
+        pthread_join(p->writer, NULL);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->changed);
+}
+
+static void submitIo(Pipeline *p, int index, int writing, off_t offset, size_t size)
+{
+    PipelineSlot *slot = &p->slots[index];
+    slot->writing = writing;
+    slot->offset = offset;
+    slot->size = size;
+    slot->done = 0;
+    slot->iov.iov_base = slot->pixels;
+    slot->iov.iov_len = size;
+    slot->busy = 1;
+#ifdef HAVE_IO_URING
+    if (p->uring)
+    {
+        if (uringSubmit(p, index) != 0)
+        {
+            p->failed |= writing;
+            slot->busy = 0;
+        }
+        return;
+    }
+#endif
+    pthread_mutex_lock(&p->lock);
+    int queue = writing;
+    p->queue[queue][(p->queue_head[queue] + p->queue_count[queue]) % PIPELINE_MAX_DEPTH] = index;
+    p->queue_count[queue]++;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void waitIo(Pipeline *p, int index)
+{
+    PipelineSlot *slot = &p->slots[index];
+#ifdef HAVE_IO_URING
+    if (p->uring)
+    {
+        while (slot->busy)
+        {
+            uringReap(p);
+        }
+        return;
+    }
+#endif
+    pthread_mutex_lock(&p->lock);
+    while (slot->busy)
+    {
+        pthread_cond_wait(&p->changed, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+// То же, что streamBMP, но чтение следующих полос и запись предыдущих идут
+// одновременно с обработкой. f стоит в начале массива пикселей; буфер bmp
+// перевыделяется под depth полос по band_rows строк
+int pipelineBMP(FILE *f, char *filename, BMP *bmp, unsigned int band_rows, int depth, int use_threads, ThreadPool *pool,
+                BandOperation operation, void *params)
+{
+    depth = depth < PIPELINE_MIN_DEPTH ? PIPELINE_MIN_DEPTH : depth > PIPELINE_MAX_DEPTH ? PIPELINE_MAX_DEPTH : depth;
+    unsigned int H = bmp->bmih.height;
+    size_t band_bytes = bmp->stride * band_rows;
+    int code = allocPixels(bmp, (size_t)depth * band_rows);
+    if (code != 0)
+    {
+        return code;
+    }
+    FILE *ff = fopen(filename, "wb");
+    if (!ff)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    writeHeaders(ff, bmp);
+    if (fflush(ff) != 0)
+    {
+        fclose(ff);
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+
+    Pipeline *p = (Pipeline *)calloc(1, sizeof(Pipeline));
+    if (p == NULL)
+    {
+        fclose(ff);
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    p->in = fileno(f);
+    p->out = fileno(ff);
+    p->depth = depth;
+    for (int i = 0; i < depth; i++)
+    {
+        p->slots[i].pixels = (unsigned char *)bmp->buffer + i * band_bytes;
+    }
+    code = startIo(p, use_threads);
+    if (code != 0)
+    {
+        free(p);
+        fclose(ff);
+        return code;
+    }
+
+    off_t in_offset = ftello(f);
+    off_t out_offset = ftello(ff);
+    unsigned int count = (H + band_rows - 1) / band_rows;
+    // полоса k лежит в слоте k % depth; чтение опережает обработку на depth - 2
+    // полосы, а слот полосы k - 2 освобождается, когда её запись закончилась
+    unsigned int ahead = depth - 2;
+    for (unsigned int k = 0; k < count && k < ahead; k++)
+    {
+        size_t rows = H - k * band_rows < band_rows ? H - k * band_rows : band_rows;
+        submitIo(p, k % depth, 0, in_offset + (off_t)k * band_bytes, rows * bmp->stride);
+    }
+    for (unsigned int k = 0; k < count; k++)
+    {
+        unsigned int next = k + ahead;
+        if (next < count)
+        {
+            if (k >= 2)
+            {
+                STATS_TIME(start);
+                waitIo(p, (k - 2) % depth);
+                STATS_ELAPSED(save_ns, start);
+            }
+            size_t rows = H - next * band_rows < band_rows ? H - next * band_rows : band_rows;
+            submitIo(p, next % depth, 0, in_offset + (off_t)next * band_bytes, rows * bmp->stride);
+        }
+
+        unsigned int y = k * band_rows;
+        unsigned int rows = H - y < band_rows ? H - y : band_rows;
+        PipelineSlot *slot = &p->slots[k % depth];
+        STATS_TIME(start);
+        waitIo(p, k % depth);
+        STATS_ADD(bytes_read, slot->done);
+        bmp->pixels = slot->pixels;
+        finishRows(bmp, slot->done, rows);
+        STATS_ELAPSED(pixel_load_ns, start);
+
+        bmp->first_row = bmp->top_down ? H - y - rows : y;
+        runOperation(pool, bmp, operation, params);
+        submitIo(p, k % depth, 1, out_offset + (off_t)y * bmp->stride, (size_t)rows * bmp->stride);
+        STATS_ADD(bytes_written, (size_t)rows * bmp->stride);
+    }
+
+    STATS_TIME(start);
+    for (int i = 0; i < depth; i++)
+    {
+        waitIo(p, i);
+    }
+    STATS_ELAPSED(save_ns, start);
+    stopIo(p);
+    int failed = p->failed;
+    free(p);
+    if (fclose(ff) != 0 || failed)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    return 0;
+}
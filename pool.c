@@ -0,0 +1,144 @@
+#include "bmp.h"
+
+#include <stdlib.h>
+
+static void runTasks(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next_task < pool->task_count)
+    {
+        int index = pool->next_task++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->function(pool->arg, index);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+        {
+            pthread_cond_broadcast(&pool->finish);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *poolWorker(void *arg)
+{
+    ThreadPool *pool = arg;
+    unsigned long seen = 0;
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && pool->generation == seen)
+        {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stop)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        runTasks(pool);
+    }
+}
+
+int createPool(ThreadPool *pool, int count)
+{
+    pool->count = count > 0 ? count : 1;
+    pool->task_count = 0;
+    pool->next_task = 0;
+    pool->pending = 0;
+    pool->generation = 0;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finish, NULL);
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * pool->count);
+    if (pool->threads == NULL)
+    {
+        pool->count = 1;
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    for (int i = 1; i < pool->count; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, poolWorker, pool) != 0)
+        {
+            pool->count = i;
+            break;
+        }
+    }
+    return 0;
+}
+
+void poolRun(ThreadPool *pool, int task_count, TaskFunction function, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->function = function;
+    pool->arg = arg;
+    pool->task_count = task_count;
+    pool->next_task = 0;
+    pool->pending = task_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    runTasks(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+    {
+        pthread_cond_wait(&pool->finish, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void destroyPool(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->count; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finish);
+}
+
+typedef struct BandJob
+{
+    BMP *bmp;
+    BandOperation operation;
+    void *params;
+    unsigned int band_rows;
+} BandJob;
+
+static void runBand(void *arg, int index)
+{
+    BandJob *job = arg;
+    BMP band = *job->bmp;
+    unsigned int offset = index * job->band_rows;
+    band.pixels += (size_t)offset * band.stride;
+    band.rows = job->bmp->rows - offset < job->band_rows ? job->bmp->rows - offset : job->band_rows;
+    // в буфере строк сверху вниз полоса с начала буфера - верхняя
+    band.first_row += job->bmp->top_down ? job->bmp->rows - offset - band.rows : offset;
+    job->operation(&band, job->params);
+}
+
+// Выполняет операцию над строками буфера, разбивая их на полосы между потоками;
+// каждая полоса меняет только свои строки, поэтому результат не зависит от числа потоков
+void runOperation(ThreadPool *pool, BMP *bmp, BandOperation operation, void *params)
+{
+    if (pool == NULL || pool->count == 1 || bmp->rows < 2)
+    {
+        operation(bmp, params);
+        return;
+    }
+
+    // полос больше, чем потоков, чтобы уравнять нагрузку для локальных фигур
+    unsigned int bands = pool->count * 4;
+    BandJob job = {bmp, operation, params, (bmp->rows + bands - 1) / bands};
+    poolRun(pool, (bmp->rows + job.band_rows - 1) / job.band_rows, runBand, &job);
+}
@@ -0,0 +1,419 @@
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// Строки результата пишутся и уменьшаются полосами примерно такого размера на
+// поток, пока они в кэше; следующие уровни копят строки по PYRAMID_BAND_ROWS
+#define PYRAMID_BAND_BYTES (256u << 10)
+#define PYRAMID_BAND_ROWS 32
+#define PYRAMID_TASK_ROWS 8 // строк первого уровня на одну задачу пула
+
+// Ядра уменьшения: пиксель x строки dst - среднее квадрата 2x2 из пикселей
+// 2x и 2x+1 строк top и bottom, (a + b + c + d + 2) / 4 по каждому байту.
+// Векторные ядра считают столько пикселей, сколько помещается в их блоки,
+// и возвращают это число; остаток досчитывает скалярный цикл
+typedef int (*BoxKernel)(unsigned char *dst, const unsigned char *top, const unsigned char *bottom, int width);
+
+static inline unsigned char boxAverage(const unsigned char *top, const unsigned char *bottom, size_t a, size_t b)
+{
+    return (top[a] + top[b] + bottom[a] + bottom[b] + 2) >> 2;
+}
+
+#ifdef HAVE_X86_SIMD
+// (a + b + c + d + 2) / 4 по 16 байтам без расширения до 16 бит: x = avg(a, b),
+// y = avg(c, d) округляют вверх, и avg(x, y) больше точного значения на 1
+// ровно тогда, когда округлялись оба уровня - это младший бит поправки
+static inline __m128i quadAverage(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+    __m128i x = _mm_avg_epu8(a, b);
+    __m128i y = _mm_avg_epu8(c, d);
+    __m128i carry = _mm_and_si128(_mm_or_si128(_mm_xor_si128(a, b), _mm_xor_si128(c, d)), _mm_xor_si128(x, y));
+    return _mm_sub_epi8(_mm_avg_epu8(x, y), _mm_and_si128(carry, _mm_set1_epi8(1)));
+}
+
+// Средние байтов i и i + 3 (соседние пиксели BGR) двух строк для 16 байт
+static inline __m128i pairAverageBgr(const unsigned char *top, const unsigned char *bottom)
+{
+    return quadAverage(_mm_loadu_si128((const __m128i *)top), _mm_loadu_si128((const __m128i *)(top + 3)),
+                       _mm_loadu_si128((const __m128i *)bottom), _mm_loadu_si128((const __m128i *)(bottom + 3)));
+}
+
+// 48 байт = 16 пикселей BGR в 24 байта = 8 пикселей. Нужные средние лежат
+// в байтах 6k..6k+2 блока и собираются перестановками pshufb
+__attribute__((target("ssse3"))) static int boxBgrSsse3(unsigned char *dst, const unsigned char *top, const unsigned char *bottom, int width)
+{
+    const __m128i first0 = _mm_setr_epi8(0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i first1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 3, 4, 8, 9, 10, 14);
+    const __m128i second1 = _mm_setr_epi8(15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i second2 = _mm_setr_epi8(-1, 0, 4, 5, 6, 10, 11, 12, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    // последнее чтение заходит на 3 байта за 48-байтный блок: он должен лежать в строке
+    int x = 0;
+    for (; (x + 8) * 6 + 3 <= width * 6; x += 8)
+    {
+        const unsigned char *t = top + (size_t)x * 6;
+        const unsigned char *b = bottom + (size_t)x * 6;
+        __m128i v0 = pairAverageBgr(t, b);
+        __m128i v1 = pairAverageBgr(t + 16, b + 16);
+        __m128i v2 = pairAverageBgr(t + 32, b + 32);
+        __m128i out0 = _mm_or_si128(_mm_shuffle_epi8(v0, first0), _mm_shuffle_epi8(v1, first1));
+        __m128i out1 = _mm_or_si128(_mm_shuffle_epi8(v1, second1), _mm_shuffle_epi8(v2, second2));
+        _mm_storeu_si128((__m128i *)(dst + (size_t)x * 3), out0);
+        _mm_storel_epi64((__m128i *)(dst + (size_t)x * 3 + 16), out1);
+    }
+    return x;
+}
+#endif
+
+static BoxKernel box_bgr_kernel = NULL; // NULL - только скалярный цикл
+static pthread_once_t box_kernel_once = PTHREAD_ONCE_INIT;
+
+static void selectBoxKernel()
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        box_bgr_kernel = boxBgrSsse3;
+    }
+#endif
+}
+
+// 32 бита: 32 байта = 8 пикселей BGRA в 16 байт = 4 пикселя. Чётные и нечётные
+// пиксели раскладываются по двум векторам, и хватает SSE2
+static int boxBgra(unsigned char *dst, const unsigned char *top, const unsigned char *bottom, int width)
+{
+    int x = 0;
+#ifdef HAVE_X86_SIMD
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i t0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(top + (size_t)x * 8)), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i t1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(top + (size_t)x * 8 + 16)), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i b0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(bottom + (size_t)x * 8)), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i b1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(bottom + (size_t)x * 8 + 16)), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i average = quadAverage(_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+                                      _mm_unpacklo_epi64(b0, b1), _mm_unpackhi_epi64(b0, b1));
+        _mm_storeu_si128((__m128i *)(dst + (size_t)x * 4), average);
+    }
+#endif
+    return x;
+}
+
+typedef struct PyramidLevel
+{
+    BMP image;                    // заголовки и размеры уровня
+    FILE *file;
+    unsigned char *band;          // строки уровня в порядке файла, ждущие записи
+    unsigned int count;           // сколько строк в band
+    unsigned int received;        // сколько строк предыдущего уровня пришло
+    const unsigned char *pending; // первая строка пары, ждущая вторую
+} PyramidLevel;
+
+typedef struct Pyramid
+{
+    BMP *source;
+    PyramidLevel *levels;
+    int count;
+    uint64_t written;
+    int failed;
+} Pyramid;
+
+// Строка уровня - среднее квадратов 2x2 из строк top и bottom источника.
+// Ширина 1 усредняет столбец сам с собой
+static void shrinkRow(unsigned char *dst, const unsigned char *top, const unsigned char *bottom, const BMP *source, const BMP *level)
+{
+    unsigned int bytes = source->pixel_bytes;
+    int width = level->bmih.width;
+    int pairs = source->bmih.width >= 2; // у каждого пикселя уровня два столбца источника
+    int step = pairs ? bytes : 0;
+    size_t row_bytes = (size_t)width * bytes;
+    BoxKernel kernel = bytes == 4 ? boxBgra : box_bgr_kernel;
+
+    int x = pairs && kernel != NULL ? kernel(dst, top, bottom, width) : 0;
+    for (; x < width; x++)
+    {
+        size_t a = (size_t)x * 2 * bytes;
+        for (unsigned int c = 0; c < bytes; c++)
+        {
+            dst[(size_t)x * bytes + c] = boxAverage(top, bottom, a + c, a + step + c);
+        }
+    }
+    memset(dst + row_bytes, 0, level->stride - row_bytes);
+}
+
+static void flushLevel(Pyramid *pyramid, PyramidLevel *level)
+{
+    size_t bytes = level->image.stride * level->count;
+    if (fwrite(level->band, 1, bytes, level->file) != bytes)
+    {
+        pyramid->failed = 1;
+    }
+    pyramid->written += bytes;
+    level->count = 0;
+}
+
+// Передаёт очередную строку (в порядке файла) уровню index: строки 2y и 2y + 1
+// его источника дают строку y, она сразу уходит следующему уровню. Строка
+// без пары у нечётной высоты пропускается, у высоты 1 строка усредняется сама с собой
+static void feedRow(Pyramid *pyramid, int index, const unsigned char *row)
+{
+    PyramidLevel *level = &pyramid->levels[index];
+    const BMP *source = index == 0 ? pyramid->source : &pyramid->levels[index - 1].image;
+    unsigned int height = source->bmih.height;
+    unsigned int file_row = level->received++;
+    unsigned int y = source->top_down ? height - 1 - file_row : file_row;
+    if (y / 2 >= level->image.bmih.height)
+    {
+        return;
+    }
+    if (height > 1 && level->pending == NULL)
+    {
+        level->pending = row;
+        return;
+    }
+
+    // первая строка пары лежит в полосе предыдущего уровня и не затирается
+    // до прихода второй: полоса сбрасывается только заполненной целиком
+    unsigned char *dst = level->band + level->image.stride * level->count;
+    shrinkRow(dst, level->pending != NULL ? level->pending : row, row, source, &level->image);
+    level->pending = NULL;
+    level->count++;
+    if (index + 1 < pyramid->count)
+    {
+        feedRow(pyramid, index + 1, dst);
+    }
+    if (level->count == PYRAMID_BAND_ROWS)
+    {
+        flushLevel(pyramid, level);
+    }
+}
+
+// Первый уровень строится из полосы результата на пуле: строка j уровня в
+// порядке файла - среднее строк skip + 2j и skip + 2j + 1 файла результата
+typedef struct PyramidJob
+{
+    BMP *source;
+    PyramidLevel *level;
+    unsigned int first; // номер первой строки полосы уровня в порядке файла
+    unsigned int skip;  // строка без пары в начале файла (нечётная высота сверху вниз)
+    unsigned int rows;
+} PyramidJob;
+
+static void shrinkBand(void *arg, int index)
+{
+    PyramidJob *job = arg;
+    BMP *source = job->source;
+    PyramidLevel *level = job->level;
+    unsigned int begin = index * PYRAMID_TASK_ROWS;
+    unsigned int end = begin + PYRAMID_TASK_ROWS < job->rows ? begin + PYRAMID_TASK_ROWS : job->rows;
+    for (unsigned int j = begin; j < end; j++)
+    {
+        size_t top = job->skip + 2 * (size_t)(job->first + j);
+        size_t bottom = source->bmih.height > 1 ? top + 1 : top;
+        shrinkRow(level->band + level->image.stride * j, source->pixels + source->stride * top,
+                  source->pixels + source->stride * bottom, source, &level->image);
+    }
+}
+
+// Имя уровня: output.bmp -> output_1.bmp; без расширения номер дописывается в конец
+static void levelPath(char *filename, int number, char *path, size_t size)
+{
+    char *slash = strrchr(filename, '/');
+    char *dot = strrchr(filename, '.');
+    if (dot == NULL || (slash != NULL && dot < slash))
+    {
+        snprintf(path, size, "%s_%d", filename, number);
+        return;
+    }
+    snprintf(path, size, "%.*s_%d%s", (int)(dot - filename), filename, number, dot);
+}
+
+// Пишет результат, лежащий в буфере целиком, и его уменьшенные вдвое копии
+// filename_1.bmp, filename_2.bmp и т.д., пока большая сторона следующего уровня
+// не меньше min_size, за один проход: каждая полоса строк результата пишется
+// и, пока она в кэше, уменьшается в строки первого уровня на пуле, а те по
+// строке - в строки следующих. Без write_result (--inplace) пишутся только
+// уровни. Уровни в том же формате, что и источник (заголовок и порядок строк)
+int writePyramid(BMP *bmp, char *filename, int write_result, unsigned int min_size, ThreadPool *pool)
+{
+    pthread_once(&box_kernel_once, selectBoxKernel);
+    STATS_TIME(start);
+
+    // полосы идут в порядке файла, он же порядок строк в буфере; на пуле
+    // каждый поток получает свою часть полосы
+    int threads = pool != NULL && pool->count > 1 ? pool->count : 1;
+    unsigned int band_rows = bmp->stride > 0 ? PYRAMID_BAND_BYTES * threads / bmp->stride : 0;
+    band_rows = band_rows > 2 ? band_rows & ~1u : 2;
+
+    int count = 0;
+    unsigned int width = bmp->bmih.width;
+    unsigned int height = bmp->bmih.height;
+    PyramidLevel *levels = NULL;
+    Pyramid pyramid = {bmp, NULL, 0, 0, 0};
+    int code = 0;
+    size_t offset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + bmp->header_extra_size;
+    while (code == 0 && (width > 1 || height > 1))
+    {
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        if ((width > height ? width : height) < min_size)
+        {
+            break;
+        }
+        PyramidLevel *grown = realloc(levels, sizeof(PyramidLevel) * (count + 1));
+        if (grown == NULL)
+        {
+            code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+            break;
+        }
+        levels = grown;
+        PyramidLevel *level = &levels[count++];
+        memset(level, 0, sizeof(*level));
+        level->image = *bmp;
+        level->image.buffer = NULL;
+        level->image.capacity = 0;
+        level->image.map = NULL;
+        level->image.first_row = 0;
+        level->image.bmih.width = width;
+        level->image.bmih.height = height;
+        level->image.stride = rowStride(width, bmp->pixel_bytes);
+        level->image.bmih.imageSize = level->image.stride * height;
+        level->image.bmfh.pixelArrOffset = offset;
+        level->image.bmfh.filesize = offset + level->image.stride * height;
+        // у первого уровня две половины по полосе результата: строка, ждущая
+        // пару на втором уровне, остаётся целой, пока строится следующая полоса
+        level->image.rows = count == 1 ? 2 * (band_rows / 2 + 1) : PYRAMID_BAND_ROWS;
+        code = allocPixels(&level->image, level->image.rows);
+        level->band = level->image.pixels;
+    }
+    pyramid.levels = levels;
+    pyramid.count = count;
+    STATS_ELAPSED(pyramid_ns, start);
+
+    STATS_TIME(save_start);
+    FILE *ff = NULL;
+    if (code == 0 && write_result)
+    {
+        ff = fopen(filename, "wb");
+        if (ff == NULL)
+        {
+            code = setError(FILE_WRITE_ERROR, "Error: file writing error");
+        }
+        else
+        {
+            writeHeaders(ff, bmp);
+        }
+    }
+    STATS_ELAPSED(save_ns, save_start);
+
+    STATS_TIME(open_start);
+    for (int i = 0; code == 0 && i < count; i++)
+    {
+        char path[PATH_MAX];
+        levelPath(filename, i + 1, path, sizeof(path));
+        levels[i].file = fopen(path, "wb");
+        if (levels[i].file == NULL)
+        {
+            code = setError(FILE_WRITE_ERROR, "Error: file writing error");
+            break;
+        }
+        writeHeaders(levels[i].file, &levels[i].image);
+    }
+    STATS_ELAPSED(pyramid_ns, open_start);
+
+    PyramidJob job = {bmp, count > 0 ? &levels[0] : NULL, 0, 0, 0};
+    // у нечётной высоты строка без пары - верхняя, в файле «сверху вниз» она первая
+    job.skip = bmp->top_down && bmp->bmih.height > 1 ? bmp->bmih.height % 2 : 0;
+    int half = 0;
+    for (unsigned int first = 0; code == 0 && first < bmp->bmih.height; first += band_rows)
+    {
+        unsigned int rows = bmp->bmih.height - first < band_rows ? bmp->bmih.height - first : band_rows;
+        if (ff != NULL)
+        {
+            STATS_TIME(write_start);
+            fwrite(bmp->pixels + bmp->stride * first, 1, bmp->stride * rows, ff); // выравнивание уже лежит в буфере нулями
+            STATS_ELAPSED(save_ns, write_start);
+        }
+        if (count == 0)
+        {
+            continue;
+        }
+
+        // строки первого уровня, у которых обе строки результата уже записаны
+        STATS_TIME(shrink_start);
+        PyramidLevel *level = &levels[0];
+        unsigned int ready = bmp->bmih.height == 1 ? 1 : (first + rows > job.skip ? (first + rows - job.skip) / 2 : 0);
+        ready = ready < level->image.bmih.height ? ready : level->image.bmih.height;
+        job.rows = ready - job.first;
+        if (job.rows > 0)
+        {
+            level->band = level->image.pixels + level->image.stride * (level->image.rows / 2) * half;
+            half = !half;
+            int tasks = (job.rows + PYRAMID_TASK_ROWS - 1) / PYRAMID_TASK_ROWS;
+            if (threads > 1 && tasks > 1)
+            {
+                poolRun(pool, tasks, shrinkBand, &job);
+            }
+            else
+            {
+                for (int i = 0; i < tasks; i++)
+                {
+                    shrinkBand(&job, i);
+                }
+            }
+            for (unsigned int j = 0; count > 1 && j < job.rows; j++)
+            {
+                feedRow(&pyramid, 1, level->band + level->image.stride * j);
+            }
+            level->count = job.rows;
+            flushLevel(&pyramid, level);
+            job.first = ready;
+        }
+        STATS_ELAPSED(pyramid_ns, shrink_start);
+    }
+
+    if (ff != NULL)
+    {
+        STATS_TIME(close_start);
+        if (fclose(ff) != 0 && code == 0)
+        {
+            code = setError(FILE_WRITE_ERROR, "Error: file writing error");
+        }
+        STATS_ADD(bytes_written, bmp->stride * bmp->bmih.height);
+        STATS_ELAPSED(save_ns, close_start);
+    }
+
+    STATS_TIME(finish_start);
+    for (int i = 0; i < count; i++)
+    {
+        if (levels[i].file != NULL)
+        {
+            if (code == 0 && levels[i].count > 0)
+            {
+                flushLevel(&pyramid, &levels[i]);
+            }
+            if (fclose(levels[i].file) != 0)
+            {
+                pyramid.failed = 1;
+            }
+        }
+        if (levels[i].image.buffer != NULL)
+        {
+            levels[i].image.allocator->free(levels[i].image.buffer, levels[i].image.allocator->user);
+        }
+    }
+    free(levels);
+    if (code == 0 && pyramid.failed)
+    {
+        code = setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    STATS_ADD(bytes_written, pyramid.written);
+    STATS_ELAPSED(pyramid_ns, finish_start);
+    return code;
+}
@@ -0,0 +1,422 @@
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Сжатие RLE: пары байт «счётчик, значение» - серия одинаковых пикселей,
+// «0, 0» - конец строки, «0, 1» - конец изображения, «0, 2, dx, dy» - пропуск,
+// «0, n» (n >= 3) - n пикселей как есть с выравниванием до двух байт.
+// У BI_RLE8 и BI_RLE4 значения - номера цветов палитры (у RLE4 - по два в байте),
+// у BI_RLE24 - сами пиксели BGR. Строки всегда идут снизу вверх.
+// Пиксели, перепрыгнутые пропуском или концом строки, и строки после конца
+// данных распаковываются чёрными (нулями), а не цветом 0 палитры
+#define RLE_INPUT_BUFFER (1u << 16)
+
+struct RleCodec
+{
+    unsigned int bits;       // 4, 8 или 24 бит на значение в файле
+    unsigned int x;          // позиция распаковки: столбец
+    unsigned int y;          // и строка (номер снизу вверх)
+    unsigned int next_row;   // первая строка следующей полосы
+    size_t filled;           // байты строки y, которые уже записаны или обнулены
+    int done;                // встретился конец изображения или конец файла
+    size_t length;           // байт в input
+    size_t position;         // прочитано из input
+    unsigned char palette[256][3];
+    unsigned char input[RLE_INPUT_BUFFER];
+};
+
+// Заполняет size байт повторениями образца из pattern_size байт: образец
+// пишется один раз, затем уже заполненная часть копируется, удваиваясь
+static void fillPattern(unsigned char *dst, const unsigned char *pattern, size_t pattern_size, size_t size)
+{
+    size_t filled = pattern_size < size ? pattern_size : size;
+    memcpy(dst, pattern, filled);
+    while (filled < size)
+    {
+        size_t chunk = filled < size - filled ? filled : size - filled;
+        memcpy(dst + filled, dst, chunk);
+        filled += chunk;
+    }
+}
+
+static int nextByte(RleCodec *codec, FILE *f)
+{
+    if (codec->position == codec->length)
+    {
+        codec->length = fread(codec->input, 1, sizeof(codec->input), f);
+        codec->position = 0;
+        STATS_ADD(bytes_read, codec->length);
+        if (codec->length == 0)
+        {
+            return -1;
+        }
+    }
+    return codec->input[codec->position++];
+}
+
+// Принимает заголовки файла BI_RLE8/BI_RLE4/BI_RLE24 и переделывает их в
+// заголовки несжатого 24-битного изображения, в которое файл распаковывается;
+// палитра переходит в состояние распаковки и из заголовков убирается
+int openRle(BMP *bmp)
+{
+    RleCodec *codec = calloc(1, sizeof(RleCodec));
+    if (codec == NULL)
+    {
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    codec->bits = bmp->bmih.bitsPerPixel;
+    if (codec->bits != 24)
+    {
+        // палитра лежит сразу за заголовком, 4 байта на цвет (B, G, R, 0)
+        size_t table = bmp->bmih.headerSize - sizeof(BitmapInfoHeader);
+        size_t limit = 1u << codec->bits;
+        size_t colors = bmp->bmih.colorsInColorTable ? bmp->bmih.colorsInColorTable : limit;
+        colors = colors < limit ? colors : limit;
+        if (bmp->header_extra_size < table + colors * 4)
+        {
+            free(codec);
+            return setError(FILE_READ_ERROR, "Error: unsupported file format");
+        }
+        for (size_t i = 0; i < colors; i++)
+        {
+            memcpy(codec->palette[i], bmp->header_extra + table + i * 4, 3);
+        }
+        bmp->header_extra_size = table;
+        bmp->bmfh.pixelArrOffset = sizeof(BitmapFileHeader) + bmp->bmih.headerSize;
+    }
+    bmp->rle = codec;
+    bmp->bmih.bitsPerPixel = 24;
+    bmp->bmih.compression = BI_RGB;
+    bmp->bmih.colorsInColorTable = 0;
+    bmp->bmih.importantColorCount = 0;
+    size_t stride = rowStride(bmp->bmih.width, sizeof(Rgb));
+    bmp->bmih.imageSize = stride * bmp->bmih.height;
+    bmp->bmfh.filesize = bmp->bmfh.pixelArrOffset + bmp->bmih.imageSize;
+    return 0;
+}
+
+// Пишет в dst первые count значений из src (номера палитры или пиксели BGR)
+static void putLiteral(RleCodec *codec, unsigned char *dst, unsigned int count, const unsigned char *src)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        const unsigned char *value;
+        if (codec->bits == 24)
+        {
+            value = src + i * 3;
+        }
+        else if (codec->bits == 8)
+        {
+            value = codec->palette[src[i]];
+        }
+        else
+        {
+            value = codec->palette[i % 2 ? src[i / 2] & 0x0f : src[i / 2] >> 4];
+        }
+        memcpy(dst + (size_t)i * 3, value, 3);
+    }
+}
+
+// Обнуляет строки [y, to), попавшие в полосу [begin, end); у строки y - начиная с байта filled
+static void clearRows(BMP *bmp, unsigned int begin, unsigned int end, unsigned int y, size_t filled, unsigned int to)
+{
+    for (unsigned int row = y > begin ? y : begin; row < to && row < end; row++)
+    {
+        size_t from = row == y ? filled : 0;
+        memset(bmp->pixels + (size_t)(row - begin) * bmp->stride + from, 0, bmp->stride - from);
+    }
+}
+
+// Готовит запись с пикселя x строки: пропущенные байты перед ним обнуляются
+static unsigned char *seekPixel(RleCodec *codec, unsigned char *row, unsigned int x)
+{
+    if ((size_t)x * 3 > codec->filled)
+    {
+        memset(row + codec->filled, 0, (size_t)x * 3 - codec->filled);
+    }
+    return row + (size_t)x * 3;
+}
+
+// Распаковывает следующие rows строк файла в буфер: серии одного цвета
+// заполняются блоками, нулями обнуляются только пропуски, выравнивание и
+// строки после конца данных, так что каждый байт буфера пишется один раз
+void readRleRows(FILE *f, BMP *bmp, unsigned int rows)
+{
+    RleCodec *codec = bmp->rle;
+    unsigned int width = bmp->bmih.width;
+    unsigned int band_begin = codec->next_row;
+    unsigned int band_end = band_begin + rows;
+    unsigned char literal[255 * 3];
+    codec->next_row = band_end;
+    bmp->rows = rows;
+    if (codec->done)
+    {
+        memset(bmp->pixels, 0, bmp->stride * rows);
+        return;
+    }
+    // строки, перепрыгнутые пропуском из прошлой полосы
+    clearRows(bmp, band_begin, band_end, band_begin, 0, codec->y);
+
+    while (!codec->done && codec->y < band_end)
+    {
+        int count = nextByte(codec, f);
+        int value = count < 0 ? -1 : nextByte(codec, f);
+        if (value < 0)
+        {
+            codec->done = 1;
+            break;
+        }
+        unsigned int length = count > 0 ? count : value;
+        unsigned int end = codec->x + length < width ? codec->x + length : width;
+        unsigned char *row = bmp->pixels + (size_t)(codec->y - band_begin) * bmp->stride;
+        if (count > 0)
+        {
+            unsigned char pattern[6];
+            size_t pattern_size = 3;
+            if (codec->bits == 24)
+            {
+                pattern[0] = value;
+                for (int i = 1; i < 3; i++)
+                {
+                    int next = nextByte(codec, f);
+                    pattern[i] = next < 0 ? 0 : next;
+                }
+            }
+            else if (codec->bits == 8)
+            {
+                memcpy(pattern, codec->palette[value], 3);
+            }
+            else
+            {
+                // у RLE4 серия чередует два цвета; одинаковые дают обычную заливку
+                memcpy(pattern, codec->palette[value >> 4], 3);
+                memcpy(pattern + 3, codec->palette[value & 0x0f], 3);
+                pattern_size = memcmp(pattern, pattern + 3, 3) == 0 ? 3 : 6;
+            }
+            if (end > codec->x)
+            {
+                fillPattern(seekPixel(codec, row, codec->x), pattern, pattern_size, (size_t)(end - codec->x) * 3);
+                codec->filled = (size_t)end * 3;
+            }
+            codec->x += count;
+        }
+        else if (value == 0)
+        {
+            clearRows(bmp, band_begin, band_end, codec->y, codec->filled, codec->y + 1);
+            codec->x = 0;
+            codec->y++;
+            codec->filled = 0;
+        }
+        else if (value == 1)
+        {
+            codec->done = 1;
+        }
+        else if (value == 2)
+        {
+            int dx = nextByte(codec, f);
+            int dy = dx < 0 ? -1 : nextByte(codec, f);
+            if (dy < 0)
+            {
+                codec->done = 1;
+                break;
+            }
+            if (dy > 0)
+            {
+                clearRows(bmp, band_begin, band_end, codec->y, codec->filled, codec->y + dy);
+                codec->filled = 0;
+            }
+            codec->x += dx;
+            codec->y += dy;
+            codec->done = codec->y >= bmp->bmih.height;
+        }
+        else
+        {
+            // value значений как есть; данные выровнены до двух байт
+            size_t bytes = codec->bits == 24 ? (size_t)value * 3 : codec->bits == 8 ? (size_t)value : ((size_t)value + 1) / 2;
+            size_t got = 0;
+            for (; got < bytes + bytes % 2; got++)
+            {
+                int next = nextByte(codec, f);
+                if (next < 0)
+                {
+                    codec->done = 1;
+                    break;
+                }
+                if (got < bytes)
+                {
+                    literal[got] = next;
+                }
+            }
+            if (end > codec->x)
+            {
+                memset(literal + (got < bytes ? got : bytes), 0, bytes - (got < bytes ? got : bytes));
+                putLiteral(codec, seekPixel(codec, row, codec->x), end - codec->x, literal);
+                codec->filled = (size_t)end * 3;
+            }
+            codec->x += value;
+        }
+    }
+    if (codec->done)
+    {
+        // конец данных: остаток полосы - нули
+        clearRows(bmp, band_begin, band_end, codec->y, codec->filled, band_end);
+    }
+}
+
+// Сколько пикселей подряд с позиции x совпадают с пикселем x (не больше limit):
+// пиксели равны, если каждый байт равен байту через три, это сравнивается по 8 байт
+static unsigned int runLength(const unsigned char *row, unsigned int x, unsigned int width, unsigned int limit)
+{
+    size_t begin = (size_t)x * 3;
+    size_t end = (size_t)(x + limit < width ? x + limit : width) * 3 - 3;
+    size_t k = begin;
+    for (; k + 8 <= end; k += 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, row + k, 8);
+        memcpy(&b, row + k + 3, 8);
+        if (a != b)
+        {
+            k += __builtin_ctzll(a ^ b) / 8;
+            return (k - begin) / 3 + 1;
+        }
+    }
+    while (k < end && row[k] == row[k + 3])
+    {
+        k++;
+    }
+    return (k - begin) / 3 + 1;
+}
+
+// Сжимает строку из width пикселей BGR в out; возвращает число байт без маркера конца строки.
+// Серии от двух пикселей пишутся парой «счётчик, пиксель», остальное - блоками как есть
+static size_t encodeRow(const unsigned char *row, unsigned int width, unsigned char *out)
+{
+    size_t size = 0;
+    unsigned int x = 0;
+    while (x < width)
+    {
+        unsigned int run = runLength(row, x, width, 255);
+        if (run >= 2)
+        {
+            out[size++] = run;
+            memcpy(out + size, row + (size_t)x * 3, 3);
+            size += 3;
+            x += run;
+            continue;
+        }
+        // пиксели без повторов собираются до начала следующей серии
+        unsigned int end = x + 1;
+        while (end < width && end - x < 255 && runLength(row, end, width, 2) < 2)
+        {
+            end++;
+        }
+        unsigned int count = end - x;
+        if (count >= 3)
+        {
+            out[size++] = 0;
+            out[size++] = count;
+            memcpy(out + size, row + (size_t)x * 3, (size_t)count * 3);
+            size += (size_t)count * 3;
+            if (count % 2)
+            {
+                out[size++] = 0;
+            }
+        }
+        else
+        {
+            // блок короче трёх пикселей нельзя записать как есть: «0, 1» и «0, 2» заняты
+            for (unsigned int i = 0; i < count; i++)
+            {
+                out[size++] = 1;
+                memcpy(out + size, row + (size_t)(x + i) * 3, 3);
+                size += 3;
+            }
+        }
+        x = end;
+    }
+    return size;
+}
+
+// Заголовки сжатого файла: высота всегда положительная (строки RLE идут снизу вверх),
+// размеры файла и данных дописывает finishRle
+void writeRleHeaders(FILE *f, BMP *bmp)
+{
+    BitmapInfoHeader header = bmp->bmih;
+    header.compression = BI_RLE24;
+    fwrite(&bmp->bmfh, sizeof(BitmapFileHeader), 1, f);
+    fwrite(&header, sizeof(BitmapInfoHeader), 1, f);
+    if (bmp->header_extra_size > 0)
+    {
+        fwrite(bmp->header_extra, 1, bmp->header_extra_size, f);
+    }
+    STATS_ADD(bytes_written, sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + bmp->header_extra_size);
+}
+
+// Сжимает строки буфера [bandBegin, bandEnd) снизу вверх и дописывает их в f;
+// после последней строки изображения ставится конец изображения.
+// *written увеличивается на число записанных байт
+int writeRleRows(FILE *f, BMP *bmp, size_t *written)
+{
+    unsigned int width = bmp->bmih.width;
+    // худший случай - серии по одному пикселю, 4 байта на пиксель
+    unsigned char *out = malloc((size_t)width * 4 + 4);
+    if (out == NULL)
+    {
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    size_t total = 0;
+    for (int y = bandBegin(bmp); y < bandEnd(bmp); y++)
+    {
+        size_t size = encodeRow((const unsigned char *)getRow(bmp, y), width, out);
+        out[size++] = 0;
+        out[size++] = (unsigned int)y + 1 == bmp->bmih.height ? 1 : 0;
+        fwrite(out, 1, size, f);
+        total += size;
+    }
+    free(out);
+    *written += total;
+    STATS_ADD(bytes_written, total);
+    return 0;
+}
+
+// Дописывает в заголовки размеры, известные только после сжатия
+int finishRle(FILE *f, BMP *bmp, size_t written)
+{
+    unsigned int data_size = written;
+    unsigned int file_size = bmp->bmfh.pixelArrOffset + written;
+    if (fflush(f) != 0 ||
+        pwrite(fileno(f), &file_size, sizeof(file_size), offsetof(BitmapFileHeader, filesize)) != sizeof(file_size) ||
+        pwrite(fileno(f), &data_size, sizeof(data_size), sizeof(BitmapFileHeader) + offsetof(BitmapInfoHeader, imageSize)) !=
+            sizeof(data_size))
+    {
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    return 0;
+}
+
+// Записывает всё изображение со сжатием BI_RLE24
+int writeRleBMP(char *filename, BMP *bmp)
+{
+    STATS_TIME(start);
+    FILE *ff = fopen(filename, "wb");
+    if (!ff)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    writeRleHeaders(ff, bmp);
+    size_t written = 0;
+    int code = writeRleRows(ff, bmp, &written);
+    if (code == 0)
+    {
+        code = finishRle(ff, bmp, written);
+    }
+    if (fclose(ff) != 0 && code == 0)
+    {
+        code = setError(FILE_WRITE_ERROR, "Error: file writing error");
+    }
+    STATS_ELAPSED(save_ns, start);
+    return code;
+}
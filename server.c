@@ -0,0 +1,648 @@
+// memfd_create
+#define _GNU_SOURCE
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Наибольший размер одного запроса и число аргументов в нём
+#define SERVER_REQUEST_MAX (64 * 1024)
+#define SERVER_ARGS_MAX 256
+// Память под изображения, если --server-memory не задан
+#define SERVER_DEFAULT_MEMORY ((size_t)512 << 20)
+// Как часто ожидающие потоки проверяют, не пора ли остановиться (мс)
+#define SERVER_POLL_MS 200
+
+// Прочитанное изображение: заголовки в image, пиксели в анонимном файле fd.
+// Каждый запрос отображает его с MAP_PRIVATE, так что копируются только
+// страницы, которые меняют операции, а общий образ остаётся нетронутым
+typedef struct CachedImage
+{
+    char *path;
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    off_t file_size;
+    BMP image;
+    int fd;
+    size_t size;       // байт пикселей
+    int refs;          // запросы, которые сейчас используют образ
+    int cached;        // лежит в списке кэша
+    unsigned long last_used;
+    struct CachedImage *next;
+} CachedImage;
+
+typedef struct Server
+{
+    int listen_fd;
+    ServerParse parse;
+    size_t memory_limit;
+    size_t memory_used;
+    CachedImage *images;
+    unsigned long clock;
+    unsigned long requests;
+    unsigned long hits;
+    unsigned long misses;
+    pthread_mutex_t lock;       // кэш и счётчики
+    pthread_mutex_t parse_lock; // разбор опций через getopt не потокобезопасен
+} Server;
+
+static volatile sig_atomic_t server_stop;
+
+static void stopServer(int signal_number)
+{
+    (void)signal_number;
+    server_stop = 1;
+}
+
+static void freeImage(CachedImage *entry)
+{
+    close(entry->fd);
+    freeBMP(&entry->image);
+    free(entry->path);
+    free(entry);
+}
+
+// Читает изображение в анонимный файл в памяти
+static int loadImage(char *path, struct stat *st, CachedImage **result)
+{
+    CachedImage *entry = (CachedImage *)calloc(1, sizeof(CachedImage));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL)
+    {
+        free(entry);
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    entry->fd = -1;
+    initBMP(&entry->image, NULL);
+    FILE *f;
+    int code = openBMP(path, &entry->image, &f);
+    if (code != 0)
+    {
+        freeImage(entry);
+        return code;
+    }
+
+    entry->size = entry->image.stride * entry->image.bmih.height;
+    size_t length = entry->size ? entry->size : 1;
+    entry->fd = memfd_create("cw-image", MFD_CLOEXEC);
+    void *pixels = MAP_FAILED;
+    if (entry->fd >= 0 && ftruncate(entry->fd, length) == 0)
+    {
+        pixels = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, entry->fd, 0);
+    }
+    if (pixels == MAP_FAILED)
+    {
+        fclose(f);
+        freeImage(entry);
+        return setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    entry->image.pixels = pixels;
+    readRows(f, &entry->image, entry->image.bmih.height);
+    fclose(f);
+    munmap(pixels, length);
+    entry->image.pixels = NULL;
+
+    entry->device = st->st_dev;
+    entry->inode = st->st_ino;
+    entry->mtime = st->st_mtim;
+    entry->file_size = st->st_size;
+    *result = entry;
+    return 0;
+}
+
+static int isSameVersion(CachedImage *entry, struct stat *st)
+{
+    return entry->device == st->st_dev && entry->inode == st->st_ino && entry->file_size == st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Убирает запись из списка; память освобождается, когда её отпустит последний запрос
+static void uncacheImage(Server *server, CachedImage **link)
+{
+    CachedImage *entry = *link;
+    *link = entry->next;
+    entry->cached = 0;
+    server->memory_used -= entry->size;
+    if (entry->refs == 0)
+    {
+        freeImage(entry);
+    }
+}
+
+// Вытесняет давно не использованные образы, пока не освободится size байт
+static void makeRoom(Server *server, size_t size)
+{
+    while (server->memory_used + size > server->memory_limit)
+    {
+        CachedImage **oldest = NULL;
+        for (CachedImage **link = &server->images; *link != NULL; link = &(*link)->next)
+        {
+            if ((*link)->refs == 0 && (oldest == NULL || (*link)->last_used < (*oldest)->last_used))
+            {
+                oldest = link;
+            }
+        }
+        if (oldest == NULL)
+        {
+            return;
+        }
+        uncacheImage(server, oldest);
+    }
+}
+
+// Находит образ файла в кэше или читает его; файл, изменившийся с момента
+// чтения, читается заново
+static int acquireImage(Server *server, char *path, CachedImage **result)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return setError(FILE_READ_ERROR, "Error: file reading error");
+    }
+
+    pthread_mutex_lock(&server->lock);
+    for (CachedImage **link = &server->images; *link != NULL; link = &(*link)->next)
+    {
+        if (strcmp((*link)->path, path) != 0)
+        {
+            continue;
+        }
+        if (isSameVersion(*link, &st))
+        {
+            CachedImage *entry = *link;
+            entry->refs++;
+            entry->last_used = ++server->clock;
+            server->hits++;
+            pthread_mutex_unlock(&server->lock);
+            *result = entry;
+            return 0;
+        }
+        uncacheImage(server, link);
+        break;
+    }
+    server->misses++;
+    pthread_mutex_unlock(&server->lock);
+
+    // изображение читается без блокировки; если параллельный запрос успел
+    // положить тот же файл, остаётся только одна копия
+    CachedImage *entry = NULL;
+    int code = loadImage(path, &st, &entry);
+    if (code != 0)
+    {
+        return code;
+    }
+    entry->refs = 1;
+    pthread_mutex_lock(&server->lock);
+    for (CachedImage *other = server->images; other != NULL; other = other->next)
+    {
+        if (strcmp(other->path, path) == 0 && isSameVersion(other, &st))
+        {
+            other->refs++;
+            other->last_used = ++server->clock;
+            pthread_mutex_unlock(&server->lock);
+            freeImage(entry);
+            *result = other;
+            return 0;
+        }
+    }
+    entry->last_used = ++server->clock;
+    makeRoom(server, entry->size);
+    if (server->memory_used + entry->size <= server->memory_limit)
+    {
+        entry->cached = 1;
+        entry->next = server->images;
+        server->images = entry;
+        server->memory_used += entry->size;
+    }
+    pthread_mutex_unlock(&server->lock);
+    *result = entry;
+    return 0;
+}
+
+static void releaseImage(Server *server, CachedImage *entry)
+{
+    pthread_mutex_lock(&server->lock);
+    if (--entry->refs == 0 && !entry->cached)
+    {
+        freeImage(entry);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Относительные пути запроса отсчитываются от каталога клиента
+static char *resolvePath(char *cwd, char *path)
+{
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    char *resolved = (char *)malloc(strlen(cwd) + strlen(path) + 2);
+    if (resolved != NULL)
+    {
+        if (path[0] == '/')
+        {
+            strcpy(resolved, path);
+        }
+        else
+        {
+            sprintf(resolved, "%s/%s", cwd, path);
+        }
+    }
+    return resolved;
+}
+
+// Применяет операции к копии образа из кэша и записывает результат
+static int processRequest(Server *server, ServerRequest *request)
+{
+    CachedImage *entry = NULL;
+    int code = acquireImage(server, request->input_file, &entry);
+    if (code != 0)
+    {
+        return code;
+    }
+
+    BMP work = entry->image;
+    size_t length = entry->size ? entry->size : 1;
+    void *pixels = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, entry->fd, 0);
+    Operation *ops = (Operation *)malloc(sizeof(Operation) * (request->op_count ? request->op_count : 1));
+    if (pixels == MAP_FAILED || ops == NULL)
+    {
+        code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+    }
+    if (code == 0 && request->op_count == 0)
+    {
+        code = setError(OPTION_ERROR, "Error: no option selected");
+    }
+    int built = 0;
+    if (code == 0)
+    {
+        work.pixels = pixels;
+        work.buffer = NULL;
+        work.capacity = 0;
+        work.map = NULL;
+        work.first_row = 0;
+        work.rows = work.bmih.height;
+        code = buildOperations(&work, request->ops, request->op_count, ops, &built);
+    }
+    if (code == 0)
+    {
+        // запросы и так идут параллельно, поэтому каждый выполняется в своём потоке
+        OperationList list = {ops, request->op_count, NULL};
+        applyOperations(&work, &list);
+        code = writeBMP(request->output_file, &work);
+    }
+
+    for (int i = 0; i < built; i++)
+    {
+        freeOperation(&ops[i]);
+    }
+    free(ops);
+    if (pixels != MAP_FAILED)
+    {
+        munmap(pixels, length);
+    }
+    releaseImage(server, entry);
+    return code;
+}
+
+// Выполняет один запрос: strings - count строк, первая из них каталог клиента
+static void handleRequest(Server *server, char **strings, int count, char *reply, size_t size)
+{
+    char *argv[SERVER_ARGS_MAX + 1];
+    argv[0] = "cw";
+    for (int i = 1; i < count; i++)
+    {
+        argv[i] = strings[i];
+    }
+    argv[count] = NULL;
+
+    ServerRequest request;
+    memset(&request, 0, sizeof(request));
+    pthread_mutex_lock(&server->parse_lock);
+    int code = count > 1 ? server->parse(count, argv, &request) : setError(OPTION_ERROR, "Error: no option selected");
+    pthread_mutex_unlock(&server->parse_lock);
+
+    char *input = NULL;
+    char *output = NULL;
+    char **circles = NULL;
+    if (code == 0 && request.stats)
+    {
+        pthread_mutex_lock(&server->lock);
+        int images = 0;
+        for (CachedImage *entry = server->images; entry != NULL; entry = entry->next)
+        {
+            images++;
+        }
+        snprintf(reply, size, "0 requests=%lu hits=%lu misses=%lu images=%d memory=%zu", server->requests, server->hits,
+                 server->misses, images, server->memory_used);
+        pthread_mutex_unlock(&server->lock);
+    }
+    else if (code == 0)
+    {
+        input = resolvePath(strings[0], request.input_file);
+        output = resolvePath(strings[0], request.output_file);
+        circles = (char **)calloc(request.op_count ? request.op_count : 1, sizeof(char *));
+        if (input == NULL || output == NULL || circles == NULL)
+        {
+            code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+        }
+        for (int i = 0; code == 0 && i < request.op_count; i++)
+        {
+            if (request.ops[i].circles_file != NULL)
+            {
+                circles[i] = resolvePath(strings[0], request.ops[i].circles_file);
+                request.ops[i].circles_file = circles[i];
+            }
+        }
+        if (code == 0)
+        {
+            request.input_file = input;
+            request.output_file = output;
+            code = processRequest(server, &request);
+        }
+    }
+    if (code != 0 || !request.stats)
+    {
+        snprintf(reply, size, "%d %s", code, code ? lastError() : "OK");
+    }
+
+    pthread_mutex_lock(&server->lock);
+    server->requests++;
+    pthread_mutex_unlock(&server->lock);
+    for (int i = 0; circles != NULL && i < request.op_count; i++)
+    {
+        free(circles[i]);
+    }
+    free(circles);
+    free(input);
+    free(output);
+    free(request.ops);
+    for (int i = 0; i < request.spec_count; i++)
+    {
+        free(request.specs[i]);
+    }
+    free(request.specs);
+}
+
+static int writeAll(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+// Обслуживает одного клиента, пока он не закроет соединение: запросы можно
+// присылать подряд, ответы приходят в том же порядке
+static void serveClient(Server *server, int fd)
+{
+    char *buffer = (char *)malloc(SERVER_REQUEST_MAX);
+    size_t used = 0;
+    while (buffer != NULL && !server_stop)
+    {
+        // конец запроса - пустая строка, то есть два нуля подряд
+        char *end = NULL;
+        for (size_t i = 1; i < used; i++)
+        {
+            if (buffer[i] == '\0' && buffer[i - 1] == '\0')
+            {
+                end = buffer + i;
+                break;
+            }
+        }
+        if (end == NULL)
+        {
+            if (used == SERVER_REQUEST_MAX)
+            {
+                const char *message = "42 Error: request is too long\n";
+                writeAll(fd, message, strlen(message));
+                break;
+            }
+            struct pollfd p = {fd, POLLIN, 0};
+            if (poll(&p, 1, SERVER_POLL_MS) <= 0)
+            {
+                continue;
+            }
+            ssize_t got = read(fd, buffer + used, SERVER_REQUEST_MAX - used);
+            if (got <= 0)
+            {
+                if (got < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            used += got;
+            continue;
+        }
+
+        char *strings[SERVER_ARGS_MAX];
+        int count = 0;
+        for (char *s = buffer; s < end && count < SERVER_ARGS_MAX; s += strlen(s) + 1)
+        {
+            strings[count++] = s;
+        }
+        char reply[1024];
+        if (count == SERVER_ARGS_MAX)
+        {
+            snprintf(reply, sizeof(reply), "%d Error: too many arguments", OPTION_ERROR);
+        }
+        else
+        {
+            handleRequest(server, strings, count, reply, sizeof(reply) - 1);
+        }
+        strcat(reply, "\n");
+        if (writeAll(fd, reply, strlen(reply)) != 0)
+        {
+            break;
+        }
+        size_t consumed = end + 1 - buffer;
+        memmove(buffer, end + 1, used - consumed);
+        used -= consumed;
+    }
+    free(buffer);
+}
+
+// Задача пула: принимает соединения, пока сервер не остановят
+static void serveConnections(void *arg, int index)
+{
+    (void)index;
+    Server *server = arg;
+    while (!server_stop)
+    {
+        struct pollfd p = {server->listen_fd, POLLIN, 0};
+        if (poll(&p, 1, SERVER_POLL_MS) <= 0)
+        {
+            continue;
+        }
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            continue; // соединение забрал другой поток
+        }
+        serveClient(server, fd);
+        close(fd);
+    }
+}
+
+// Сервер: threads потоков пула принимают соединения и выполняют запросы,
+// прочитанные изображения хранятся в пределах memory_limit байт.
+// Работает до SIGINT или SIGTERM
+int runServer(char *socket_path, int threads, size_t memory_limit, ServerParse parse)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: socket path is too long");
+    }
+    strcpy(address.sun_path, socket_path);
+
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.parse = parse;
+    server.memory_limit = memory_limit ? memory_limit : SERVER_DEFAULT_MEMORY;
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.listen_fd < 0)
+    {
+        return setError(FILE_WRITE_ERROR, "Error: can not create socket");
+    }
+    // сокет, оставшийся от прошлого запуска, заменяется
+    struct stat st;
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(socket_path);
+    }
+    if (bind(server.listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server.listen_fd, 128) != 0)
+    {
+        close(server.listen_fd);
+        return setError(FILE_WRITE_ERROR, "Error: can not listen on socket");
+    }
+    fcntl(server.listen_fd, F_SETFL, fcntl(server.listen_fd, F_GETFL) | O_NONBLOCK);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    server_stop = 0;
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_mutex_init(&server.parse_lock, NULL);
+    ThreadPool pool;
+    int code = createPool(&pool, threads);
+    if (code == 0)
+    {
+        poolRun(&pool, pool.count, serveConnections, &server);
+    }
+    destroyPool(&pool);
+
+    close(server.listen_fd);
+    unlink(socket_path);
+    while (server.images != NULL)
+    {
+        uncacheImage(&server, &server.images);
+    }
+    pthread_mutex_destroy(&server.lock);
+    pthread_mutex_destroy(&server.parse_lock);
+    printf("Server: %lu requests, %lu hits, %lu misses\n", server.requests, server.hits, server.misses);
+    return code;
+}
+
+int connectServer(char *socket_path, int *fd)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: socket path is too long");
+    }
+    strcpy(address.sun_path, socket_path);
+    *fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*fd < 0 || connect(*fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        if (*fd >= 0)
+        {
+            close(*fd);
+        }
+        return setError(FILE_READ_ERROR, "Error: can not connect to server");
+    }
+    return 0;
+}
+
+// Отправляет запрос и ждёт ответ; reply получает сообщение без кода,
+// возвращается код ответа
+int sendRequest(int fd, char *cwd, int argc, char **argv, char *reply, size_t size)
+{
+    size_t length = strlen(cwd) + 2;
+    for (int i = 0; i < argc; i++)
+    {
+        length += strlen(argv[i]) + 1;
+    }
+    char *message = (char *)malloc(length);
+    if (message == NULL)
+    {
+        snprintf(reply, size, "Memory allocation error!");
+        return MEMORY_ALLOCATION_ERROR;
+    }
+    char *p = stpcpy(message, cwd) + 1;
+    for (int i = 0; i < argc; i++)
+    {
+        // пустая строка означает конец запроса, поэтому пустые аргументы не передаются
+        if (argv[i][0] != '\0')
+        {
+            p = stpcpy(p, argv[i]) + 1;
+        }
+    }
+    *p++ = '\0';
+    int failed = writeAll(fd, message, p - message) != 0;
+    free(message);
+
+    char line[1024];
+    size_t used = 0;
+    while (!failed && (used == 0 || line[used - 1] != '\n') && used < sizeof(line) - 1)
+    {
+        ssize_t got = read(fd, line + used, 1);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        failed = got <= 0;
+        used += got > 0 ? got : 0;
+    }
+    line[used] = '\0';
+    int code = 0;
+    int offset = 0;
+    if (failed || sscanf(line, "%d %n", &code, &offset) < 1)
+    {
+        snprintf(reply, size, "Error: no reply from server");
+        return FILE_READ_ERROR;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    snprintf(reply, size, "%s", line + offset);
+    return code;
+}
@@ -0,0 +1,125 @@
+#include "bmp.h"
+
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// Статистика файла, который обрабатывает текущий поток (NULL - не собирается)
+static __thread BmpStats *current_stats;
+
+void initStats(BmpStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+// Складывает статистику одного файла в общую (пакетная обработка)
+void mergeStats(BmpStats *to, BmpStats *from)
+{
+    to->files += from->files;
+    to->header_parse_ns += from->header_parse_ns;
+    to->pixel_load_ns += from->pixel_load_ns;
+    to->save_ns += from->save_ns;
+    to->pyramid_ns += from->pyramid_ns;
+    to->total_ns += from->total_ns;
+    for (int i = 0; i < from->operation_count && i < STATS_MAX_OPERATIONS; i++)
+    {
+        to->operation_ns[i] += from->operation_ns[i];
+        to->operation_types[i] = from->operation_types[i];
+    }
+    if (from->operation_count > to->operation_count)
+    {
+        to->operation_count = from->operation_count;
+    }
+    to->bytes_read += from->bytes_read;
+    to->bytes_written += from->bytes_written;
+    to->alloc_count += from->alloc_count;
+    to->alloc_bytes += from->alloc_bytes;
+    to->cache_hits += from->cache_hits;
+    to->cache_misses += from->cache_misses;
+}
+
+uint64_t statsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+BmpStats *currentStats()
+{
+    return current_stats;
+}
+
+void setCurrentStats(BmpStats *stats)
+{
+    current_stats = stats;
+}
+
+static const char *operationName(int type)
+{
+    switch (type)
+    {
+    case OPERATION_CIRCLE:
+        return "circle";
+    case OPERATION_FILTER:
+        return "rgbfilter";
+    case OPERATION_SPLIT:
+        return "split";
+    case OPERATION_CIRCLES:
+        return "circles";
+    case OPERATION_LINE:
+        return "line";
+    case OPERATION_LUT:
+        return "lut";
+    default:
+        return "none";
+    }
+}
+
+// Печатает статистику для человека или одной строкой JSON для сбора логов
+void printStats(FILE *f, BmpStats *stats, int json)
+{
+    struct rusage usage;
+    long peak_rss_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+    int count = stats->operation_count < STATS_MAX_OPERATIONS ? stats->operation_count : STATS_MAX_OPERATIONS;
+
+    if (json)
+    {
+        fprintf(f, "{\"files\":%lu,\"header_parse_ns\":%llu,\"pixel_load_ns\":%llu,\"operations\":[",
+                stats->files, (unsigned long long)stats->header_parse_ns, (unsigned long long)stats->pixel_load_ns);
+        for (int i = 0; i < count; i++)
+        {
+            fprintf(f, "%s{\"name\":\"%s\",\"ns\":%llu}", i ? "," : "", operationName(stats->operation_types[i]),
+                    (unsigned long long)stats->operation_ns[i]);
+        }
+        fprintf(f, "],\"save_ns\":%llu,\"pyramid_ns\":%llu,\"total_ns\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,"
+                   "\"alloc_count\":%lu,\"alloc_bytes\":%llu,\"cache_hits\":%lu,\"cache_misses\":%lu,\"peak_rss_kb\":%ld}\n",
+                (unsigned long long)stats->save_ns, (unsigned long long)stats->pyramid_ns, (unsigned long long)stats->total_ns,
+                (unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written,
+                stats->alloc_count, (unsigned long long)stats->alloc_bytes, stats->cache_hits, stats->cache_misses, peak_rss_kb);
+        return;
+    }
+
+    fprintf(f, "Statistics:\n");
+    fprintf(f, "files:        \t%lu\n", stats->files);
+    fprintf(f, "header parse: \t%.3f ms\n", stats->header_parse_ns / 1e6);
+    fprintf(f, "pixel load:   \t%.3f ms\n", stats->pixel_load_ns / 1e6);
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(f, "operation %d (%s):\t%.3f ms\n", i + 1, operationName(stats->operation_types[i]), stats->operation_ns[i] / 1e6);
+    }
+    fprintf(f, "save:         \t%.3f ms\n", stats->save_ns / 1e6);
+    if (stats->pyramid_ns > 0)
+    {
+        fprintf(f, "pyramid:      \t%.3f ms\n", stats->pyramid_ns / 1e6);
+    }
+    fprintf(f, "total:        \t%.3f ms\n", stats->total_ns / 1e6);
+    fprintf(f, "bytes read:   \t%llu\n", (unsigned long long)stats->bytes_read);
+    fprintf(f, "bytes written:\t%llu\n", (unsigned long long)stats->bytes_written);
+    fprintf(f, "allocations:  \t%lu (%llu bytes)\n", stats->alloc_count, (unsigned long long)stats->alloc_bytes);
+    if (stats->cache_hits + stats->cache_misses > 0)
+    {
+        fprintf(f, "cache:        \t%lu hits, %lu misses\n", stats->cache_hits, stats->cache_misses);
+    }
+    fprintf(f, "peak RSS:     \t%ld KB\n", peak_rss_kb);
+}
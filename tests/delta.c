@@ -0,0 +1,207 @@
+// Патчи --delta: --apply-patch должен собрать тот же файл, что и прямая запись,
+// патч сетки --split - быть много меньше картинки, а на изменённый исходный
+// файл патч не должен ложиться вовсе
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Одна операция из аргументов командной строки, например {'s', 'x', 'y'}, {NULL, "3", "3"}
+typedef struct TestOp
+{
+    const char *name;
+    int opt[8];
+    char *value[8];
+    int max_percent; // предел размера патча в процентах от файла результата
+} TestOp;
+
+static const TestOp ops[] = {
+    {"grid", {'s', 'x', 'y', 'T', 'C'}, {NULL, "3", "3", "2", "255.0.0"}, 20},
+    {"circle", {'c', 'O', 'r', 'T', 'C', 'F', 'P'}, {NULL, "40.30", "20", "3", "0.255.0", NULL, "1.2.3"}, 15},
+    {"line", {'L', 'b', 'e', 'T', 'C'}, {NULL, "5.7", "300.200", "1", "0.0.255"}, 25},
+    {"lut", {'Y'}, {"invert"}, 101},
+};
+
+static void makeArgs(const TestOp *op, OperationArgs *args)
+{
+    initOperationArgs(args);
+    for (int k = 0; k < 8 && op->opt[k] != 0; k++)
+    {
+        setOperationArg(args, op->opt[k], op->value[k]);
+    }
+}
+
+static int runOp(const TestOp *op, int delta, char *input, char *output)
+{
+    OperationArgs args;
+    makeArgs(op, &args);
+    BMP image;
+    initBMP(&image, NULL);
+    ProcessOptions options;
+    memset(&options, 0, sizeof(options));
+    options.ops = &args;
+    options.op_count = 1;
+    options.delta = delta;
+    int code = processFile(&image, input, output, &options);
+    if (code != 0)
+    {
+        fprintf(stderr, "%s\n", lastError());
+    }
+    freeBMP(&image);
+    return code;
+}
+
+static int sameFiles(char *a, char *b)
+{
+    FILE *fa = fopen(a, "rb");
+    FILE *fb = fopen(b, "rb");
+    int same = fa != NULL && fb != NULL;
+    while (same)
+    {
+        int ca = fgetc(fa);
+        int cb = fgetc(fb);
+        same = ca == cb;
+        if (ca == EOF || cb == EOF)
+        {
+            break;
+        }
+    }
+    if (fa != NULL)
+    {
+        fclose(fa);
+    }
+    if (fb != NULL)
+    {
+        fclose(fb);
+    }
+    return same;
+}
+
+static long long fileSize(char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+// Пишет файл со случайными пикселями и мусором в выравнивании строк
+static int makeImage(char *path, int width, int height, int bits, int top_down)
+{
+    size_t stride = ((size_t)width * bits / 8 + 3) & ~(size_t)3;
+    size_t offset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+    BitmapFileHeader bmfh = {0x4d42, (unsigned int)(offset + stride * height), 0, 0, (unsigned int)offset};
+    BitmapInfoHeader bmih = {sizeof(BitmapInfoHeader), width, top_down ? -height : height, 1, bits, BI_RGB,
+                             (unsigned int)(stride * height), 2835, 2835, 0, 0};
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        return 1;
+    }
+    fwrite(&bmfh, sizeof(bmfh), 1, f);
+    fwrite(&bmih, sizeof(bmih), 1, f);
+    for (size_t i = 0; i < stride * height; i++)
+    {
+        fputc(rand() & 0xff, f);
+    }
+    return fclose(f) != 0;
+}
+
+static int copyFile(char *from, char *to)
+{
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    int c;
+    while (in != NULL && out != NULL && (c = fgetc(in)) != EOF)
+    {
+        fputc(c, out);
+    }
+    int failed = in == NULL || out == NULL;
+    if (in != NULL)
+    {
+        fclose(in);
+    }
+    if (out != NULL)
+    {
+        failed |= fclose(out) != 0;
+    }
+    return failed;
+}
+
+// Меняет один байт пикселей исходного файла, не меняя его размер и заголовки
+static int touchPixel(char *path)
+{
+    FILE *f = fopen(path, "r+b");
+    if (f == NULL)
+    {
+        return 1;
+    }
+    fseek(f, sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader), SEEK_SET);
+    int value = fgetc(f);
+    fseek(f, sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader), SEEK_SET);
+    fputc(value ^ 1, f);
+    return fclose(f) != 0;
+}
+
+static int checkDelta(int width, int height, int bits, int top_down)
+{
+    char input[64], direct[64], patch[64], rebuilt[64];
+    snprintf(input, sizeof(input), "/tmp/bmp_delta_%d_in.bmp", (int)getpid());
+    snprintf(direct, sizeof(direct), "/tmp/bmp_delta_%d_direct.bmp", (int)getpid());
+    snprintf(patch, sizeof(patch), "/tmp/bmp_delta_%d.patch", (int)getpid());
+    snprintf(rebuilt, sizeof(rebuilt), "/tmp/bmp_delta_%d_rebuilt.bmp", (int)getpid());
+    int failed = makeImage(input, width, height, bits, top_down);
+
+    for (size_t i = 0; !failed && i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        unlink(rebuilt);
+        failed = runOp(&ops[i], 0, input, direct) != 0 || runOp(&ops[i], 1, input, patch) != 0;
+        if (!failed && applyPatch(input, patch, rebuilt) != 0)
+        {
+            fprintf(stderr, "%s\n", lastError());
+            failed = 1;
+        }
+        long long patch_size = fileSize(patch);
+        long long image_size = fileSize(direct);
+        if (!failed && !sameFiles(direct, rebuilt))
+        {
+            printf("FAIL: %s, %dx%d, %d bit%s: rebuilt file differs from direct output\n", ops[i].name, width, height, bits,
+                   top_down ? ", top-down" : "");
+            failed = 1;
+        }
+        else if (!failed && patch_size * 100 > image_size * ops[i].max_percent)
+        {
+            printf("FAIL: %s, %dx%d, %d bit%s: patch of %lld bytes for a %lld byte image\n", ops[i].name, width, height, bits,
+                   top_down ? ", top-down" : "", patch_size, image_size);
+            failed = 1;
+        }
+        else if (!failed)
+        {
+            printf("ok: %s, %dx%d, %d bit%s: patch %lld of %lld bytes\n", ops[i].name, width, height, bits,
+                   top_down ? ", top-down" : "", patch_size, image_size);
+        }
+    }
+
+    // исходный файл с другим пикселем: патч отклоняется и ничего не пишется, в том числе на месте
+    unlink(rebuilt);
+    if (!failed && (touchPixel(input) != 0 || copyFile(input, direct) != 0 || applyPatch(input, patch, rebuilt) == 0 ||
+                    fileSize(rebuilt) >= 0 || applyPatch(input, patch, input) == 0 || !sameFiles(input, direct)))
+    {
+        printf("FAIL: %dx%d, %d bit: patch applied to a changed base file\n", width, height, bits);
+        failed = 1;
+    }
+    unlink(input);
+    unlink(direct);
+    unlink(patch);
+    unlink(rebuilt);
+    return failed;
+}
+
+int main()
+{
+    int failed = 0;
+    failed += checkDelta(1001, 703, 24, 0);
+    failed += checkDelta(333, 257, 32, 1);
+    printf("%s: grid, circle, line and lut patches, changed base rejected\n", failed ? "FAIL" : "ok");
+    return failed != 0;
+}
@@ -0,0 +1,102 @@
+// Каждое ядро --rgbfilter (скалярное, SSE4.1, AVX2) должно давать те же байты,
+// что и попиксельный цикл: выбранный канал каждого пикселя заменяется значением,
+// остальные каналы, альфа и выравнивание строк не меняются
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const int widths[] = {1, 2, 3, 4, 5, 15, 16, 17, 31, 32, 33, 100, 1001};
+static const char *channels[] = {"blue", "green", "red"}; // по смещению в Rgb
+static const int values[] = {0, 77, 255};
+
+// Исходная реализация: поканальная запись в каждый пиксель строки
+static void referenceFilter(unsigned char *pixels, size_t stride, int width, int height, int step, int offset, int value)
+{
+    for (int i = 0; i < height; i++)
+    {
+        unsigned char *row = pixels + stride * i;
+        for (int j = 0; j < width; j++)
+        {
+            row[(size_t)j * step + offset] = value;
+        }
+    }
+}
+
+static int checkImage(int width, int height, int pixel_bytes)
+{
+    BMP bmp;
+    initBMP(&bmp, NULL);
+    bmp.bmih.width = width;
+    bmp.bmih.height = height;
+    bmp.bmih.bitsPerPixel = pixel_bytes * 8;
+    bmp.pixel_bytes = pixel_bytes;
+    bmp.alpha = pixel_bytes == 4;
+    bmp.stride = rowStride(width, pixel_bytes);
+    bmp.rows = height;
+    if (allocPixels(&bmp, height) != 0)
+    {
+        fprintf(stderr, "%s\n", lastError());
+        return 1;
+    }
+
+    size_t size = bmp.stride * height;
+    unsigned char *source = malloc(size);
+    unsigned char *expected = malloc(size);
+    int failed = source == NULL || expected == NULL;
+    // случайные байты и в выравнивании: ядра не должны его трогать
+    for (size_t i = 0; !failed && i < size; i++)
+    {
+        source[i] = rand();
+    }
+    for (int c = 0; !failed && c < 3; c++)
+    {
+        for (size_t v = 0; !failed && v < sizeof(values) / sizeof(values[0]); v++)
+        {
+            memcpy(expected, source, size);
+            referenceFilter(expected, bmp.stride, width, height, pixel_bytes, c, values[v]);
+            for (int kernel = FILTER_KERNEL_SCALAR; kernel <= FILTER_KERNEL_AVX2; kernel++)
+            {
+                if (!setFilterKernel(kernel))
+                {
+                    continue;
+                }
+                memcpy(bmp.pixels, source, size);
+                rgbFilter(&bmp, (char *)channels[c], values[v]);
+                if (memcmp(bmp.pixels, expected, size) != 0)
+                {
+                    size_t at = 0;
+                    while (bmp.pixels[at] == expected[at])
+                    {
+                        at++;
+                    }
+                    printf("FAIL: kernel %d, %dx%d, %d bit, %s=%d: byte %zu is %d, expected %d\n", kernel, width,
+                           height, pixel_bytes * 8, channels[c], values[v], at, bmp.pixels[at], expected[at]);
+                    failed = 1;
+                }
+            }
+        }
+    }
+    free(source);
+    free(expected);
+    freeBMP(&bmp);
+    return failed;
+}
+
+int main()
+{
+    const char *names[] = {"scalar", "sse4.1", "avx2"};
+    for (int kernel = FILTER_KERNEL_SCALAR; kernel <= FILTER_KERNEL_AVX2; kernel++)
+    {
+        printf("%s: %s\n", names[kernel], setFilterKernel(kernel) ? "checked" : "skipped, not supported");
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++)
+    {
+        failed += checkImage(widths[i], 3, 3);
+        failed += checkImage(widths[i], 3, 4);
+    }
+    printf("%s: %d widths, 24 and 32 bit\n", failed ? "FAIL" : "ok", (int)(sizeof(widths) / sizeof(widths[0])));
+    return failed != 0;
+}
@@ -0,0 +1,241 @@
+// Таблицы --lut: векторное ядро должно давать те же байты, что и скалярный
+// цикл, а цепочка --op, сложенная в одну таблицу (fuseOperations), - тот же
+// файл, что и те же операции, применённые по одной
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const int widths[] = {1, 2, 21, 63, 64, 65, 100, 129, 256, 1001};
+
+static void randomLut(ChannelLut *lut, int swap)
+{
+    static const unsigned char orders[6][3] = {{0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}};
+    int same = rand() % 3 == 0; // одна таблица на все каналы - отдельная ветка ядра
+    for (int c = 0; c < 3; c++)
+    {
+        for (int v = 0; v < 256; v++)
+        {
+            lut->table[c][v] = same && c > 0 ? lut->table[0][v] : rand();
+        }
+        lut->source[c] = orders[swap ? rand() % 6 : 0][c];
+    }
+}
+
+static int checkKernel(int kernel, int width, int height, int pixel_bytes)
+{
+    BMP bmp;
+    initBMP(&bmp, NULL);
+    bmp.bmih.width = width;
+    bmp.bmih.height = height;
+    bmp.bmih.bitsPerPixel = pixel_bytes * 8;
+    bmp.pixel_bytes = pixel_bytes;
+    bmp.stride = rowStride(width, pixel_bytes);
+    bmp.rows = height;
+    if (allocPixels(&bmp, height) != 0)
+    {
+        return 1;
+    }
+    size_t size = bmp.stride * height;
+    unsigned char *source = malloc(size);
+    unsigned char *expected = malloc(size);
+    int failed = source == NULL || expected == NULL;
+    for (int round = 0; !failed && round < 8; round++)
+    {
+        ChannelLut lut;
+        randomLut(&lut, round % 2);
+        for (size_t i = 0; i < size; i++)
+        {
+            source[i] = rand(); // и в выравнивании: его ядро не трогает
+        }
+        setLutKernel(LUT_KERNEL_SCALAR);
+        memcpy(bmp.pixels, source, size);
+        applyLut(&bmp, &lut);
+        memcpy(expected, bmp.pixels, size);
+
+        setLutKernel(kernel);
+        memcpy(bmp.pixels, source, size);
+        applyLut(&bmp, &lut);
+        if (memcmp(bmp.pixels, expected, size) != 0)
+        {
+            printf("FAIL: kernel %d, %dx%d, %d bit, round %d\n", kernel, width, height, pixel_bytes * 8, round);
+            failed = 1;
+        }
+    }
+    free(source);
+    free(expected);
+    freeBMP(&bmp);
+    return failed;
+}
+
+// Одна операция --op из аргументов командной строки, например {'Y', "gamma=2.2", 'Z', "rg"}
+typedef struct TestOp
+{
+    int opt[3];
+    char *value[3];
+} TestOp;
+
+static const TestOp chains[][4] = {
+    {{{'Y'}, {"invert"}}, {{'Y', 'Z'}, {"gamma=2.2", "rg"}}, {{'Y'}, {"swap=bgr"}}},
+    {{{'Y'}, {"scale=1.7"}}, {{'Y', 'Z'}, {"clamp=30.200", "b"}}, {{'Y', 'Z'}, {"threshold=128", "g"}},
+     {{'f', 'N', 'V'}, {NULL, "red", "9"}}},
+    {{{'Y'}, {"swap=gbr"}}, {{'Y'}, {"swap=brg"}}, {{'Y', 'Z'}, {"invert", "r"}}, {{'Y'}, {"gamma=0.5"}}},
+    {{{'Y'}, {"swap=grb"}}, {{'Y', 'Z'}, {"scale=0.3", "gb"}}, {{'f', 'N', 'V'}, {NULL, "blue", "200"}},
+     {{'Y'}, {"swap=rbg"}}},
+};
+
+static void makeArgs(const TestOp *op, OperationArgs *args)
+{
+    initOperationArgs(args);
+    for (int k = 0; k < 3 && op->opt[k] != 0; k++)
+    {
+        setOperationArg(args, op->opt[k], op->value[k]);
+    }
+}
+
+static int chainLength(const TestOp *chain)
+{
+    int count = 0;
+    while (count < 4 && chain[count].opt[0] != 0)
+    {
+        count++;
+    }
+    return count;
+}
+
+static int runOps(OperationArgs *args, int count, char *input, char *output)
+{
+    BMP image;
+    initBMP(&image, NULL);
+    ProcessOptions options;
+    memset(&options, 0, sizeof(options));
+    options.ops = args;
+    options.op_count = count;
+    int code = processFile(&image, input, output, &options);
+    if (code != 0)
+    {
+        fprintf(stderr, "%s\n", lastError());
+    }
+    freeBMP(&image);
+    return code;
+}
+
+static int sameFiles(char *a, char *b)
+{
+    FILE *fa = fopen(a, "rb");
+    FILE *fb = fopen(b, "rb");
+    int same = fa != NULL && fb != NULL;
+    while (same)
+    {
+        int ca = fgetc(fa);
+        int cb = fgetc(fb);
+        same = ca == cb;
+        if (ca == EOF || cb == EOF)
+        {
+            break;
+        }
+    }
+    if (fa != NULL)
+    {
+        fclose(fa);
+    }
+    if (fb != NULL)
+    {
+        fclose(fb);
+    }
+    return same;
+}
+
+// Пишет файл со случайными пикселями и нулевым выравниванием строк
+static int makeImage(char *path, int width, int height, int bits, int top_down)
+{
+    size_t stride = ((size_t)width * bits / 8 + 3) & ~(size_t)3;
+    size_t offset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+    BitmapFileHeader bmfh = {0x4d42, (unsigned int)(offset + stride * height), 0, 0, (unsigned int)offset};
+    BitmapInfoHeader bmih = {sizeof(BitmapInfoHeader), width, top_down ? -height : height, 1, bits, BI_RGB,
+                             (unsigned int)(stride * height), 2835, 2835, 0, 0};
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        return 1;
+    }
+    fwrite(&bmfh, sizeof(bmfh), 1, f);
+    fwrite(&bmih, sizeof(bmih), 1, f);
+    for (int y = 0; y < height; y++)
+    {
+        for (size_t x = 0; x < stride; x++)
+        {
+            fputc(x < (size_t)width * bits / 8 ? rand() & 0xff : 0, f);
+        }
+    }
+    return fclose(f) != 0;
+}
+
+static int checkChains(int kernel, int width, int height, int bits, int top_down)
+{
+    char input[64], step[2][64], fused[64];
+    snprintf(input, sizeof(input), "/tmp/bmp_lut_%d_in.bmp", (int)getpid());
+    snprintf(step[0], sizeof(step[0]), "/tmp/bmp_lut_%d_a.bmp", (int)getpid());
+    snprintf(step[1], sizeof(step[1]), "/tmp/bmp_lut_%d_b.bmp", (int)getpid());
+    snprintf(fused, sizeof(fused), "/tmp/bmp_lut_%d_fused.bmp", (int)getpid());
+    int failed = makeImage(input, width, height, bits, top_down);
+    setLutKernel(kernel);
+
+    for (size_t c = 0; !failed && c < sizeof(chains) / sizeof(chains[0]); c++)
+    {
+        int count = chainLength(chains[c]);
+        OperationArgs args[4];
+        for (int i = 0; i < count; i++)
+        {
+            makeArgs(&chains[c][i], &args[i]);
+        }
+        char *current = input;
+        for (int i = 0; !failed && i < count; i++)
+        {
+            failed = runOps(&args[i], 1, current, step[i % 2]) != 0;
+            current = step[i % 2];
+        }
+        failed = failed || runOps(args, count, input, fused) != 0;
+        if (!failed && !sameFiles(current, fused))
+        {
+            printf("FAIL: kernel %d, chain %zu, %dx%d, %d bit%s: fused result differs from sequential\n", kernel, c, width,
+                   height, bits, top_down ? ", top-down" : "");
+            failed = 1;
+        }
+    }
+    unlink(input);
+    unlink(step[0]);
+    unlink(step[1]);
+    unlink(fused);
+    return failed;
+}
+
+int main()
+{
+    const char *names[] = {"scalar", "avx512vbmi"};
+    int kernels[2];
+    for (int kernel = LUT_KERNEL_SCALAR; kernel <= LUT_KERNEL_AVX512; kernel++)
+    {
+        kernels[kernel] = setLutKernel(kernel);
+        printf("%s: %s\n", names[kernel], kernels[kernel] ? "checked" : "skipped, not supported");
+    }
+
+    int failed = 0;
+    for (int kernel = LUT_KERNEL_SCALAR; kernel <= LUT_KERNEL_AVX512; kernel++)
+    {
+        for (size_t i = 0; kernels[kernel] && i < sizeof(widths) / sizeof(widths[0]); i++)
+        {
+            failed += checkKernel(kernel, widths[i], 3, 3);
+            failed += checkKernel(kernel, widths[i], 3, 4);
+        }
+        if (kernels[kernel])
+        {
+            failed += checkChains(kernel, 333, 57, 24, 0);
+            failed += checkChains(kernel, 101, 40, 32, 1);
+        }
+    }
+    printf("%s: %d widths, 24 and 32 bit, %d --op chains\n", failed ? "FAIL" : "ok", (int)(sizeof(widths) / sizeof(widths[0])),
+           (int)(sizeof(chains) / sizeof(chains[0])));
+    return failed != 0;
+}
@@ -0,0 +1,426 @@
+// Сжатые BI_RLE8/BI_RLE4/BI_RLE24: поток команд собирается вместе с картинкой,
+// которую он задаёт, и распаковка целиком (readBMP) и полосами (--max-memory)
+// должна её повторить - с пропусками «0, 2, dx, dy» через границы полос, RLE4
+// нечётной длины и оборванными файлами. Результат --rle должен читаться обратно
+// без потерь
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct Stream
+{
+    int bits;
+    int width;
+    int height;
+    unsigned char palette[256][3];
+    unsigned char *data; // команды RLE
+    size_t size;
+    unsigned char *pixels; // ожидаемая картинка: строки снизу вверх по width * 3 байт, пропуски чёрные
+    int x;
+    int y;
+} Stream;
+
+static void paint(Stream *s, int x, const unsigned char *bgr)
+{
+    if (x < s->width && s->y < s->height)
+    {
+        memcpy(s->pixels + ((size_t)s->y * s->width + x) * 3, bgr, 3);
+    }
+}
+
+static void emit(Stream *s, int value)
+{
+    s->data[s->size++] = value;
+}
+
+// Серия count одинаковых значений (у RLE4 - двух чередующихся цветов)
+static void emitRun(Stream *s, int count)
+{
+    unsigned char bgr[3] = {rand(), rand(), rand()};
+    int value = rand() & 0xff;
+    emit(s, count);
+    if (s->bits == 24)
+    {
+        emit(s, bgr[0]);
+        emit(s, bgr[1]);
+        emit(s, bgr[2]);
+    }
+    else
+    {
+        emit(s, value);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (s->bits == 24)
+        {
+            paint(s, s->x + i, bgr);
+        }
+        else if (s->bits == 8)
+        {
+            paint(s, s->x + i, s->palette[value]);
+        }
+        else
+        {
+            paint(s, s->x + i, s->palette[i % 2 ? value & 0x0f : value >> 4]);
+        }
+    }
+    s->x += count;
+}
+
+// count значений как есть, данные выровнены до двух байт
+static void emitLiteral(Stream *s, int count)
+{
+    emit(s, 0);
+    emit(s, count);
+    size_t bytes = s->bits == 24 ? (size_t)count * 3 : s->bits == 8 ? (size_t)count : ((size_t)count + 1) / 2;
+    unsigned char *values = s->data + s->size;
+    for (size_t i = 0; i < bytes + bytes % 2; i++)
+    {
+        emit(s, rand() & 0xff);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (s->bits == 24)
+        {
+            paint(s, s->x + i, values + i * 3);
+        }
+        else if (s->bits == 8)
+        {
+            paint(s, s->x + i, s->palette[values[i]]);
+        }
+        else
+        {
+            paint(s, s->x + i, s->palette[i % 2 ? values[i / 2] & 0x0f : values[i / 2] >> 4]);
+        }
+    }
+    s->x += count;
+}
+
+// Случайный поток из steps команд: серии, литералы (у RLE4 и нечётной длины),
+// концы строк и пропуски на несколько строк; серии и литералы бывают шире строки
+static void generate(Stream *s, unsigned int seed, int steps, int end_marker)
+{
+    srand(seed);
+    for (int i = 0; i < 256; i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            s->palette[i][c] = rand();
+        }
+    }
+    memset(s->pixels, 0, (size_t)s->width * s->height * 3);
+    s->size = 0;
+    s->x = 0;
+    s->y = 0;
+    for (int step = 0; step < steps && s->y < s->height; step++)
+    {
+        int kind = rand() % 20;
+        if (kind < 11)
+        {
+            emitRun(s, 1 + rand() % (rand() % 4 ? 16 : 255));
+        }
+        else if (kind < 15)
+        {
+            emitLiteral(s, 3 + rand() % (rand() % 4 ? 14 : 253));
+        }
+        else if (kind < 18)
+        {
+            emit(s, 0);
+            emit(s, 0);
+            s->x = 0;
+            s->y++;
+        }
+        else
+        {
+            int dx = rand() % 12;
+            int dy = rand() % 6;
+            emit(s, 0);
+            emit(s, 2);
+            emit(s, dx);
+            emit(s, dy);
+            s->x += dx;
+            s->y += dy;
+        }
+    }
+    if (end_marker)
+    {
+        emit(s, 0);
+        emit(s, 1);
+    }
+}
+
+static int writeStream(char *path, Stream *s, size_t size)
+{
+    size_t colors = s->bits == 24 ? 0 : (size_t)1 << s->bits;
+    size_t offset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + colors * 4;
+    int compression = s->bits == 24 ? BI_RLE24 : s->bits == 8 ? BI_RLE8 : BI_RLE4;
+    BitmapFileHeader bmfh = {0x4d42, (unsigned int)(offset + size), 0, 0, (unsigned int)offset};
+    BitmapInfoHeader bmih = {sizeof(BitmapInfoHeader), s->width, s->height, 1, s->bits, compression,
+                             (unsigned int)size, 2835, 2835, 0, 0};
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        return 1;
+    }
+    fwrite(&bmfh, sizeof(bmfh), 1, f);
+    fwrite(&bmih, sizeof(bmih), 1, f);
+    for (size_t i = 0; i < colors; i++)
+    {
+        unsigned char entry[4] = {s->palette[i][0], s->palette[i][1], s->palette[i][2], 0};
+        fwrite(entry, 4, 1, f);
+    }
+    fwrite(s->data, 1, size, f);
+    return fclose(f) != 0;
+}
+
+// Сравнивает строки снизу вверх с ожидаемыми; у строки skip_row - только первые skip_bytes байт
+static int sameRows(unsigned char *(*row)(void *, int), void *source, Stream *s, int skip_row, size_t skip_bytes)
+{
+    size_t row_bytes = (size_t)s->width * 3;
+    for (int y = 0; y < s->height; y++)
+    {
+        size_t bytes = y == skip_row ? skip_bytes : row_bytes;
+        if (memcmp(row(source, y), s->pixels + y * row_bytes, bytes) != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static unsigned char *bmpRow(void *bmp, int y)
+{
+    return (unsigned char *)getRow(bmp, y);
+}
+
+static unsigned char *fileRow(void *data, int y)
+{
+    unsigned char *file = data;
+    BitmapFileHeader bmfh;
+    BitmapInfoHeader bmih;
+    memcpy(&bmfh, file, sizeof(bmfh));
+    memcpy(&bmih, file + sizeof(bmfh), sizeof(bmih));
+    return file + bmfh.pixelArrOffset + rowStride(bmih.width, 3) * y;
+}
+
+static unsigned char *readFile(char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *data = malloc(*size + 1);
+    if (data != NULL && fread(data, 1, *size, f) != *size)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+// Пропускает файл через тождественную таблицу --lut gamma=1: пиксели не меняются
+static int runFile(char *input, char *output, size_t max_memory, int rle)
+{
+    OperationArgs args;
+    initOperationArgs(&args);
+    setOperationArg(&args, 'Y', "gamma=1");
+    BMP image;
+    initBMP(&image, NULL);
+    ProcessOptions options;
+    memset(&options, 0, sizeof(options));
+    options.ops = &args;
+    options.op_count = 1;
+    options.max_memory = max_memory;
+    options.rle = rle;
+    int code = processFile(&image, input, output, &options);
+    if (code != 0)
+    {
+        fprintf(stderr, "%s\n", lastError());
+    }
+    freeBMP(&image);
+    return code;
+}
+
+// Распаковывает файл целиком и полосами по 1, 2 и 3 строки и сравнивает с картинкой
+static int checkDecode(char *input, char *output, Stream *s, int skip_row, size_t skip_bytes)
+{
+    BMP bmp;
+    initBMP(&bmp, NULL);
+    int same = readBMP(input, &bmp) == 0 && bmp.pixel_bytes == 3 && sameRows(bmpRow, &bmp, s, skip_row, skip_bytes);
+    freeBMP(&bmp);
+    for (int band = 1; same && band <= 3; band++)
+    {
+        size_t size = 0;
+        unsigned char *data = NULL;
+        same = runFile(input, output, rowStride(s->width, 3) * band, 0) == 0 && (data = readFile(output, &size)) != NULL &&
+               size == sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + rowStride(s->width, 3) * s->height &&
+               sameRows(fileRow, data, s, skip_row, skip_bytes);
+        free(data);
+    }
+    return same;
+}
+
+static int checkStreams(int bits, int width, int height)
+{
+    char input[64], output[64];
+    snprintf(input, sizeof(input), "/tmp/bmp_rle_%d_in.bmp", (int)getpid());
+    snprintf(output, sizeof(output), "/tmp/bmp_rle_%d_out.bmp", (int)getpid());
+    int steps = width * height / 4 + 8;
+    Stream s = {bits, width, height};
+    s.data = malloc((size_t)(steps + 1) * (4 + 255 * 3 + 1));
+    s.pixels = malloc((size_t)width * height * 3);
+    int failed = s.data == NULL || s.pixels == NULL;
+
+    for (unsigned int seed = 1; !failed && seed <= 8; seed++)
+    {
+        // весь поток, с концом изображения и без него
+        for (int end_marker = 0; !failed && end_marker <= 1; end_marker++)
+        {
+            generate(&s, seed, steps, end_marker);
+            if (writeStream(input, &s, s.size) != 0 || !checkDecode(input, output, &s, -1, 0))
+            {
+                printf("FAIL: RLE%d %dx%d, seed %u%s\n", bits, width, height, seed, end_marker ? "" : ", no end marker");
+                failed = 1;
+            }
+        }
+
+        // файл оборван посреди команды: строки до неё и начало её строки распакованы,
+        // остальное - чёрное
+        int cut = 1 + rand() % steps;
+        generate(&s, seed, cut, 0);
+        size_t before = s.size;
+        int y = s.y;
+        size_t x = s.x;
+        unsigned char *expected = malloc((size_t)width * height * 3);
+        if (!failed && expected != NULL)
+        {
+            memcpy(expected, s.pixels, (size_t)width * height * 3);
+            generate(&s, seed, cut + 1, 0);
+            size_t size = s.size > before + 1 ? before + 1 + rand() % (s.size - before - 1) : s.size;
+            memcpy(s.pixels, expected, (size_t)width * height * 3);
+            if (writeStream(input, &s, size) != 0 || !checkDecode(input, output, &s, y, x < (size_t)width ? x * 3 : (size_t)width * 3))
+            {
+                printf("FAIL: RLE%d %dx%d, seed %u, cut after %zu of %zu bytes\n", bits, width, height, seed, size, s.size);
+                failed = 1;
+            }
+        }
+        failed |= expected == NULL;
+        free(expected);
+    }
+    if (!failed)
+    {
+        printf("ok: RLE%d %dx%d: whole and banded decode, truncated streams\n", bits, width, height);
+    }
+    free(s.data);
+    free(s.pixels);
+    unlink(input);
+    unlink(output);
+    return failed;
+}
+
+// Пишет 24-битный файл с сериями одного цвета и шумом между ними
+static int makeImage(char *path, int width, int height, unsigned char **pixels)
+{
+    size_t stride = rowStride(width, 3);
+    size_t offset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+    BitmapFileHeader bmfh = {0x4d42, (unsigned int)(offset + stride * height), 0, 0, (unsigned int)offset};
+    BitmapInfoHeader bmih = {sizeof(BitmapInfoHeader), width, height, 1, 24, BI_RGB, (unsigned int)(stride * height), 2835, 2835, 0, 0};
+    *pixels = calloc(stride * height, 1);
+    if (*pixels == NULL)
+    {
+        return 1;
+    }
+    for (int y = 0; y < height; y++)
+    {
+        unsigned char *row = *pixels + stride * y;
+        for (int x = 0; x < width;)
+        {
+            int length = rand() % 3 == 0 ? 1 + rand() % 5 : 1 + rand() % 400;
+            unsigned char bgr[3] = {rand(), rand(), rand()};
+            for (int end = x + length < width ? x + length : width; x < end; x++)
+            {
+                memcpy(row + (size_t)x * 3, bgr, 3);
+                if (length <= 5)
+                {
+                    bgr[rand() % 3] = rand();
+                }
+            }
+        }
+    }
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        return 1;
+    }
+    fwrite(&bmfh, sizeof(bmfh), 1, f);
+    fwrite(&bmih, sizeof(bmih), 1, f);
+    fwrite(*pixels, 1, stride * height, f);
+    return fclose(f) != 0;
+}
+
+// --rle целиком и полосами: файл сжат BI_RLE24, меньше исходного и читается в те же пиксели
+static int checkWriter(int width, int height)
+{
+    char input[64], output[64];
+    snprintf(input, sizeof(input), "/tmp/bmp_rle_%d_plain.bmp", (int)getpid());
+    snprintf(output, sizeof(output), "/tmp/bmp_rle_%d_packed.bmp", (int)getpid());
+    unsigned char *pixels = NULL;
+    int failed = makeImage(input, width, height, &pixels);
+    size_t stride = rowStride(width, 3);
+
+    for (int band = 0; !failed && band <= 3; band++)
+    {
+        size_t size = 0;
+        unsigned char *data = NULL;
+        BMP bmp;
+        initBMP(&bmp, NULL);
+        int same = runFile(input, output, stride * band, 1) == 0 && (data = readFile(output, &size)) != NULL &&
+                   size < stride * height && readBMP(output, &bmp) == 0 && bmp.rle != NULL;
+        BitmapInfoHeader bmih;
+        if (same)
+        {
+            memcpy(&bmih, data + sizeof(BitmapFileHeader), sizeof(bmih));
+            same = bmih.compression == BI_RLE24;
+        }
+        for (int y = 0; same && y < height; y++)
+        {
+            same = memcmp(getRow(&bmp, y), pixels + stride * y, stride) == 0;
+        }
+        if (!same)
+        {
+            printf("FAIL: --rle %dx%d, %d-row bands\n", width, height, band ? band : height);
+            failed = 1;
+        }
+        else
+        {
+            printf("ok: --rle %dx%d, %d-row bands: %zu of %zu bytes\n", width, height, band ? band : height, size,
+                   sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + stride * height);
+        }
+        freeBMP(&bmp);
+        free(data);
+    }
+    free(pixels);
+    unlink(input);
+    unlink(output);
+    return failed;
+}
+
+int main()
+{
+    int failed = 0;
+    failed += checkStreams(8, 37, 29);
+    failed += checkStreams(4, 37, 29);
+    failed += checkStreams(4, 6, 50);
+    failed += checkStreams(24, 33, 21);
+    failed += checkWriter(1001, 61);
+    failed += checkWriter(45, 40);
+    printf("%s: RLE8, RLE4 and RLE24 streams, --rle round trip\n", failed ? "FAIL" : "ok");
+    return failed != 0;
+}
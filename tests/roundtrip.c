@@ -0,0 +1,129 @@
+// Чтение и запись через libbmp со своим распределителем: файл после
+// readBMP -> writeBMP должен совпасть с исходным байт в байт
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct Counter
+{
+    int allocs;
+    int frees;
+    int misaligned;
+} Counter;
+
+static void *countingAlloc(size_t size, size_t alignment, void *user)
+{
+    Counter *counter = user;
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, alignment, size) != 0)
+    {
+        return NULL;
+    }
+    counter->allocs++;
+    counter->misaligned += (uintptr_t)ptr % alignment != 0;
+    return ptr;
+}
+
+static void countingFree(void *ptr, void *user)
+{
+    Counter *counter = user;
+    counter->frees++;
+    free(ptr);
+}
+
+// Пишет файл с случайными пикселями и нулевым выравниванием строк
+static int makeImage(char *path, int width, int height, int bits, int top_down, unsigned char **data, size_t *size)
+{
+    size_t stride = ((size_t)width * bits / 8 + 3) & ~(size_t)3;
+    size_t offset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+    *size = offset + stride * height;
+    *data = calloc(*size, 1);
+    if (*data == NULL)
+    {
+        return 1;
+    }
+
+    BitmapFileHeader bmfh = {0x4d42, (unsigned int)*size, 0, 0, (unsigned int)offset};
+    BitmapInfoHeader bmih = {sizeof(BitmapInfoHeader), width, top_down ? -height : height, 1, bits, BI_RGB,
+                             (unsigned int)(stride * height), 2835, 2835, 0, 0};
+    memcpy(*data, &bmfh, sizeof(bmfh));
+    memcpy(*data + sizeof(bmfh), &bmih, sizeof(bmih));
+    for (int y = 0; y < height; y++)
+    {
+        unsigned char *row = *data + offset + stride * y;
+        for (size_t x = 0; x < (size_t)width * bits / 8; x++)
+        {
+            row[x] = rand();
+        }
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        return 1;
+    }
+    fwrite(*data, 1, *size, f);
+    return fclose(f) != 0;
+}
+
+static int compareFile(char *path, unsigned char *data, size_t size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        return 1;
+    }
+    unsigned char *got = malloc(size + 1);
+    size_t n = got != NULL ? fread(got, 1, size + 1, f) : 0;
+    fclose(f);
+    int failed = got == NULL || n != size || memcmp(got, data, size) != 0;
+    free(got);
+    return failed;
+}
+
+static int roundTrip(int width, int height, int bits, int top_down)
+{
+    char input[64], output[64];
+    snprintf(input, sizeof(input), "/tmp/bmp_roundtrip_%d_in.bmp", (int)getpid());
+    snprintf(output, sizeof(output), "/tmp/bmp_roundtrip_%d_out.bmp", (int)getpid());
+
+    unsigned char *data = NULL;
+    size_t size = 0;
+    Counter counter = {0, 0, 0};
+    BmpAllocator allocator = {countingAlloc, countingFree, &counter};
+    int failed = makeImage(input, width, height, bits, top_down, &data, &size);
+    if (!failed)
+    {
+        BMP bmp;
+        initBMP(&bmp, &allocator);
+        failed = readBMP(input, &bmp) != 0 || writeBMP(output, &bmp) != 0;
+        if (failed)
+        {
+            fprintf(stderr, "%s\n", lastError());
+        }
+        freeBMP(&bmp);
+        failed = failed || compareFile(output, data, size);
+    }
+    failed = failed || counter.allocs == 0 || counter.frees != counter.allocs || counter.misaligned != 0;
+
+    printf("%s: %dx%d, %d bit%s (allocs %d, frees %d)\n", failed ? "FAIL" : "ok", width, height, bits,
+           top_down ? ", top-down" : "", counter.allocs, counter.frees);
+    free(data);
+    unlink(input);
+    unlink(output);
+    return failed;
+}
+
+int main()
+{
+    int failed = 0;
+    failed += roundTrip(1, 1, 24, 0);
+    failed += roundTrip(5, 3, 24, 0);
+    failed += roundTrip(17, 9, 24, 1);
+    failed += roundTrip(1001, 40, 24, 0);
+    failed += roundTrip(7, 5, 32, 0);
+    failed += roundTrip(33, 12, 32, 1);
+    return failed != 0;
+}
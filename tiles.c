@@ -0,0 +1,219 @@
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Сколько векторов отдаётся одному вызову writev
+#define TILE_IOV_COUNT 512
+
+// Прямоугольник тайла в координатах от левого верхнего угла изображения
+typedef struct TileRect
+{
+    int row;
+    int column;
+    int x;
+    int y;
+    int width;
+    int height;
+} TileRect;
+
+typedef struct TileJob
+{
+    BMP *source;
+    char *output_dir;
+    TileRect *rects;
+    int *codes;
+} TileJob;
+
+// Записывает все векторы, продолжая после частичной записи
+static int writeVectors(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Тайл пишется прямо из строк исходного буфера (или отображения файла):
+// заголовки, затем куски строк и нули выравнивания одной цепочкой writev
+static void writeTile(void *arg, int index)
+{
+    static const unsigned char zeros[4] = {0, 0, 0, 0};
+    TileJob *job = arg;
+    BMP *source = job->source;
+    TileRect *rect = &job->rects[index];
+
+    // формат и дополнительные байты заголовка те же, меняются только размеры
+    BMP tile = *source;
+    tile.bmih.width = rect->width;
+    tile.bmih.height = rect->height;
+    tile.stride = rowStride(rect->width, source->pixel_bytes);
+    size_t offset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + source->header_extra_size;
+    tile.bmfh.pixelArrOffset = offset;
+    tile.bmfh.filesize = offset + tile.stride * rect->height;
+    tile.bmih.imageSize = tile.stride * rect->height;
+    BitmapInfoHeader info = fileInfoHeader(&tile);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/tile_%d_%d.bmp", job->output_dir, rect->row, rect->column);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        job->codes[index] = setError(FILE_WRITE_ERROR, "Error: file writing error");
+        return;
+    }
+
+    struct iovec iov[TILE_IOV_COUNT];
+    int count = 0;
+    iov[count++] = (struct iovec){&tile.bmfh, sizeof(BitmapFileHeader)};
+    iov[count++] = (struct iovec){&info, sizeof(BitmapInfoHeader)};
+    if (source->header_extra_size > 0)
+    {
+        iov[count++] = (struct iovec){source->header_extra, source->header_extra_size};
+    }
+
+    size_t row_bytes = (size_t)rect->width * source->pixel_bytes;
+    size_t padding = tile.stride - row_bytes;
+    // нижняя строка тайла в номерах строк изображения (снизу вверх)
+    int bottom = source->bmih.height - rect->y - rect->height;
+    int failed = 0;
+    for (int i = 0; i < rect->height && !failed; i++)
+    {
+        // строки тайла идут в том же порядке, что и в исходном файле
+        int y = source->top_down ? bottom + rect->height - 1 - i : bottom + i;
+        iov[count++] = (struct iovec){(unsigned char *)getRow(source, y) + (size_t)rect->x * source->pixel_bytes, row_bytes};
+        if (padding)
+        {
+            iov[count++] = (struct iovec){(void *)zeros, padding};
+        }
+        if (count > TILE_IOV_COUNT - 2)
+        {
+            failed = writeVectors(fd, iov, count) != 0;
+            count = 0;
+        }
+    }
+    if (!failed && count > 0)
+    {
+        failed = writeVectors(fd, iov, count) != 0;
+    }
+    if (close(fd) != 0 || failed)
+    {
+        job->codes[index] = setError(FILE_WRITE_ERROR, "Error: file writing error");
+        return;
+    }
+    job->codes[index] = 0;
+}
+
+// Режет изображение на те же части, что и --split: number_x полос по высоте
+// и number_y по ширине (как в dividePicture), последняя часть забирает остаток.
+// Прямоугольники считаются один раз, тайлы пишутся параллельно на пуле потоков
+// из отображённого в память файла без промежуточных копий
+int exportTiles(char *input_file, char *output_dir, int number_x, int number_y, ThreadPool *pool)
+{
+    if (number_x < 1 || number_y < 1)
+    {
+        return setError(WRONG_ARGUMENTS_ERROR, "Error: --number_x and --number_y must be positive");
+    }
+
+    BMP source;
+    initBMP(&source, NULL);
+    // если файл нельзя отобразить (например, он короче заявленного), он читается целиком
+    int code = mapBMP(input_file, &source, 0);
+    if (code != 0)
+    {
+        code = readBMP(input_file, &source);
+    }
+    if (code == 0 && ((int)source.bmih.height < number_x || (int)source.bmih.width < number_y))
+    {
+        code = setError(WRONG_ARGUMENTS_ERROR, "Error: image is smaller than the number of tiles");
+    }
+    if (code == 0 && mkdir(output_dir, 0777) != 0 && errno != EEXIST)
+    {
+        code = setError(FILE_WRITE_ERROR, "Error: can not create output directory");
+    }
+
+    int count = number_x * number_y;
+    TileRect *rects = NULL;
+    int *codes = NULL;
+    if (code == 0)
+    {
+        rects = (TileRect *)malloc(sizeof(TileRect) * count);
+        codes = (int *)malloc(sizeof(int) * count);
+        if (rects == NULL || codes == NULL)
+        {
+            code = setError(MEMORY_ALLOCATION_ERROR, "Memory allocation error!");
+        }
+    }
+
+    if (code == 0)
+    {
+        int W = source.bmih.width;
+        int H = source.bmih.height;
+        for (int row = 0; row < number_x; row++)
+        {
+            for (int column = 0; column < number_y; column++)
+            {
+                TileRect *rect = &rects[row * number_y + column];
+                rect->row = row;
+                rect->column = column;
+                rect->x = column * (W / number_y);
+                rect->y = row * (H / number_x);
+                rect->width = column == number_y - 1 ? W - rect->x : W / number_y;
+                rect->height = row == number_x - 1 ? H - rect->y : H / number_x;
+            }
+        }
+
+        TileJob job = {&source, output_dir, rects, codes};
+        if (pool != NULL && pool->count > 1 && count > 1)
+        {
+            poolRun(pool, count, writeTile, &job);
+        }
+        else
+        {
+            for (int i = 0; i < count; i++)
+            {
+                writeTile(&job, i);
+            }
+        }
+        for (int i = 0; i < count && code == 0; i++)
+        {
+            code = codes[i];
+        }
+        if (code != 0)
+        {
+            // сообщение об ошибке осталось в потоке, который писал тайл
+            code = setError(code, "Error: file writing error");
+        }
+    }
+
+    free(rects);
+    free(codes);
+    freeBMP(&source);
+    return code;
+}